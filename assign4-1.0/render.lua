@@ -1,6 +1,8 @@
 local driver = require"driver"
 local image = require"image"
 local chronos = require"chronos"
+-- native winding kernels, used when primitive.so is available
+local kernels, primitive = pcall(require, "primitive")
 
 local solve = {}
 solve.quadratic = require"quadratic"
@@ -22,6 +24,12 @@ local FLT_MIN = 1.17549435E-38 -- smallest-magnitude normalized single-precision
 local TOL = 0.01 -- root-finding tolerance, in pixels
 local MAX_ITER = 30 -- maximum number of bisection iterations in root-finding
 local MAX_DEPTH = 8 -- maximum quadtree depth
+local BUDGET_DEPTH = 16 -- maximum quadtree depth under -budget
+local HEAT_TOP = 10 -- most expensive elements listed by -heatmap
+local LOD_AREA = 1 -- smallest box, in pixels, kept by -lod
+
+-- counters for the sample being taken, only while rendering a heatmap
+local cost = false
 
 local _M = driver.new()
 
@@ -328,20 +336,11 @@ function newmonotonizer(forward)
     end
     function monotonizer:rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2)
         if x0 ~= x2 or y0 ~= y2 then
-            function solve_extreme(b0, b1, b2, w, t)
-                local a = (w - 1)*(b0 - b2)
-                local b = b0 - 2*b0*w + 2*b1 - b2                   
-                local c = w*b0 - b1
-                local n, r1, s1, r2, s2 = solve.quadratic.quadratic(a, b, c)
-                if n == 0 then return end
-                local t1, t2 = r1/s1, r2/s2
-                if 0 < t1 and t1 < 1 then t[#t + 1] = t1 end
-                if 0 < t2 and t2 < 1 then t[#t + 1] = t2 end
-            end
-
-            local t = {0, 1}
-            solve_extreme(x0, x1, x2, w1, t)
-            solve_extreme(y0, y1, y2, w1, t)
+            -- extrema in x and in y, solved together
+            local t = solve.quadratic.unitroots({
+                (w1 - 1)*(x0 - x2), x0 - 2*x0*w1 + 2*x1 - x2, w1*x0 - x1,
+                (w1 - 1)*(y0 - y2), y0 - 2*y0*w1 + 2*y1 - y2, w1*y0 - y1
+            }, {0, 1})
 
             table.sort(t)
             for i = 2, #t do 
@@ -351,19 +350,13 @@ function newmonotonizer(forward)
     end
     function monotonizer:cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3)
         if x0 ~= x3 or y0 ~= y3 then
-            function solve_extreme(z0, z1, z2,z3, t)
-                local a = 3 * ( -z0 + 3*z1 - 3*z2 + z3 )
-                local b = 2 * ( 3*z0 - 6*z1 + 3*z2 )
-                local c = 3 * ( -z0 + z1 )
-                local n, r1, s1, r2, s2 = solve.quadratic.quadratic(a, b, c)
-                if n == 0 then return end
-                local t1, t2 = r1/s1, r2/s2
-                if 0 < t1 and t1 < 1 then t[#t + 1] = t1 end
-                if 0 < t2 and t2 < 1 then t[#t + 1] = t2 end
-            end
-            local t = {0,1}
-            solve_extreme(x0, x1, x2, x3, t)
-            solve_extreme(y0, y1, y2, y3, t)
+            -- extrema in x and in y, solved together
+            local t = solve.quadratic.unitroots({
+                3 * ( -x0 + 3*x1 - 3*x2 + x3 ), 2 * ( 3*x0 - 6*x1 + 3*x2 ),
+                3 * ( -x0 + x1 ),
+                3 * ( -y0 + 3*y1 - 3*y2 + y3 ), 2 * ( 3*y0 - 6*y1 + 3*y2 ),
+                3 * ( -y0 + y1 )
+            }, {0, 1})
             table.sort(t)
 
             for i = 2, #t do 
@@ -378,18 +371,61 @@ function newmonotonizer(forward)
     return monotonizer
 end
 
+-- replace curves by polylines that stay within tol pixels of them
+local function newflattener(tol, forward)
+    -- required only here, so the driver runs without flatten.so as long
+    -- as -flatten is not given
+    local flatten = require"flatten"
+    local flattener = {}
+    local vertices = {}
+    local function polyline(x0, y0, n)
+        for i = 1, 2*n, 2 do
+            local x1, y1 = vertices[i], vertices[i+1]
+            forward:linear_segment(x0, y0, x1, y1)
+            x0, y0 = x1, y1
+        end
+    end
+    function flattener:begin_closed_contour(len, x0, y0)
+        forward:begin_closed_contour(_, x0, y0)
+    end
+    flattener.begin_open_contour = flattener.begin_closed_contour
+    function flattener:linear_segment(x0, y0, x1, y1)
+        forward:linear_segment(x0, y0, x1, y1)
+    end
+    function flattener:quadratic_segment(x0, y0, x1, y1, x2, y2)
+        local _, n = flatten.quadratic(x0, y0, x1, y1, x2, y2, tol, vertices)
+        polyline(x0, y0, n)
+    end
+    function flattener:rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2)
+        local _, n = flatten.rational_quadratic(x0, y0, x1, y1, w1, x2, y2,
+            tol, vertices)
+        polyline(x0, y0, n)
+    end
+    function flattener:cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3)
+        local _, n = flatten.cubic(x0, y0, x1, y1, x2, y2, x3, y3, tol,
+            vertices)
+        polyline(x0, y0, n)
+    end
+    function flattener:end_closed_contour(len)
+        forward:end_closed_contour(_)
+    end
+    flattener.end_open_contour = flattener.end_closed_contour
+    return flattener
+end
+
 -- here is a function that returns a path transformed to
 -- pixel coordinates using the iterator trick I talked about
 -- you should chain your own implementation of monotonization!
 -- if you don't do that, your life will be *much* harder
-function transformpath(oldpath, xf)
+function transformpath(oldpath, xf, tol)
     local newpath = _M.path()
     newpath:open()
+    -- curves become polylines when a tolerance is given
+    local forward = newcleaner(newpath)
+    if tol then forward = newflattener(tol, forward) end
     oldpath:iterate(
-    newxformer(xf * oldpath.xf,
-    newmonotonizer(
-    newcleaner(
-    newpath))))
+        newxformer(xf * oldpath.xf,
+            newmonotonizer(forward)))
     newpath:close()
     return newpath
 end
@@ -443,20 +479,17 @@ function prepare.radialgradient(paint, xf)
     paint.T = m * (xf*paint.xf):inverse()
 end
 
--- prepare scene for sampling and return modified scene
-local function preparescene(scene)
-    -- implement
-    -- (feel free to use the transformpath function above)
-    for i, element in ipairs(scene.elements) do
-        prepare[element.paint.type](element.paint, scene.xf) 
-        element.shape = transformpath(element.shape, scene.xf)
-    end
-    scene.xf = _M.identity()
-    return scene
+-- circles, triangles, and polygons are kept as they are until the
+-- scene is prepared. then they become paths, so that the quadtree can
+-- clip them. when primitive.so is available, they also keep a native
+-- kernel to compute their winding numbers
+local topath = {}
+
+function topath.path(shape)
+    return shape
 end
 
--- override circle creation function and return a path instead
-function _M.circle(cx, cy, r)
+function topath.circle(shape)
     -- we start with a unit circle centered at the origin
     -- it is formed by 3 arcs covering each third of the unit circle
     local s = 0.5           -- sin(pi/6)
@@ -469,23 +502,20 @@ function _M.circle(cx, cy, r)
         _M.R,  c,  s,  w,  0,  1,
         _M.Z
         -- transform it to the circle with given center and radius
-    }:scale(r, r):translate(cx, cy)
+    }:scale(shape.r, shape.r):translate(shape.cx, shape.cy):transform(shape.xf)
 end
 
--- override triangle creation and return a path instead
-function _M.triangle(x1, y1, x2, y2, x3, y3)
-    -- implement
+function topath.triangle(shape)
     return _M.path{
-        _M.M, x1, y1,
-        _M.L, x2, y2,
-        _M.L, x3, y3,
+        _M.M, shape.x1, shape.y1,
+        _M.L, shape.x2, shape.y2,
+        _M.L, shape.x3, shape.y3,
         _M.Z
-    }
+    }:transform(shape.xf)
 end
 
--- override polygon creation and return a path instead
-function _M.polygon(data)
-    -- implement
+function topath.polygon(shape)
+    local data = shape.data
     local  content = { _M.M, data[1], data[2]}
     local j = 1
     for i = 3, #data, 2 do
@@ -496,16 +526,146 @@ function _M.polygon(data)
     end
     content[3*j+1] = _M.Z
 
-    return _M.path{unpack(content)}
+    return _M.path{unpack(content)}:transform(shape.xf)
+end
+
+-- kernels only take affine transformations
+local function isaffine(xf)
+    return xf[7] == 0 and xf[8] == 0 and xf[9] ~= 0
+end
+
+-- vertices of a shape in pixel coordinates. checkinside.linear skips
+-- crossings less than TOL to the right of a sample, which is the same
+-- as moving straight edges TOL to the left
+local function pixelvertices(xf, data)
+    local vertices = {}
+    for i = 1, #data, 2 do
+        local x, y, w = xf:apply(data[i], data[i+1])
+        vertices[i], vertices[i+1] = x/w - TOL, y/w
+    end
+    return vertices
+end
+
+-- each kernel comes with the most tests it makes for one sample,
+-- which is what sampling its element costs, however it was clipped.
+-- polygons build the crossings of each row once, and then only search
+-- them, so they count as one test
+local newkernel = {}
+
+function newkernel.circle(shape, xf)
+    local m = xf * _M.translate(shape.cx, shape.cy) *
+        _M.scale(shape.r, shape.r)
+    local w = m[9]
+    return primitive.ellipse(m[1]/w, m[2]/w, m[3]/w, m[4]/w, m[5]/w,
+        m[6]/w), 1
+end
+
+function newkernel.triangle(shape, xf)
+    return primitive.triangle(unpack(pixelvertices(xf, {
+        shape.x1, shape.y1, shape.x2, shape.y2, shape.x3, shape.y3 }))), 3
+end
+
+function newkernel.polygon(shape, xf)
+    return primitive.polygon(pixelvertices(xf, shape.data)), 1
+end
+
+-- grow box to contain the control points of a path under xf. each
+-- segment stays inside the hull of its control points, so the box
+-- contains the path without having to monotonize it first
+local function newhullboxer(xf, box)
+    local hullboxer = {}
+    local function grow(x, y, w)
+        x, y, w = xf:apply(x, y, w)
+        if w <= 0 then
+            -- not bounded by the hull, so leave nothing out
+            box[1], box[2] = -math.huge, -math.huge
+            box[3], box[4] = math.huge, math.huge
+        else
+            x, y = x/w, y/w
+            box[1], box[2] = min(box[1], x), min(box[2], y)
+            box[3], box[4] = max(box[3], x), max(box[4], y)
+        end
+    end
+    function hullboxer:begin_closed_contour(len, x0, y0)
+        grow(x0, y0, 1)
+    end
+    hullboxer.begin_open_contour = hullboxer.begin_closed_contour
+    function hullboxer:linear_segment(x0, y0, x1, y1)
+        grow(x1, y1, 1)
+    end
+    function hullboxer:quadratic_segment(x0, y0, x1, y1, x2, y2)
+        grow(x1, y1, 1)
+        grow(x2, y2, 1)
+    end
+    function hullboxer:rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2)
+        grow(x1, y1, w1)
+        grow(x2, y2, 1)
+    end
+    function hullboxer:cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3)
+        grow(x1, y1, 1)
+        grow(x2, y2, 1)
+        grow(x3, y3, 1)
+    end
+    function hullboxer:end_closed_contour(len)
+    end
+    hullboxer.end_open_contour = hullboxer.end_closed_contour
+    return hullboxer
+end
+
+-- returns a function that tells whether an element can be left out of
+-- a rendering of the viewport: either no pixel center falls inside its
+-- bounding box, so no sample would ever see it, or the box covers less
+-- than area pixels. only the latter changes the image. boxes are found
+-- before anything else is prepared, so what is left out costs little
+local function newculler(xf, viewport, area)
+    local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+    local width, height = vxmax-vxmin, vymax-vymin
+    return function(element)
+        local path = topath[element.shape.type](element.shape)
+        local box = { math.huge, math.huge, -math.huge, -math.huge }
+        path:iterate(newhullboxer(xf * path.xf, box))
+        local xmin, ymin, xmax, ymax = unpack(box, 1, 4)
+        local jmin = max(1, math.ceil(xmin-vxmin+.5))
+        local imin = max(1, math.ceil(ymin-vymin+.5))
+        local jmax = min(width, floor(xmax-vxmin+.5))
+        local imax = min(height, floor(ymax-vymin+.5))
+        return jmin > jmax or imin > imax or (xmax-xmin)*(ymax-ymin) < area
+    end
+end
+
+-- prepare scene for sampling and return modified scene
+-- with a tolerance, curves are flattened to within that many pixels
+-- with a culler, elements it tells apart are left out of the scene
+local function preparescene(scene, tolerance, cull)
+    -- implement
+    -- (feel free to use the transformpath function above)
+    if cull then
+        local kept = {}
+        for i, element in ipairs(scene.elements) do
+            if not cull(element) then kept[#kept+1] = element end
+        end
+        scene.elements = kept
+    end
+    for i, element in ipairs(scene.elements) do
+        prepare[element.paint.type](element.paint, scene.xf) 
+        local shape = element.shape
+        local xf = scene.xf * shape.xf
+        if kernels and newkernel[shape.type] and isaffine(xf) then
+            element.kernel, element.tests = newkernel[shape.type](shape, xf)
+        end
+        element.shape = transformpath(topath[shape.type](shape),
+            scene.xf, tolerance)
+    end
+    scene.xf = _M.identity()
+    return scene
 end
 
 -- verifies that there is nothing unsupported in the scene
--- note that we only support paths!
--- triangles, circles, and polygons were overriden
+-- note that we only support paths, and the shapes topath converts
 local function checkscene(scene)
     for i, element in ipairs(scene.elements) do
         assert(element.type == "fill" or element.type == "eofill")
-        assert(element.shape.type == "path", "unsuported primitive")
+        assert(topath[element.shape.type], "unsuported primitive")
         assert(element.paint.type == "solid" or
         element.paint.type == "lineargradient" or
         element.paint.type == "radialgradient" or
@@ -517,6 +677,7 @@ end
 local checkinside = {}
 
 function checkinside.linear(x0, y0, x1, y1, x, y)
+    if cost then cost.evaluations = cost.evaluations + 1 end
     local t = (y-y0)/(y1-y0)
     local u = lerp(x0,x1,t) - x
     if abs(u) < TOL then return 0 end
@@ -533,6 +694,10 @@ function checkinside.quadratic(x0, y0, x1, y1, x2, y2, x, y)
     if y0 <= y2 and (y < y0 or y2 <= y) then return 0 end
     if y0 >= y2 and (y >= y0 or y2 > y) then return 0 end
 
+    if cost then
+        cost.evaluations = cost.evaluations + 1
+        cost.solves = cost.solves + 1
+    end
     local t = bisectquadratic(y0 - y, y1 - y, y2 - y)
     local u = lerp2(x0, x1, x2, t, t) - x
     if y0 < y2 then 
@@ -547,6 +712,10 @@ function checkinside.cubic(x0, y0, x1, y1, x2, y2, x3, y3, x, y)
     if y0 <= y3 and (y < y0 or y3 <= y) then return 0 end
     if y0 >= y3 and (y >= y0 or y3 > y) then return 0 end
 
+    if cost then
+        cost.evaluations = cost.evaluations + 1
+        cost.solves = cost.solves + 1
+    end
     local t = bisectcubic(y0 - y, y1 - y, y2 - y, y3 - y)
     local u = lerp3(x0, x1, x2, x3, t, t) - x
     if y0 < y3 then 
@@ -560,6 +729,10 @@ end
 function checkinside.rational_quadratic(x0, y0, x1, y1, w1, x2, y2, x, y)
     if y0 <= y2 and (y < y0 or y2 <= y) then return 0 end
     if y0 >= y2 and (y >= y0 or y2 > y) then return 0 end
+    if cost then
+        cost.evaluations = cost.evaluations + 1
+        cost.solves = cost.solves + 1
+    end
     local t = bisectrationalquadratic(y0 - y, y1 - y*w1, w1, y2 - y)
     local u = lerp2(x0, x1, x2, t, t)/lerp2(1, w1, 1, t, t) - x
     if y0 < y2 then 
@@ -653,6 +826,7 @@ function getcolor.radialgradient(paint, x0, y0)
 end
 
 function getleaf(quadtree, xmin, ymin, xmax, ymax, x, y)
+    if cost then cost.depth = cost.depth + 1 end
     if not quadtree.children then return quadtree end
 
     local xm = 0.5*(xmin + xmax)
@@ -670,6 +844,77 @@ function getleaf(quadtree, xmin, ymin, xmax, ymax, x, y)
 end
 
 
+-- winding number of element shape at x,y
+local function winding(element, x, y)
+    if element.kernel then
+        -- each test evaluates one side, or the circle, at the sample
+        if cost then
+            cost.segments = cost.segments + element.tests
+            cost.evaluations = cost.evaluations + element.tests
+        end
+        return element.kernel:winding(x, y)
+    end
+    local data = element.shape.data
+    local px, py
+    local fx, fy
+    local ni = 0
+    local n = #element.shape.instructions
+    for j=1, n do
+        local o = element.shape.offsets[j]
+        local s = rvgcommand[element.shape.instructions[j]]
+        if s == "M" then
+            px, py = data[o+1], data[o+2]
+            fx, fy = px, py
+        elseif s == "Z" then
+            ni = ni + checkinside.linear(px, py, fx, fy, x, y)
+            fx, fy = px, py
+            if cost then cost.segments = cost.segments + 1 end
+        elseif s == "L" then
+            ni = ni + checkinside.linear(px, py, data[o+2], data[o+3], x, y)
+            px, py = data[o+2], data[o+3]
+            if cost then cost.segments = cost.segments + 1 end
+        elseif s == "Q" then
+            ni = ni + checkinside.quadratic(px, py, data[o+2], data[o+3],
+            data[o+4], data[o+5], x, y)
+            px, py = data[o+4], data[o+5]
+            if cost then cost.segments = cost.segments + 1 end
+        elseif s == "A" then
+            ni = ni + checkinside.rational_quadratic(px, py, data[o+2], data[o+3], 
+            data[o+4], data[o+5], data[o+6], x, y)
+            px, py = data[o+5], data[o+6]
+            if cost then cost.segments = cost.segments + 1 end
+        elseif s == "C" then
+            ni = ni + checkinside.cubic(px, py, data[o+2], data[o+3], 
+            data[o+4], data[o+5], data[o+6], data[o+7], x, y)
+            px, py = data[o+6], data[o+7]
+            if cost then cost.segments = cost.segments + 1 end
+        end
+    end
+    return ni
+end
+
+-- charge the segments and root solves of an inside test to the
+-- element of the input scene it came from
+local function charge(element, segments, solves)
+    local i = element.index
+    cost.elements = cost.elements + 1
+    cost.charged[i] = (cost.charged[i] or 0) +
+        (cost.segments - segments) + (cost.solves - solves)
+end
+
+local function inside(element, x, y)
+    local ni
+    if cost then
+        local segments, solves = cost.segments, cost.solves
+        ni = winding(element, x, y)
+        charge(element, segments, solves)
+    else
+        ni = winding(element, x, y)
+    end
+    return (element.type == "fill" and ni ~= 0) or
+        (element.type == "eofill" and ni % 2 ~= 0)
+end
+
 -- descend on quadtree, find leaf containing x,y, use leaf
 -- to evaluate the color, and finally return r,g,b,a
 local function sample(quadtree, xmin, ymin, xmax, ymax, x, y)
@@ -683,38 +928,7 @@ local function sample(quadtree, xmin, ymin, xmax, ymax, x, y)
     local scene = getleaf(quadtree, xmin, ymin, xmax, ymax, x, y)
 
     for i,element in ipairs(scene.elements) do
-        local data = element.shape.data
-        local px, py
-        local fx, fy
-        local ni = 0
-        local n = #element.shape.instructions
-        for j=1, n do
-            local o = element.shape.offsets[j]
-            local s = rvgcommand[element.shape.instructions[j]]
-            if s == "M" then
-                px, py = data[o+1], data[o+2]
-                fx, fy = px, py
-            elseif s == "Z" then
-                ni = ni + checkinside.linear(px, py, fx, fy, x, y)
-                fx, fy = px, py
-            elseif s == "L" then
-                ni = ni + checkinside.linear(px, py, data[o+2], data[o+3], x, y)
-                px, py = data[o+2], data[o+3]
-            elseif s == "Q" then
-                ni = ni + checkinside.quadratic(px, py, data[o+2], data[o+3],
-                data[o+4], data[o+5], x, y)
-                px, py = data[o+4], data[o+5]
-            elseif s == "A" then
-                ni = ni + checkinside.rational_quadratic(px, py, data[o+2], data[o+3], 
-                data[o+4], data[o+5], data[o+6], x, y)
-                px, py = data[o+5], data[o+6]
-            elseif s == "C" then
-                ni = ni + checkinside.cubic(px, py, data[o+2], data[o+3], 
-                data[o+4], data[o+5], data[o+6], data[o+7], x, y)
-                px, py = data[o+6], data[o+7]
-            end
-        end
-        if (element.type == "fill" and ni ~= 0) or (element.type == "eofill" and ni % 2 ~= 0) then
+        if inside(element, x, y) then
             r,g,b,a = getcolor[element.paint.type](element.paint, x, y)
             a = element.paint.opacity*a
             Cr = r*a + Cr*alpha*(1-a)
@@ -726,6 +940,33 @@ local function sample(quadtree, xmin, ymin, xmax, ymax, x, y)
     return Cr, Cg, Cb, alpha
 end
 
+-- same as sample, but visits the elements from the top down,
+-- accumulating color under what is already there.
+-- stops as soon as nothing else can show through
+local function samplefronttoback(quadtree, xmin, ymin, xmax, ymax, x, y)
+    local Cr, Cg, Cb = 0.0, 0.0, 0.0
+    local t = 1.0 -- transparency of what was accumulated so far
+
+    local r, g, b, a 
+    local scene = getleaf(quadtree, xmin, ymin, xmax, ymax, x, y)
+    local elements = scene.elements
+
+    for i = #elements, 1, -1 do
+        local element = elements[i]
+        if inside(element, x, y) then
+            r,g,b,a = getcolor[element.paint.type](element.paint, x, y)
+            a = element.paint.opacity*a*t
+            Cr = Cr + r*a
+            Cg = Cg + g*a
+            Cb = Cb + b*a
+            t = t - a
+            if t <= 0 then return Cr, Cg, Cb, 1.0 end
+        end
+    end
+    -- white background
+    return Cr + t, Cg + t, Cb + t, 1.0
+end
+
 -- this returns an iterator that prints the methods called
 -- and then forwards them on.
 -- very useful for debugging!
@@ -1014,6 +1255,10 @@ local function scenetoleaf(scene, xmin, ymin, xmax, ymax, c1, c2)
     for i,element in ipairs(newelements) do
         local obj = elements[element[2]]
         copied_elements[i] = _M[obj.type](element[1], obj.paint)
+        -- remember where it was in the input scene
+        copied_elements[i].index = obj.index or element[2]
+        copied_elements[i].kernel = obj.kernel
+        copied_elements[i].tests = obj.tests
     end
 
     return _M.scene(copied_elements)
@@ -1032,36 +1277,107 @@ local function checkaxi(x0, y0, x1, y1)
     return abs(x0 - x1) < TOL or abs(y0 - y1) < TOL
 end
 
-local function checkstop(scene, xmin, ymin, xmax, ymax)
+-- true if shape has only axis-aligned segments on the cell boundary
+local function onbound(shape, xmin, ymin, xmax, ymax)
     local px, py
+    local n = #shape.instructions
+    for j=1,n do
+        local o = shape.offsets[j]
+        local s = rvgcommand[shape.instructions[j]]
+        if s == "M" then
+            px = shape.data[o+1]
+            py = shape.data[o+2]
+            if not checkbound(px, py, xmin, ymin, xmax, ymax) then return false end
+        elseif s == "L" then
+            if not checkbound(shape.data[o+2], shape.data[o+3], xmin, ymin, xmax, ymax) or 
+                not checkaxi(px, py, shape.data[o+2], shape.data[o+3]) then
+                return false
+            end
+            px = shape.data[o+2]
+            py = shape.data[o+3]
+        elseif s == "Q" or s == "A" or s == "C" then
+            return false
+        end
+    end
+    return true
+end
+
+local function checkstop(scene, xmin, ymin, xmax, ymax)
     for i, element in ipairs(scene.elements) do
-        local shape = element.shape
-        local n = #shape.instructions
-        for j=1,n do
-            local o = shape.offsets[j]
-            local s = rvgcommand[shape.instructions[j]]
-            if s == "M" then
-                px = shape.data[o+1]
-                py = shape.data[o+2]
-                if not checkbound(px, py, xmin, ymin, xmax, ymax) then return false end
-            elseif s == "L" then
-                if not checkbound(shape.data[o+2], shape.data[o+3], xmin, ymin, xmax, ymax) or 
-                    not checkaxi(px, py, shape.data[o+2], shape.data[o+3]) then
-                    return false
-                end
-                px = shape.data[o+2]
-                py = shape.data[o+3]
-            elseif s == "Q" or s == "A" or s == "C" then
+        if not onbound(element.shape, xmin, ymin, xmax, ymax) then
+            return false
+        end
+    end
+    return true
+end
+
+-- true if segment runs along one of the cell edges
+local function onedge(x0, y0, x1, y1, xmin, ymin, xmax, ymax)
+    return (abs(x0-xmin) < TOL and abs(x1-xmin) < TOL) or
+        (abs(x0-xmax) < TOL and abs(x1-xmax) < TOL) or
+        (abs(y0-ymin) < TOL and abs(y1-ymin) < TOL) or
+        (abs(y0-ymax) < TOL and abs(y1-ymax) < TOL)
+end
+
+-- true if shape has only straight segments along the cell edges
+local function alongedges(shape, xmin, ymin, xmax, ymax)
+    local data = shape.data
+    local px, py
+    local fx, fy
+    local n = #shape.instructions
+    for j=1,n do
+        local o = shape.offsets[j]
+        local s = rvgcommand[shape.instructions[j]]
+        if s == "M" then
+            px, py = data[o+1], data[o+2]
+            fx, fy = px, py
+        elseif s == "Z" then
+            if not onedge(px, py, fx, fy, xmin, ymin, xmax, ymax) then
                 return false
             end
+        elseif s == "L" then
+            if not onedge(px, py, data[o+2], data[o+3],
+                xmin, ymin, xmax, ymax) then
+                return false
+            end
+            px, py = data[o+2], data[o+3]
+        elseif s == "Q" or s == "A" or s == "C" then
+            return false
         end
     end
     return true
 end
 
+-- drop everything below the topmost element that paints the
+-- whole cell with an opaque solid color. the clipped shape of
+-- such an element only runs along the cell edges, so the
+-- winding number at the center holds for the entire cell
+local function cullhidden(leaf, xmin, ymin, xmax, ymax)
+    local elements = leaf.elements
+    local xc, yc = 0.5*(xmin + xmax), 0.5*(ymin + ymax)
+    for i = #elements, 2, -1 do
+        local element = elements[i]
+        local paint = element.paint
+        if paint.type == "solid" and paint.opacity*paint.data[4] >= 1 and
+            alongedges(element.shape, xmin, ymin, xmax, ymax) and
+            inside(element, xc, yc) then
+            local n = #elements
+            for j = i, n do
+                elements[j-i+1] = elements[j]
+            end
+            for j = n-i+2, n do
+                elements[j] = nil
+            end
+            return leaf
+        end
+    end
+    return leaf
+end
+
 -- recursively subdivides leaf to create the quadtree
 function subdividescene(leaf, xmin, ymin, xmax, ymax, maxdepth, depth)
     depth = depth or 1
+    cullhidden(leaf, xmin, ymin, xmax, ymax)
     if depth >= maxdepth or checkstop(leaf, xmin, ymin, xmax, ymax) then  return leaf end
     local xm = 0.5*(xmin + xmax)
     local ym = 0.5*(ymin + ymax)
@@ -1074,6 +1390,133 @@ function subdividescene(leaf, xmin, ymin, xmax, ymax, maxdepth, depth)
     return leaf
 end
 
+-- relative cost of testing a sample against each kind of segment.
+-- curves pay for the bisection that finds their crossing
+local SEGMENT_COST = { L = 1, Z = 1, Q = 4, A = 6, C = 6 }
+-- cost, in linear segment tests, of clipping a segment into a child
+-- and keeping it there
+local SPLIT_COST = 16
+
+-- number of pixel centers of the viewport inside the cell
+local function cellsamples(viewport, xmin, ymin, xmax, ymax)
+    local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+    local function count(lo, hi)
+        return max(0, math.ceil(hi-.5) - math.ceil(lo-.5))
+    end
+    return count(max(xmin, vxmin), min(xmax, vxmax)) *
+        count(max(ymin, vymin), min(ymax, vymax))
+end
+
+-- a leaf with its cell, the number of segments it keeps, and the
+-- estimated cost of sampling it
+local function newcell(leaf, xmin, ymin, xmax, ymax, depth, viewport)
+    cullhidden(leaf, xmin, ymin, xmax, ymax)
+    local segments, weight = 0, 0
+    for i, element in ipairs(leaf.elements) do
+        local w = 0
+        for j, instruction in ipairs(element.shape.instructions) do
+            local s = rvgcommand[instruction]
+            if s ~= "M" then
+                segments = segments + 1
+                w = w + SEGMENT_COST[s]
+            end
+        end
+        -- clipping does not make kernels any cheaper to sample
+        weight = weight + (element.kernel and element.tests or w)
+    end
+    return { leaf = leaf, xmin = xmin, ymin = ymin, xmax = xmax,
+        ymax = ymax, depth = depth, segments = segments,
+        cost = weight*cellsamples(viewport, xmin, ymin, xmax, ymax) }
+end
+
+-- max-heap of cells by priority
+local function pushcell(heap, cell)
+    local k = #heap+1
+    heap[k] = cell
+    while k > 1 and heap[floor(k/2)].priority < cell.priority do
+        heap[k] = heap[floor(k/2)]
+        k = floor(k/2)
+        heap[k] = cell
+    end
+end
+
+local function popcell(heap)
+    local top, n = heap[1], #heap
+    local cell = heap[n]
+    heap[n] = nil
+    n = n - 1
+    local k = 1
+    while 2*k <= n do
+        local c = 2*k
+        if c < n and heap[c+1].priority > heap[c].priority then c = c + 1 end
+        if heap[c].priority <= cell.priority then break end
+        heap[k] = heap[c]
+        k = c
+    end
+    if n > 0 then heap[k] = cell end
+    return top
+end
+
+-- clip cell into its four children, and queue it if splitting saves
+-- more sampling than the clipping costs. cells that save the most for
+-- each segment they add to the tree come out first
+local function queuecell(heap, cell, viewport, maxdepth)
+    local leaf, xmin, ymin, xmax, ymax =
+        cell.leaf, cell.xmin, cell.ymin, cell.xmax, cell.ymax
+    if cell.depth >= maxdepth or cell.cost <= 0 or
+        checkstop(leaf, xmin, ymin, xmax, ymax) then
+        return
+    end
+    local xm = 0.5*(xmin + xmax)
+    local ym = 0.5*(ymin + ymax)
+    local depth = cell.depth + 1
+    local children = {
+        newcell(scenetoleaf(leaf, xmin, ymin, xm, ym, 't', 'r'),
+            xmin, ymin, xm, ym, depth, viewport), --bl
+        newcell(scenetoleaf(leaf, xm, ymin, xmax, ym, 't', 'l'),
+            xm, ymin, xmax, ym, depth, viewport), --br
+        newcell(scenetoleaf(leaf, xmin, ym, xm, ymax, 'b', 'r'),
+            xmin, ym, xm, ymax, depth, viewport), --tl
+        newcell(scenetoleaf(leaf, xm, ym, xmax, ymax, 'b', 'l'),
+            xm, ym, xmax, ymax, depth, viewport), --tr
+    }
+    local segments, cost = 0, 0
+    for i, child in ipairs(children) do
+        segments = segments + child.segments
+        cost = cost + child.cost
+    end
+    local saved = cell.cost - cost - SPLIT_COST*segments
+    if saved <= 0 then return end
+    cell.children = children
+    cell.added = segments - cell.segments
+    cell.priority = saved/max(1, cell.added)
+    pushcell(heap, cell)
+end
+
+-- builds the quadtree by splitting cells in order of how much they
+-- save, until no split pays for itself or the leaves would keep more
+-- than budget segments
+local function budgetscene(leaf, xmin, ymin, xmax, ymax, viewport, budget,
+    maxdepth)
+    local root = newcell(leaf, xmin, ymin, xmax, ymax, 1, viewport)
+    local stored = root.segments
+    local heap = {}
+    queuecell(heap, root, viewport, maxdepth)
+    while #heap > 0 do
+        local cell = popcell(heap)
+        if stored + cell.added <= budget then
+            stored = stored + cell.added
+            cell.leaf.children = {}
+            for i, child in ipairs(cell.children) do
+                cell.leaf.children[i] = child.leaf
+                queuecell(heap, child, viewport, maxdepth)
+            end
+        end
+        cell.children = nil
+    end
+    return root.leaf, stored
+end
+
 -- return smallest power of 2 larger than n
 local function power2(n)
     n = floor(n)
@@ -1102,6 +1545,9 @@ end
 -- load your own svg driver here and use it for debugging!
 local svg = dofile"assign/svg.lua"
 
+-- file this driver was loaded from, for the threads of -threads
+local DRIVER = debug.getinfo(1, "S").source:match("^@(.*)$")
+
 local function newstroke(x1, y1, x2, y2, t, w)
     if t == 'h' then
         return _M.fill(_M.path{
@@ -1122,45 +1568,308 @@ local function newstroke(x1, y1, x2, y2, t, w)
     end
 end
 
--- append lines marking the tree bounding box to the scene
-local function appendbox(xmin, ymin, xmax, ymax, scene)
-    -- implement
-    local elements = scene.elements
-    elements[#elements + 1] = newstroke(xmin, ymin, xmax, ymin, 'h', 0.5)
-    elements[#elements + 1] = newstroke(xmin, ymax, xmax, ymax, 'h', 0.5)
-    elements[#elements + 1] = newstroke(xmin, ymin, xmin, ymax, 'v', 0.5)
-    elements[#elements + 1] = newstroke(xmax, ymin, xmax, ymax, 'v', 0.5)
+-- emit lines marking the tree bounding box
+local function emitbox(xmin, ymin, xmax, ymax, emit)
+    emit(newstroke(xmin, ymin, xmax, ymin, 'h', 0.5))
+    emit(newstroke(xmin, ymax, xmax, ymax, 'h', 0.5))
+    emit(newstroke(xmin, ymin, xmin, ymax, 'v', 0.5))
+    emit(newstroke(xmax, ymin, xmax, ymax, 'v', 0.5))
 end
 
--- recursively append the lines marking cell divisions to the scene
-local function appendtree(quadtree, xmin, ymin, xmax, ymax, scene)
-    -- implement
+-- recursively emit the lines marking cell divisions
+local function emittree(quadtree, xmin, ymin, xmax, ymax, emit)
     if not quadtree.children then return end
 
     local xm = 0.5*(xmax+xmin)
     local ym = 0.5*(ymax+ymin)
 
-    local elements = scene.elements
-    elements[#elements + 1] = newstroke(xmin, ym, xmax, ym, 'h', 0.5)
-    elements[#elements + 1] = newstroke(xm, ymin, xm, ymax, 'v', 0.5)
+    emit(newstroke(xmin, ym, xmax, ym, 'h', 0.5))
+    emit(newstroke(xm, ymin, xm, ymax, 'v', 0.5))
 
-    appendtree(quadtree.children[1], xmin, ymin, xm, ym, scene)
-    appendtree(quadtree.children[2], xm, ymin, xmax, ym, scene)
-    appendtree(quadtree.children[3], xmin, ym, xm, ymax, scene)
-    appendtree(quadtree.children[4], xm, ym, xmax, ymax, scene)
+    emittree(quadtree.children[1], xmin, ymin, xm, ym, emit)
+    emittree(quadtree.children[2], xm, ymin, xmax, ym, emit)
+    emittree(quadtree.children[3], xmin, ym, xm, ymax, emit)
+    emittree(quadtree.children[4], xm, ym, xmax, ymax, emit)
 end
 
+-- the lines go straight to the output as the tree is walked, so
+-- they never pile up in the scene, however deep the tree is
 local function dumpscenetree(quadtree, xmin, ymin, xmax, ymax,
     scene, viewport, output)
-    appendbox(xmin, ymin, xmax, ymax, scene)
-    appendtree(quadtree, xmin, ymin, xmax, ymax, scene)
     -- use your svg driver to dump contents to an SVG file
-    svg.render(scene, viewport, output)
+    svg.render(scene, viewport, output, function(emit)
+        emitbox(xmin, ymin, xmax, ymax, emit)
+        emittree(quadtree, xmin, ymin, xmax, ymax, emit)
+    end)
+end
+
+-- what is counted for each sample, in the order the summary lists it
+--   depth: quadtree nodes visited by getleaf, including the leaf
+--   elements: elements tested for inside
+--   segments: segments tested for crossings
+--   evaluations: segment positions evaluated at the sample height
+--   solves: roots found by bisection
+local HEAT_METRICS = { "depth", "elements", "segments", "evaluations", "solves" }
+
+local function newcost()
+    local cost = { charged = {} }
+    for i, metric in ipairs(HEAT_METRICS) do
+        cost[metric] = 0
+    end
+    return cost
+end
+
+-- per pixel counts of each metric
+local function newheat(width, height)
+    local heat = { width = width, height = height }
+    for i, metric in ipairs(HEAT_METRICS) do
+        heat[metric] = {}
+    end
+    -- move the counters of the sample just taken to pixel j, i
+    function heat:record(j, i)
+        local k = (i-1)*width+j
+        for l, metric in ipairs(HEAT_METRICS) do
+            self[metric][k] = cost[metric]
+            cost[metric] = 0
+        end
+    end
+    return heat
+end
+
+-- black, purple, red, yellow, white
+local HEAT_RAMP = {
+    { 0, 0, 0 }, { .4, 0, .6 }, { .9, .1, .1 }, { 1, .8, 0 }, { 1, 1, 1 }
+}
+
+local function heatcolor(t)
+    local n = #HEAT_RAMP-1
+    local k = min(floor(t*n), n-1)
+    local a = t*n-k
+    local c0, c1 = HEAT_RAMP[k+1], HEAT_RAMP[k+2]
+    return lerp(c0[1], c1[1], a), lerp(c0[2], c1[2], a),
+        lerp(c0[3], c1[3], a), 1
+end
+
+-- false color png of one metric. colors follow log(1+count), so that
+-- a few very expensive pixels do not wash out everything else
+local function storeheatmap(heat, metric, name)
+    local counts = heat[metric]
+    local most = 0
+    for k = 1, heat.width*heat.height do
+        most = max(most, counts[k])
+    end
+    local scale = most > 0 and 1/math.log(1+most) or 0
+    local heatimage = image.image(heat.width, heat.height, "unorm8")
+    for i = 1, heat.height do
+        for j = 1, heat.width do
+            local c = counts[(i-1)*heat.width+j]
+            heatimage:set(j, i, heatcolor(math.log(1+c)*scale))
+        end
+    end
+    local file = assert(io.open(name, "wb"))
+    image.png.store8(file, heatimage)
+    file:close()
+end
+
+-- number of segments in a shape, as winding tests them
+local function countsegments(shape)
+    local n = 0
+    for j, instruction in ipairs(shape.instructions) do
+        local s = rvgcommand[instruction]
+        if s ~= "M" then n = n + 1 end
+    end
+    return n
+end
+
+-- call leaf(leaf, depth) for each leaf of the quadtree
+local function eachleaf(quadtree, leaf, depth)
+    depth = depth or 1
+    if not quadtree.children then return leaf(quadtree, depth) end
+    for i = 1, 4 do
+        eachleaf(quadtree.children[i], leaf, depth+1)
+    end
+end
+
+-- print totals per metric, the elements that cost the most, and
+-- how segments are spread over the leaves of the quadtree
+local function summarizeheat(heat, charged, quadtree)
+    local npixels = heat.width*heat.height
+    stderr("%-12s %12s %10s %8s\n", "per sample", "total", "mean", "max")
+    for l, metric in ipairs(HEAT_METRICS) do
+        local counts, total, most = heat[metric], 0, 0
+        for k = 1, npixels do
+            total = total + counts[k]
+            most = max(most, counts[k])
+        end
+        stderr("%-12s %12d %10.2f %8d\n", metric, total, total/npixels, most)
+    end
+    -- segments tested plus roots solved, per input element
+    local ranked = {}
+    for i, c in pairs(charged) do
+        ranked[#ranked+1] = i
+    end
+    table.sort(ranked, function(a, b)
+        if charged[a] ~= charged[b] then return charged[a] > charged[b] end
+        return a < b
+    end)
+    stderr("most expensive elements (segments tested + roots solved):\n")
+    for k = 1, min(HEAT_TOP, #ranked) do
+        stderr("  element %d: %d\n", ranked[k], charged[ranked[k]])
+    end
+    -- leaves binned by segment count, 0, 1, 2-3, 4-7, ...
+    local bins, depths, nleaves, maxdepth = {}, {}, 0, 1
+    eachleaf(quadtree, function(leaf, depth)
+        local n = 0
+        for i, element in ipairs(leaf.elements) do
+            n = n + countsegments(element.shape)
+        end
+        local b = 0
+        while 2^b <= n do b = b + 1 end
+        bins[b] = (bins[b] or 0) + 1
+        local d = depths[depth] or { 0, 0 }
+        d[1], d[2] = d[1] + 1, d[2] + n
+        depths[depth] = d
+        nleaves = nleaves + 1
+        maxdepth = max(maxdepth, depth)
+    end)
+    stderr("leaves by segment count:\n")
+    local nbins = 0
+    for b in pairs(bins) do nbins = max(nbins, b) end
+    for b = 0, nbins do
+        local lo, hi = b > 0 and 2^(b-1) or 0, b > 0 and 2^b-1 or 0
+        local range = lo == hi and string.format("%d", lo) or
+            string.format("%d-%d", lo, hi)
+        stderr("  %12s %8d %6.1f%%\n", range, bins[b] or 0,
+            100*(bins[b] or 0)/nleaves)
+    end
+    stderr("leaves by depth (mean segments):\n")
+    for depth = 1, maxdepth do
+        local d = depths[depth] or { 0, 0 }
+        stderr("  %12d %8d %8.1f\n", depth, d[1],
+            d[1] > 0 and d[2]/d[1] or 0)
+    end
+end
+
+-- write a deep zoom image (DZI) pyramid, one tile at a time
+-- level maxlevel has full resolution, and each level below halves it
+-- pixels in coarser levels are point-sampled from the full resolution
+-- scene at the center of the area they cover, so no level ever needs
+-- more than a single tile worth of memory
+local function rendertiles(sample, viewport, output, name, tilesize)
+    local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+    local width, height = vxmax-vxmin, vymax-vymin
+    local maxlevel = 0
+    while 2^maxlevel < max(width, height) do maxlevel = maxlevel + 1 end
+    local dir = name .. "_files"
+    os.execute(string.format('mkdir "%s"', dir))
+    -- reuse tile images of the same dimensions
+    local images = {}
+    local function tileimage(w, h)
+        local key = w .. "x" .. h
+        local img = images[key]
+        if not img then
+            img = image.image(w, h, "unorm8")
+            images[key] = img
+        end
+        return img
+    end
+    local ntiles, done = 0, 0
+    for level = 0, maxlevel do
+        local s = 2^(maxlevel-level)
+        local lw, lh = math.ceil(width/s), math.ceil(height/s)
+        ntiles = ntiles + math.ceil(lw/tilesize)*math.ceil(lh/tilesize)
+    end
+    for level = maxlevel, 0, -1 do
+        local s = 2^(maxlevel-level)
+        local lw, lh = math.ceil(width/s), math.ceil(height/s)
+        os.execute(string.format('mkdir "%s/%d"', dir, level))
+        for row = 0, math.ceil(lh/tilesize)-1 do
+            for col = 0, math.ceil(lw/tilesize)-1 do
+                stderr("\r%d%%", floor(1000*done/ntiles)/10)
+                local x0, y0 = col*tilesize, row*tilesize
+                local tw = min(tilesize, lw-x0)
+                local th = min(tilesize, lh-y0)
+                local tile = tileimage(tw, th)
+                -- tile rows go top-down, image rows bottom-up
+                for i = 1, th do
+                    local y = max(vymax-(y0+th-i+.5)*s, vymin+.5)
+                    for j = 1, tw do
+                        local x = min(vxmin+(x0+j-.5)*s, vxmax-.5)
+                        tile:set(j, i, sample(x, y))
+                    end
+                end
+                local file = assert(io.open(string.format("%s/%d/%d_%d.png",
+                    dir, level, col, row), "wb"))
+                image.png.store8(file, tile)
+                file:close()
+                done = done + 1
+            end
+        end
+    end
+    stderr("\r100%%\n")
+    output:write(string.format([[
+<?xml version="1.0" encoding="UTF-8"?>
+<Image xmlns="http://schemas.microsoft.com/deepzoom/2008"
+  Format="png" Overlap="0" TileSize="%d">
+  <Size Width="%d" Height="%d"/>
+</Image>
+]], tilesize, width, height))
+    return ntiles
+end
+
+-- quadtree of a prepared scene over the viewport, and its bounds. with
+-- a budget, also returns the number of segments kept in the leaves
+local function buildquadtree(scene, viewport, maxdepth, budget)
+    local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+    local qxmin, qymin, qxmax, qymax =
+    adjustviewport(vxmin, vymin, vxmax, vymax)
+    if budget then
+        -- split where it pays, keeping at most budget segments
+        local quadtree, stored = budgetscene(
+        scenetoleaf(scene, vxmin, vymin, vxmax, vymax),
+        qxmin, qymin, qxmax, qymax, viewport, budget,
+        maxdepth or BUDGET_DEPTH)
+        return quadtree, qxmin, qymin, qxmax, qymax, stored
+    else
+        local quadtree = subdividescene(
+        scenetoleaf(scene, vxmin, vymin, vxmax, vymax),
+        qxmin, qymin, qxmax, qymax, maxdepth or MAX_DEPTH)
+        return quadtree, qxmin, qymin, qxmax, qymax
+    end
+end
+
+-- used by bands.lua in each of the threads of -threads. options holds
+-- the render options that change how the scene is prepared and sampled
+function _M.rows(scene, viewport, options)
+    local sample = options.fronttoback and samplefronttoback or sample
+    local cull = options.lod and
+        newculler(scene.xf, viewport, options.lod)
+    scene = preparescene(scene, options.tolerance, cull)
+    local quadtree, qxmin, qymin, qxmax, qymax =
+        buildquadtree(scene, viewport, options.maxdepth, options.budget)
+    local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+    return function(i, rowimage, ii)
+        for j = 1, vxmax-vxmin do
+            local x, y = vxmin+j-.5, vymin+i-.5
+            local r, g, b, a = sample(quadtree,
+            qxmin, qymin, qxmax, qymax, x, y)
+            rowimage:set(j, ii, r, g, b, a)
+        end
+    end
 end
 
 function _M.render(scene, viewport, output, arguments)
-    local maxdepth = MAX_DEPTH
+    local maxdepth = false
+    local budget = false
     local scenetree = false
+    local tiles, tilesize = nil, 256
+    local stream = false
+    local encoder = image.png
+    local fronttoback = false
+    local tolerance = false
+    local heatmap, heatmetric = false, "segments"
+    local threads = 1
+    local lod = false
     -- dump arguments
     if #arguments > 0 then stderr("driver arguments:\n") end
     for i, argument in ipairs(arguments) do
@@ -1177,11 +1886,90 @@ function _M.render(scene, viewport, output, arguments)
             maxdepth = math.floor(n)
             return true
         end },
+        { "^(%-budget:(%d+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "invalid option " .. all)
+            n = assert(tonumber(n), "invalid option " .. all)
+            assert(n >= 1, "invalid option " .. all)
+            budget = math.floor(n)
+            return true
+        end },
         { "^%-scenetree$", function(d)
             if not d then return false end
             scenetree = true
             return true
         end },
+        { "^%-stream$", function(d)
+            if not d then return false end
+            stream = true
+            return true
+        end },
+        { "^(%-format:(.+))$", function(all, name)
+            if not name then return false end
+            -- formats that can store and stream 8-bit rgba
+            assert(name == "png" or name == "pam" or name == "ppm" or
+                name == "qoi", "invalid option " .. all)
+            encoder = image[name]
+            return true
+        end },
+        { "^%-fronttoback$", function(d)
+            if not d then return false end
+            fronttoback = true
+            return true
+        end },
+        { "^(%-flatten:(.+))$", function(all, n)
+            if not n then return false end
+            tolerance = assert(tonumber(n), "invalid option " .. all)
+            assert(tolerance > 0, "invalid option " .. all)
+            return true
+        end },
+        { "^(%-heatmap:(.+))$", function(all, name)
+            if not name then return false end
+            heatmap = name
+            return true
+        end },
+        { "^(%-heatmetric:(.+))$", function(all, name)
+            if not name then return false end
+            local known = false
+            for i, metric in ipairs(HEAT_METRICS) do
+                known = known or metric == name
+            end
+            assert(known, "invalid option " .. all)
+            heatmetric = name
+            return true
+        end },
+        { "^(%-tiles:(.+))$", function(all, n)
+            if not n then return false end
+            tiles = n
+            return true
+        end },
+        { "^(%-tilesize:(%d+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "invalid option " .. all)
+            n = assert(tonumber(n), "invalid option " .. all)
+            assert(n >= 1, "invalid option " .. all)
+            tilesize = math.floor(n)
+            return true
+        end },
+        -- -lod:0 only leaves out what no pixel center would see
+        { "^(%-lod(.*))$", function(all, e)
+            if not e then return false end
+            lod = LOD_AREA
+            if e ~= "" then
+                lod = assert(tonumber(e:match("^:(.+)$")),
+                    "invalid option " .. all)
+                assert(lod >= 0, "invalid option " .. all)
+            end
+            return true
+        end },
+        { "^(%-threads:(%d+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "invalid option " .. all)
+            n = assert(tonumber(n), "invalid option " .. all)
+            assert(n >= 1, "invalid option " .. all)
+            threads = math.floor(n)
+            return true
+        end },
         { ".*", function(all)
             error("unrecognized option " .. all)
         end }
@@ -1194,23 +1982,52 @@ function _M.render(scene, viewport, output, arguments)
             end
         end
     end
+    assert(not (heatmap and tiles), "-heatmap does not work with -tiles")
+    assert(threads == 1 or not (scenetree or tiles or stream or heatmap),
+        "-threads only works when rendering the whole image at once")
+    -- coarser tile levels sample between pixel centers
+    assert(not (lod and tiles), "-lod does not work with -tiles")
+    -- composite from the top element down if asked to
+    local sample = fronttoback and samplefronttoback or sample
     -- create timer
     local time = chronos.chronos()
     -- make sure scene does not contain any unsuported content
     checkscene(scene)
+    if threads > 1 then
+        -- each thread prepares its own copy of the scene, and images
+        -- cannot be copied into other threads
+        for i, element in ipairs(scene.elements) do
+            assert(element.paint.type ~= "texture",
+                "-threads does not support textures")
+        end
+        local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+        local outputimage = image.image(vxmax-vxmin, vymax-vymin, "unorm8")
+        require"bands".render(threads, DRIVER, outputimage, scene, viewport,
+            { fronttoback = fronttoback, tolerance = tolerance,
+              maxdepth = maxdepth, budget = budget, lod = lod })
+        stderr("rendering with %d threads in %.3fs\n", threads,
+            time:elapsed())
+        time:reset()
+        encoder.store8(output, outputimage)
+        stderr("saved in %.3fs\n", time:elapsed())
+        return
+    end
     -- prepare scene for rendering
-    scene = preparescene(scene)
+    local total = #scene.elements
+    local cull = lod and newculler(scene.xf, viewport, lod)
+    scene = preparescene(scene, tolerance, cull)
+    if cull then
+        stderr("%d of %d elements culled\n", total-#scene.elements, total)
+    end
     -- get viewport
     local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
     -- get image width and height from viewport
     local width, height = vxmax-vxmin, vymax-vymin
-    -- build quadtree for scene
-    local qxmin, qymin, qxmax, qymax =
-    adjustviewport(vxmin, vymin, vxmax, vymax)
     stderr("preparescene in %.3fs\n", time:elapsed())
-    local quadtree = subdividescene(
-    scenetoleaf(scene, vxmin, vymin, vxmax, vymax),
-    qxmin, qymin, qxmax, qymax, maxdepth)
+    -- build quadtree for scene
+    local quadtree, qxmin, qymin, qxmax, qymax, stored =
+        buildquadtree(scene, viewport, maxdepth, budget)
+    if budget then stderr("%d segments in leaves\n", stored) end
     stderr("preprocess in %.3fs\n", time:elapsed())
     time:reset()
     if scenetree then
@@ -1221,24 +2038,73 @@ function _M.render(scene, viewport, output, arguments)
         stderr("scene quadtree dump in %.3fs\n", time:elapsed())
         os.exit()
     end
-    -- allocate output image
-    local outputimage = image.image(width, height)
-    -- render
-    for i = 1, height do
-        stderr("\r%d%%", floor(1000*i/height)/10)
-        for j = 1, width do
-            local x, y = vxmin+j-.5, vymin+i-.5
-            local r, g, b, a = sample(quadtree,
-            qxmin, qymin, qxmax, qymax, x, y)
-            outputimage:set(j, i, r, g, b, a)
+    if tiles then
+        -- write tile pyramid and its descriptor into output
+        local ntiles = rendertiles(function(x, y)
+            return sample(quadtree,
+                qxmin, qymin, qxmax, qymax, x, y)
+        end, viewport, output, tiles, tilesize)
+        stderr("%d tiles in %.3fs\n", ntiles, time:elapsed())
+        return
+    end
+    -- count what each sample costs, once the quadtree is built
+    local heat = false
+    if heatmap then
+        cost = newcost()
+        heat = newheat(width, height)
+    end
+    -- the counters belong to this render alone, so they are dropped
+    -- even when it fails
+    local ok, err = pcall(function()
+        if stream then
+            -- render rows top to bottom, as the encoders want them,
+            -- and hand each one over while the next one is rendered
+            local rowimage = image.image(width, 1, "unorm8")
+            local rows = encoder.stream8(output, width, height)
+            for i = height, 1, -1 do
+                stderr("\r%d%%", floor(1000*(height-i+1)/height)/10)
+                for j = 1, width do
+                    local x, y = vxmin+j-.5, vymin+i-.5
+                    local r, g, b, a = sample(quadtree,
+                    qxmin, qymin, qxmax, qymax, x, y)
+                    rowimage:set(j, 1, r, g, b, a)
+                    if heat then heat:record(j, i) end
+                end
+                rows:write(rowimage)
+            end
+            rows:close()
+            stderr("\n")
+            stderr("rendering and saving in %.3fs\n", time:elapsed())
+        else
+            -- allocate output image
+            -- it is only ever stored with 8 bits per channel, so keep it that way
+            local outputimage = image.image(width, height, "unorm8")
+            -- render
+            for i = 1, height do
+                stderr("\r%d%%", floor(1000*i/height)/10)
+                for j = 1, width do
+                    local x, y = vxmin+j-.5, vymin+i-.5
+                    local r, g, b, a = sample(quadtree,
+                    qxmin, qymin, qxmax, qymax, x, y)
+                    outputimage:set(j, i, r, g, b, a)
+                    if heat then heat:record(j, i) end
+                end
+            end
+            stderr("\n")
+            stderr("rendering in %.3fs\n", time:elapsed())
+            time:reset()
+            -- store output image
+            encoder.store8(output, outputimage)
+            stderr("saved in %.3fs\n", time:elapsed())
         end
+    end)
+    local charged = heat and cost.charged
+    cost = false
+    if not ok then error(err, 0) end
+    if heat then
+        storeheatmap(heat, heatmetric, heatmap)
+        summarizeheat(heat, charged, quadtree)
     end
-    stderr("\n")
-    stderr("rendering in %.3fs\n", time:elapsed())
-    time:reset()
-    -- store output image
-    image.png.store8(output, outputimage)
-    stderr("saved in %.3fs\n", time:elapsed())
 end
 
 return _M
@@ -2,6 +2,7 @@ local driver = require"driver"
 local style = require"style"
 local arc = require"arc"
 local xform = require"xform"
+local svgwriter = require"svgwriter"
 
 local _M = driver.new()
 
@@ -166,48 +167,10 @@ local rvgcommand = {
     end_closed_contour = "Z",
 }
 
+-- the writer goes over the path data natively
 function write.path(shape, file)
     file:write(' d="')
-    local previous = nil
-    local printer = {}
-    function printer:begin_open_contour(len, x0, y0)
-        file:write("M ",x0," ", y0," ")
-        previous = "M"
-    end
-    function printer:begin_closed_contour(len, x0, y0)
-        file:write("M ", x0," ",y0," ")
-        previous = "M"
-    end
-    function printer:linear_segment(x0, y0, x1, y1)
-        if previous ~= "L" then file:write("L ") end
-        file:write(x1," ", y1," ")
-        previous = "L"
-    end
-    function printer:quadratic_segment(x0, y0, x1, y1, x2, y2)
-        if previous ~= "Q" then file:write("Q ") end
-        file:write(x1," ", y1," ",x2," ",y2," ")
-        previous = "Q"
-    end
-    function printer:rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2)
-        if previous ~= "A" then file:write("A ") end
-        local sx, sy, ax, fa, fs = arc.tosvg(x0, y0, x1, y1, w1, x2, y2)
-        file:write(sx," ", sy," ",ax," ",fa," ",fs," ")
-        file:write(x2," ", y2," ")
-        previous = "A"
-    end
-    function printer:cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3)
-        if previous ~= "C" then file:write("C ") end
-        file:write(x1," ", y1," ",x2," ",y2," ",x3," ",y3," ")
-        previous = "C"
-    end
-    function printer:end_open_contour(len)
-        previous = nil
-    end
-    function printer:end_closed_contour(len)
-        if previous ~= "Z" then file:write("Z ") end
-        previous = "Z"
-    end
-    shape:iterate(printer)
+    file:path(shape, arc.tosvg)
     file:write('"')
 end
 
@@ -290,7 +253,13 @@ function write.eofill(element, id, file)
     file:write("/>\n") 
 end
 
-function _M.render(scene, viewport, file)
+-- everything goes through a buffered writer, which also formats the
+-- numbers. if more is a function, it is called with a function that
+-- writes one more element on top of the scene, so that callers can
+-- stream any number of them without adding them to the scene first.
+-- process.lua passes its driver arguments in the same place, as a table
+function _M.render(scene, viewport, output, more)
+    local file = svgwriter.writer(output)
     local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
     file:write("<?xml version=\"1.0\" standalone=\"no\"?>\n")
     file:write("<svg\n")
@@ -326,8 +295,18 @@ function _M.render(scene, viewport, file)
             "no handler for " .. element.type)
         callback(element, "p"..i, file)
     end
+    if type(more) == "function" then
+        local n = #scene.elements
+        more(function(element)
+            n = n + 1
+            local callback = assert(write[element.type],
+                "no handler for " .. element.type)
+            callback(element, "p"..n, file)
+        end)
+    end
     if s ~= "" then file:write("</g>\n") end
     file:write("</svg>\n")
+    file:close()
 end
 
 return _M
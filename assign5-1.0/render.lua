@@ -1,6 +1,7 @@
 local driver = require"driver"
 local image = require"image"
 local chronos = require"chronos"
+local bvh = require"bvh"
 
 local solve = {}
 solve.quadratic = require"quadratic"
@@ -21,6 +22,9 @@ local FLT_MIN = 1.17549435E-38 -- smallest-magnitude normalized single-precision
 local TOL = 0.01 -- root-finding tolerance, in pixels
 local MAX_ITER = 30 -- maximum number of bisection iterations in root-finding
 local MAX_DEPTH = 8 -- maximum quadtree depth
+local ATLAS_SIZE = 16 -- largest element, in pixels, kept in the atlas
+local FIXED_BITS = 8 -- fractional bits of the -fixed grid
+local LOD_AREA = 1 -- smallest box, in pixels, kept by -lod
 
 local _M = driver.new()
     
@@ -300,6 +304,45 @@ local function newcleaner(forward)
     return cleaner
 end
 
+-- round every control point to a multiple of 2^-bits pixels. this only
+-- snaps control points: edges are still evaluated in doubles, and the
+-- points where monotonization splits curves fall off the grid, so it
+-- makes no promise about how pixels along shared edges are split.
+-- rounding can bend a monotonic curve back on itself, so it happens
+-- before monotonization
+local function newsnapper(bits, forward)
+    local s = 2^bits
+    local function snap(v)
+        return floor(v*s+.5)/s
+    end
+    local snapper = {}
+    function snapper:begin_closed_contour(len, x0, y0)
+        forward:begin_closed_contour(_, snap(x0), snap(y0))
+    end
+    snapper.begin_open_contour = snapper.begin_closed_contour
+    function snapper:linear_segment(x0, y0, x1, y1)
+        forward:linear_segment(snap(x0), snap(y0), snap(x1), snap(y1))
+    end
+    function snapper:quadratic_segment(x0, y0, x1, y1, x2, y2)
+        forward:quadratic_segment(snap(x0), snap(y0), snap(x1), snap(y1),
+            snap(x2), snap(y2))
+    end
+    function snapper:rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2)
+        -- the middle control point is rounded as given, i.e., times w1
+        forward:rational_quadratic_segment(snap(x0), snap(y0),
+            snap(x1), snap(y1), w1, snap(x2), snap(y2))
+    end
+    function snapper:cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3)
+        forward:cubic_segment(snap(x0), snap(y0), snap(x1), snap(y1),
+            snap(x2), snap(y2), snap(x3), snap(y3))
+    end
+    function snapper:end_closed_contour(len)
+        forward:end_closed_contour(_)
+    end
+    snapper.end_open_contour = snapper.end_closed_contour
+    return snapper
+end
+
 -- transform segments to monotonic segments
 function newmonotonizer(forward)
     local monotonizer = {}
@@ -327,20 +370,11 @@ function newmonotonizer(forward)
         end
     end
     function monotonizer:rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2)
-        function solve_extreme(b0, b1, b2, w, t)
-            local a = (w - 1)*(b0 - b2)
-            local b = b0 - 2*b0*w + 2*b1 - b2                   
-            local c = w*b0 - b1
-            local n, r1, s1, r2, s2 = solve.quadratic.quadratic(a, b, c)
-            if n == 0 then return end
-            local t1, t2 = r1/s1, r2/s2
-            if 0 < t1 and t1 < 1 then t[#t + 1] = t1 end
-            if 0 < t2 and t2 < 1 then t[#t + 1] = t2 end
-        end
-
-        local t = {0, 1}
-        solve_extreme(x0, x1, x2, w1, t)
-        solve_extreme(y0, y1, y2, w1, t)
+        -- extrema in x and in y, solved together
+        local t = solve.quadratic.unitroots({
+            (w1 - 1)*(x0 - x2), x0 - 2*x0*w1 + 2*x1 - x2, w1*x0 - x1,
+            (w1 - 1)*(y0 - y2), y0 - 2*y0*w1 + 2*y1 - y2, w1*y0 - y1
+        }, {0, 1})
 
         table.sort(t)
         for i = 2, #t do 
@@ -348,58 +382,30 @@ function newmonotonizer(forward)
         end
     end
     function monotonizer:cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3)
-        function solve_extreme(z0, z1, z2,z3, t)
-            local a = 3 * ( -z0 + 3*z1 - 3*z2 + z3 )
-            local b = 6 * ( z0 - 2*z1 + z2 )
-            local c = 3 * ( -z0 + z1 )
-            local n, r1, s1, r2, s2 = solve.quadratic.quadratic(a, b, c)
-            if n == 0 then return end
-            local t1, t2 = r1/s1, r2/s2
-            if 0 < t1 and t1 < 1 then t[#t + 1] = t1 end
-            if 0 < t2 and t2 < 1 then t[#t + 1] = t2 end
-        end
-        function inflecction_double(x0, y0, x1, y1, x2, y2, x3, y3, t)
+        -- determinants that locate inflections and double points
+        local function determinants(x0, y0, x1, y1, x2, y2, x3, y3)
             local m = {
                 x0, -3*x0 + 3*x1, 3*x0 - 6*x1 + 3*x2, -x0 + 3*x1 - 3*x2 + x3,
                 y0, -3*y0 + 3*y1, 3*y0 - 6*y1 + 3*y2, -y0 + 3*y1 - 3*y2 + y3,
                 1, 0, 0, 0
             }
-            local _, d1 = _M.xform(m[2], m[3], m[4], m[6], m[7], m[8], m[10], m[11], m[12]):inversedet()
             local _, d2 = _M.xform(m[1], m[3], m[4], m[5], m[7], m[8], m[9], m[11], m[12]):inversedet()
             local _, d3 = _M.xform(m[1], m[2], m[4], m[5], m[6], m[8], m[9], m[10], m[12]):inversedet()
             local _, d4 = _M.xform(m[1], m[2], m[3], m[5], m[6], m[7], m[9], m[10], m[11]):inversedet()
-            
-            d2, d4 = -d2, -d4
-
-            local a, b, c, n, r1, s1, r2, s2
-            -- inflecction point
-            a = -3*d2
-            b = 3*d3
-            c = -d4
-            n, r1, s1, r2, s2 = solve.quadratic.quadratic(a, b, c)
-            if n ~= 0 then 
-                local t1, t2 = r1/s1, r2/s2
-                if 0 < t1 and t1 < 1 then t[#t + 1] = t1 end
-                if 0 < t2 and t2 < 1 then t[#t + 1] = t2 end
-            end
-
-            -- double point
-            a = d2*d2
-            b = -d2*d3
-            c = d3*d3 - d2*d4
-            n, r1, s1, r2, s2 = solve.quadratic.quadratic(a, b, c)
-            if n ~= 0 then 
-                local t1, t2 = r1/s1, r2/s2
-                if 0 < t1 and t1 < 1 then t[#t + 1] = t1 end
-                if 0 < t2 and t2 < 1 then t[#t + 1] = t2 end
-            end
-
+            return -d2, d3, -d4
         end
-        
-        local t = {0,1}
-        solve_extreme(x0, x1, x2, x3, t)
-        solve_extreme(y0, y1, y2, y3, t)
-        inflecction_double(x0, y0, x1, y1, x2, y2, x3, y3, t)
+
+        local d2, d3, d4 = determinants(x0, y0, x1, y1, x2, y2, x3, y3)
+        -- extrema in x and in y, inflections and double point,
+        -- all solved together
+        local t = solve.quadratic.unitroots({
+            3 * ( -x0 + 3*x1 - 3*x2 + x3 ), 6 * ( x0 - 2*x1 + x2 ),
+            3 * ( -x0 + x1 ),
+            3 * ( -y0 + 3*y1 - 3*y2 + y3 ), 6 * ( y0 - 2*y1 + y2 ),
+            3 * ( -y0 + y1 ),
+            -3*d2, 3*d3, -d4,
+            d2*d2, -d2*d3, d3*d3 - d2*d4
+        }, {0, 1})
         
         table.sort(t)
 
@@ -430,10 +436,42 @@ local function newlinear(x1, y1, x2, y2)
         if y > ymax then return false end
         if y <= ymin then return false end
         return a * x + b * y + c < 0
+    end,
+    -- value of the line function at x, y and its change for each step
+    -- of 1 in x, or false when y is out of range
+    start = function(self, x, y)
+        local xmin, ymin, xmax, ymax, a, b, c = unpack(self)
+        if y > ymax then return false end
+        if y <= ymin then return false end
+        return a * x + b * y + c, a
     end
     }
 end
 
+-- spans are runs of n pixels along a row, at x, x+1, ..., x+n-1.
+-- segments add their winding numbers to a span as differences, so that
+-- w[k] is the change from pixel k-1 to pixel k
+
+-- number of pixels in the span with x+k-1-tx <= bound
+local function leading(x, tx, bound, n)
+    local k = max(0, min(n, floor(bound + tx - x) + 1))
+    -- settle rounding exactly as the pixel by pixel tests would
+    while k < n and x+k-tx <= bound do k = k + 1 end
+    while k > 0 and x+k-1-tx > bound do k = k - 1 end
+    return k
+end
+
+-- add s to the pixels left of a segment spanning xmin to xmax, and
+-- return the range of pixels in between
+local function spanrange(x, tx, xmin, xmax, s, n, w)
+    local k0 = leading(x, tx, xmin, n)
+    if k0 > 0 then
+        w[1] = w[1] + s
+        w[k0+1] = w[k0+1] - s
+    end
+    return k0+1, leading(x, tx, xmax, n)
+end
+
 -- create new structure for paths
 function newimpliciter(forward)
     local px, py
@@ -473,6 +511,20 @@ function newimpliciter(forward)
                 if x <= xmin then return s end
                 if a * x + b * y + c < 0 then return s end
                 return 0
+            end,
+            span = function(self, x, y, n, w)
+                local xmin, ymin, xmax, ymax, s, a, b, c = unpack(self)
+                if y > ymax then return end
+                if y <= ymin then return end
+                local k0, k1 = spanrange(x, 0, xmin, xmax, s, n, w)
+                local F = a * (x+k0-1) + b * y + c
+                for k = k0, k1 do
+                    if F < 0 then
+                        w[k] = w[k] + s
+                        w[k+1] = w[k+1] - s
+                    end
+                    F = F + a
+                end
             end
         }
         px, py = x1, y1
@@ -517,6 +569,33 @@ function newimpliciter(forward)
                     if dd:winding(x,y) or  F < 0 then return s end 
                 end
                 return 0
+            end,
+            span = function(self, x, y, n, w)
+                local xmin, ymin, xmax, ymax, s, a, b, c, d, e, tx, ty, command, dd = unpack(self)
+                y = y - ty
+                if y > ymax then return end
+                if y <= ymin then return end
+                local k0, k1 = spanrange(x, tx, xmin, xmax, s, n, w)
+                x = x+k0-1-tx
+                -- F is a quadratic in x along the row
+                local F = (a*y + x*b)^2 - (c*y + x*d)*e
+                local p2, p1 = b*b, 2*a*y*b - d*e
+                local dF, ddF = p2*(2*x+1) + p1, 2*p2
+                local D, dD = dd:start(x, y)
+                for k = k0, k1 do
+                    local inside
+                    if command == "and" then
+                        inside = D and D < 0 and F > 0
+                    else
+                        inside = (D and D < 0) or F < 0
+                    end
+                    if inside then
+                        w[k] = w[k] + s
+                        w[k+1] = w[k+1] - s
+                    end
+                    F, dF = F + dF, dF + ddF
+                    if D then D = D + dD end
+                end
             end
         }
         px, py = x2, y2
@@ -564,6 +643,32 @@ function newimpliciter(forward)
                     if dd:winding(x,y) or f < 0 then return s end 
                 end
                 return 0
+            end,
+            span = function(self, x, y, n, w)
+                local xmin, ymin, xmax, ymax, s, a, b, c, d, e, tx, ty, command, dd = unpack(self)
+                y = y - ty
+                if y > ymax then return end
+                if y <= ymin then return end
+                local k0, k1 = spanrange(x, tx, xmin, xmax, s, n, w)
+                x = x+k0-1-tx
+                -- f is a quadratic in x along the row
+                local f = y*(a*y + b) + x*(c + y*d + x*e)
+                local df, ddf = e*(2*x+1) + c + y*d, 2*e
+                local D, dD = dd:start(x, y)
+                for k = k0, k1 do
+                    local inside
+                    if command == "and" then
+                        inside = D and D < 0 and f > 0
+                    else
+                        inside = (D and D < 0) or f < 0
+                    end
+                    if inside then
+                        w[k] = w[k] + s
+                        w[k+1] = w[k+1] - s
+                    end
+                    f, df = f + df, df + ddf
+                    if D then D = D + dD end
+                end
             end
         }
         px, py = x2, y2
@@ -672,6 +777,39 @@ function newimpliciter(forward)
                     if dd:winding(x,y) or (( da:winding(x, y) or db:winding(x, y)) and F < 0)  then return s end 
                 end
                 return 0
+            end,
+            span = function(self, x, y, n, w)
+                local xmin, ymin, xmax, ymax, s, a, b, c, d, e, f, g, h, i, tx, ty, command, dd, da, db = unpack(self)
+                y = y - ty
+                if y > ymax then return end
+                if y <= ymin then return end
+                local k0, k1 = spanrange(x, tx, xmin, xmax, s, n, w)
+                x = x+k0-1-tx
+                -- F is a cubic in x along the row
+                local F = y*(a+y*(b*y+c)) + x*(d + y*(e + y*f) + x*(g + y*h + x*i))
+                local p3, p2, p1 = i, g + y*h, d + y*(e + y*f)
+                local dF = p3*(3*x*x + 3*x + 1) + p2*(2*x + 1) + p1
+                local ddF, dddF = p3*(6*x + 6) + 2*p2, 6*p3
+                local D, dD = dd:start(x, y)
+                local A, dA = da:start(x, y)
+                local B, dB = db:start(x, y)
+                for k = k0, k1 do
+                    local inside
+                    local triangle = (A and A < 0) or (B and B < 0)
+                    if command == "and" then
+                        inside = D and D < 0 and (triangle or F > 0)
+                    else
+                        inside = (D and D < 0) or (triangle and F < 0)
+                    end
+                    if inside then
+                        w[k] = w[k] + s
+                        w[k+1] = w[k+1] - s
+                    end
+                    F, dF, ddF = F + dF, dF + ddF, ddF + dddF
+                    if D then D = D + dD end
+                    if A then A = A + dA end
+                    if B then B = B + dB end
+                end
             end
         }
         px, py = x3, y3
@@ -685,22 +823,77 @@ function newimpliciter(forward)
     return impliciter
 end
 
+-- replace curves by polylines that stay within tol pixels of them
+local function newflattener(tol, forward)
+    -- required only here, so the driver runs without flatten.so as long
+    -- as -flatten is not given
+    local flatten = require"flatten"
+    local flattener = {}
+    local vertices = {}
+    local function polyline(x0, y0, n)
+        for i = 1, 2*n, 2 do
+            local x1, y1 = vertices[i], vertices[i+1]
+            forward:linear_segment(x0, y0, x1, y1)
+            x0, y0 = x1, y1
+        end
+    end
+    function flattener:begin_closed_contour(len, x0, y0)
+        forward:begin_closed_contour(_, x0, y0)
+    end
+    flattener.begin_open_contour = flattener.begin_closed_contour
+    function flattener:linear_segment(x0, y0, x1, y1)
+        forward:linear_segment(x0, y0, x1, y1)
+    end
+    function flattener:quadratic_segment(x0, y0, x1, y1, x2, y2)
+        local _, n = flatten.quadratic(x0, y0, x1, y1, x2, y2, tol, vertices)
+        polyline(x0, y0, n)
+    end
+    function flattener:rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2)
+        local _, n = flatten.rational_quadratic(x0, y0, x1, y1, w1, x2, y2,
+            tol, vertices)
+        polyline(x0, y0, n)
+    end
+    function flattener:cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3)
+        local _, n = flatten.cubic(x0, y0, x1, y1, x2, y2, x3, y3, tol,
+            vertices)
+        polyline(x0, y0, n)
+    end
+    function flattener:end_closed_contour(len)
+        forward:end_closed_contour(_)
+    end
+    flattener.end_open_contour = flattener.end_closed_contour
+    return flattener
+end
+
 -- here is a function that returns a path transformed to
 -- pixel coordinates using the iterator trick I talked about
 -- you should chain your own implementation of monotonization!
 -- if you don't do that, your life will be *much* harder
-function transformpath(oldpath, xf)
+function transformpath(oldpath, xf, tol, bits)
     local newpath = _M.path()
     newpath:open()
-    oldpath:iterate(
-        newxformer(xf * oldpath.xf,
-            newmonotonizer(
-                newcleaner(
-                    newpath))))
+    -- control points are snapped to a grid when bits are given, before
+    -- curves are split into monotonic pieces, and curves become
+    -- polylines when a tolerance is given
+    local forward = newcleaner(newpath)
+    if tol then forward = newflattener(tol, forward) end
+    forward = newmonotonizer(forward)
+    if bits then forward = newsnapper(bits, forward) end
+    oldpath:iterate(newxformer(xf * oldpath.xf, forward))
     newpath:close()
     return newpath
 end
 
+-- fill rule applied to a winding number
+local function filled(w, type)
+    if type == "eofill" and  w % 2 ~= 0 then
+        return true
+    elseif type == "fill" and w ~= 0 then
+        return true
+    end
+    return false
+end
+
 function preparepath(oldpath)
     local implicitform = {}
     implicitform.path = {}
@@ -713,13 +906,21 @@ function preparepath(oldpath)
         return w
     end
     implicitform.inside = function(self, x, y, type)
-        local w = self:winding(x, y)
-        if type == "eofill" and  w % 2 ~= 0 then
-            return true
-        elseif type == "fill" and w ~= 0 then
-            return true
+        return filled(self:winding(x, y), type)
+    end
+    -- winding numbers of the n pixels at x, x+1, ... on row y, into w
+    implicitform.span = function(self, x, y, n, w)
+        for k = 1, n+1 do
+            w[k] = 0
+        end
+        for i, s in ipairs(self.path) do
+            s:span(x, y, n, w)
+        end
+        local acc = 0
+        for k = 1, n do
+            acc = acc + w[k]
+            w[k] = acc
         end
-        return false
     end
     return implicitform
 end
@@ -771,16 +972,187 @@ function prepare.radialgradient(paint, xf)
     paint.T = m * (xf*paint.xf):inverse()
 end
 
+-- grow box at boxes[n+1..n+4] to contain a monotonized path.
+-- segments are monotonic, so their endpoints bound them
+local function newboxer(boxes, n)
+    local boxer = {}
+    local function grow(x, y)
+        boxes[n+1], boxes[n+2] = min(boxes[n+1], x), min(boxes[n+2], y)
+        boxes[n+3], boxes[n+4] = max(boxes[n+3], x), max(boxes[n+4], y)
+    end
+    function boxer:begin_closed_contour(len, x0, y0)
+        grow(x0, y0)
+    end
+    boxer.begin_open_contour = boxer.begin_closed_contour
+    function boxer:linear_segment(x0, y0, x1, y1)
+        grow(x1, y1)
+    end
+    function boxer:quadratic_segment(x0, y0, x1, y1, x2, y2)
+        grow(x2, y2)
+    end
+    function boxer:rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2)
+        grow(x2, y2)
+    end
+    function boxer:cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3)
+        grow(x3, y3)
+    end
+    function boxer:end_closed_contour(len)
+    end
+    boxer.end_open_contour = boxer.end_closed_contour
+    return boxer
+end
+
+-- grow box to contain the control points of a path under xf. each
+-- segment stays inside the hull of its control points, so the box
+-- contains the path without having to monotonize it first
+local function newhullboxer(xf, box)
+    local hullboxer = {}
+    local function grow(x, y, w)
+        x, y, w = xf:apply(x, y, w)
+        if w <= 0 then
+            -- not bounded by the hull, so leave nothing out
+            box[1], box[2] = -math.huge, -math.huge
+            box[3], box[4] = math.huge, math.huge
+        else
+            x, y = x/w, y/w
+            box[1], box[2] = min(box[1], x), min(box[2], y)
+            box[3], box[4] = max(box[3], x), max(box[4], y)
+        end
+    end
+    function hullboxer:begin_closed_contour(len, x0, y0)
+        grow(x0, y0, 1)
+    end
+    hullboxer.begin_open_contour = hullboxer.begin_closed_contour
+    function hullboxer:linear_segment(x0, y0, x1, y1)
+        grow(x1, y1, 1)
+    end
+    function hullboxer:quadratic_segment(x0, y0, x1, y1, x2, y2)
+        grow(x1, y1, 1)
+        grow(x2, y2, 1)
+    end
+    function hullboxer:rational_quadratic_segment(x0, y0, x1, y1, w1, x2, y2)
+        grow(x1, y1, w1)
+        grow(x2, y2, 1)
+    end
+    function hullboxer:cubic_segment(x0, y0, x1, y1, x2, y2, x3, y3)
+        grow(x1, y1, 1)
+        grow(x2, y2, 1)
+        grow(x3, y3, 1)
+    end
+    function hullboxer:end_closed_contour(len)
+    end
+    hullboxer.end_open_contour = hullboxer.end_closed_contour
+    return hullboxer
+end
+
+-- returns a function that tells whether an element can be left out of
+-- a rendering of the viewport: either no pixel center falls inside its
+-- bounding box, so no sample would ever see it, or the box covers less
+-- than area pixels. only the latter changes the image. boxes are found
+-- before anything else is prepared, so what is left out costs little
+local function newculler(xf, viewport, area, fixed)
+    local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+    local width, height = vxmax-vxmin, vymax-vymin
+    -- control points move by up to half a step when snapped
+    local slack = fixed and 2^-(fixed+1) or 0
+    return function(element)
+        local shape = element.shape
+        local box = { math.huge, math.huge, -math.huge, -math.huge }
+        shape:iterate(newhullboxer(xf * shape.xf, box))
+        local xmin, ymin = box[1]-slack, box[2]-slack
+        local xmax, ymax = box[3]+slack, box[4]+slack
+        local jmin = max(1, math.ceil(xmin-vxmin+.5))
+        local imin = max(1, math.ceil(ymin-vymin+.5))
+        local jmax = min(width, floor(xmax-vxmin+.5))
+        local imax = min(height, floor(ymax-vymin+.5))
+        return jmin > jmax or imin > imax or (xmax-xmin)*(ymax-ymin) < area
+    end
+end
+
+-- evaluate the fill rule of an element once for each pixel center in
+-- its bounding box, and append the answers to the coverage atlas.
+-- each row only visits the segments that cross it, so this is much
+-- cheaper than testing the pixels one by one, and gives the same answer
+local function rasterize(element, atlas, xmin, ymin, xmax, ymax, maxpx)
+    local j0, j1 = math.ceil(xmin-.5), floor(xmax-.5)
+    local i0, i1 = math.ceil(ymin-.5), floor(ymax-.5)
+    local w, h = j1-j0+1, i1-i0+1
+    if w < 1 or h < 1 or w > maxpx or h > maxpx then return end
+    local segments, type = element.implicitform.path, element.type
+    local base = #atlas
+    local crossing = {}
+    for i = 0, h-1 do
+        local y = i0+i+.5
+        -- segments left of a sample contribute their sign only
+        -- when the row crosses them, and nothing otherwise
+        local n = 0
+        for k = 1, #segments do
+            local s = segments[k]
+            if s:winding(-math.huge, y) ~= 0 then
+                n = n + 1
+                crossing[n] = s
+            end
+        end
+        for j = 0, w-1 do
+            local x, winding = j0+j+.5, 0
+            for k = 1, n do
+                winding = winding + crossing[k]:winding(x, y)
+            end
+            atlas[base+i*w+j+1] = filled(winding, type)
+        end
+    end
+    element.atlas = base
+    element.ax, element.ay = j0+.5, i0+.5
+    element.aw, element.ah = w, h
+end
+
+-- prepare one element for sampling, and return its bounding box
+local function prepareelement(scene, element, xf, atlas, tolerance, fixed)
+    -- a paint shared by several elements is prepared only once
+    local paint = element.paint
+    if not scene.prepared[paint] then
+        prepare[paint.type](paint, xf)
+        scene.prepared[paint] = true
+    end
+    element.shape = transformpath(element.shape, xf, tolerance, fixed)
+    element.implicitform = preparepath(element.shape)
+    -- the winding number of a closed path vanishes outside
+    -- the bounding box of its segments
+    local box = { math.huge, math.huge, -math.huge, -math.huge }
+    element.shape:iterate(newboxer(box, 0))
+    rasterize(element, scene.atlas, box[1], box[2], box[3], box[4], atlas)
+    return unpack(box, 1, 4)
+end
+
 -- prepare scene for sampling and return modified scene
-local function preparescene(scene)
+-- elements spanning at most atlas pixels each way are rasterized into
+-- the coverage atlas, and larger ones are always tested against outlines
+-- with a tolerance, curves are flattened to within that many pixels
+-- with fixed bits, control points are snapped to 2^-fixed pixels
+-- with a culler, elements it tells apart are left out of the scene
+local function preparescene(scene, atlas, tolerance, fixed, cull)
     -- implement
     -- (feel free to use the transformpath function above)
+    if cull then
+        local kept = {}
+        for i, element in ipairs(scene.elements) do
+            if not cull(element) then kept[#kept+1] = element end
+        end
+        scene.elements = kept
+    end
+    local boxes = {}
+    scene.atlas = {}
+    scene.prepared = {}
     for i, element in ipairs(scene.elements) do
-        prepare[element.paint.type](element.paint, scene.xf) 
-        element.shape = transformpath(element.shape, scene.xf)
-        element.implicitform = preparepath(element.shape)
+        local n = #boxes
+        boxes[n+1], boxes[n+2], boxes[n+3], boxes[n+4] =
+            prepareelement(scene, element, scene.xf, atlas, tolerance, fixed)
     end
     scene.xf = _M.identity()
+    -- only elements whose boxes contain a sample are visited
+    scene.boxes = boxes
+    scene.bvh = bvh.bvh(boxes)
+    scene.found = {}
     return scene
 end
 
@@ -914,14 +1286,31 @@ function getcolor.radialgradient(paint, x0, y0)
 end
 
 
+-- samples at pixel centers inside a rasterized element read the
+-- coverage atlas, and everything else tests the outline
+local function inside(scene, element, x, y)
+    local base = element.atlas
+    if base then
+        local j, i = x - element.ax, y - element.ay
+        if j >= 0 and i >= 0 and j < element.aw and i < element.ah and
+            j == floor(j) and i == floor(i) then
+            return scene.atlas[base+i*element.aw+j+1]
+        end
+    end
+    return element.implicitform:inside(x, y, element.type)
+end
+
 -- use scene to evaluate the color, and finally return r,g,b,a
 local function sample(scene, x, y)
     -- implement
     local Cr, Cg, Cb, alpha = 1.0, 1.0, 1.0, 1.0
     local r, g, b, a 
+    local elements = scene.elements
+    local found, n = scene.bvh:query(x, y, scene.found)
 
-    for i, element in ipairs(scene.elements) do
-        if element.implicitform:inside(x, y, element.type) then
+    for k = 1, n do
+        local element = elements[found[k]]
+        if inside(scene, element, x, y) then
             r,g,b,a = getcolor[element.paint.type](element.paint, x, y)
             a = element.paint.opacity*a
             Cr = r*a + Cr*alpha*(1-a)
@@ -933,12 +1322,489 @@ local function sample(scene, x, y)
     return Cr, Cg, Cb, alpha
 end
 
+-- same as sample, but visits the elements from the top down,
+-- accumulating color under what is already there.
+-- stops as soon as nothing else can show through
+local function samplefronttoback(scene, x, y)
+    local Cr, Cg, Cb = 0.0, 0.0, 0.0
+    local t = 1.0 -- transparency of what was accumulated so far
+    local r, g, b, a 
+    local elements = scene.elements
+    local found, n = scene.bvh:query(x, y, scene.found)
+
+    for k = n, 1, -1 do
+        local element = elements[found[k]]
+        if inside(scene, element, x, y) then
+            r,g,b,a = getcolor[element.paint.type](element.paint, x, y)
+            a = element.paint.opacity*a*t
+            Cr = Cr + r*a
+            Cg = Cg + g*a
+            Cb = Cb + b*a
+            t = t - a
+            if t <= 0 then return Cr, Cg, Cb, 1.0 end
+        end
+    end
+    -- white background
+    return Cr + t, Cg + t, Cb + t, 1.0
+end
+
+-- color of a ramp at parameter p, as getcolor.lineargradient finds it
+local function rampcolor(ramp, p)
+    local n = #ramp
+    if p < 0 then
+        return unpack(ramp[2])
+    elseif p > 1 then
+        return unpack(ramp[n])
+    end
+    for i=1, n-2, 2 do
+        if ramp[i] <= p and p <= ramp[i+2] then
+            local t0, t1 = p-ramp[i], ramp[i+2] - p
+            local d = ramp[i+2] - ramp[i]
+            local c0, c1 = ramp[i+1], ramp[i+3]
+            return (c1[1]*t0 + c0[1]*t1)/d, (c1[2]*t0 + c0[2]*t1)/d,
+                (c1[3]*t0 + c0[3]*t1)/d, (c1[4]*t0 + c0[4]*t1)/d
+        end
+    end
+    return 1,1,1,1
+end
+
+-- paints along a span. each returns a function that moves on to the
+-- next pixel every time it is called, and also returns its color when
+-- asked for it. gradient parameters are affine in the sample position,
+-- so they are stepped by forward differences
+local spancolor = {}
+
+function spancolor.solid(paint, x, y)
+    local r, g, b, a = unpack(paint.data)
+    return function(fill)
+        return r, g, b, a
+    end
+end
+
+function spancolor.lineargradient(paint, x, y)
+    local T, ramp = paint.T, paint.data.ramp
+    local p = paint.T:apply(x, y)
+    local dp = T[1]
+    return function(fill)
+        local q = p
+        p = p + dp
+        if fill then return rampcolor(ramp, q) end
+    end
+end
+
+-- the gradient parameter p of a point q, with the focus at the origin,
+-- is where q/p lands on the circle, so that
+--   (cx^2 + cy^2 - r^2)*p^2 - 2*(q.c)*p + q.q == 0
+-- along a span, q.c is linear and the discriminant quadratic
+function spancolor.radialgradient(paint, x, y)
+    local T, data = paint.T, paint.data
+    local ramp, n = data.ramp, #data.ramp
+    local cx, cy, r = data.cx, data.cy, data.radius
+    local A = cx*cx + cy*cy - r*r
+    if A >= 0 then
+        -- focus on or outside the circle
+        return function(fill)
+            local u = x
+            x = x + 1
+            if fill then return getcolor.radialgradient(paint, u, y) end
+        end
+    end
+    local ux, uy = T:apply(x, y)
+    local dx, dy = T[1], T[4]
+    local B, dB = ux*cx + uy*cy, dx*cx + dy*cy
+    local C = ux*ux + uy*uy
+    local D = B*B - A*C
+    local e = dB*dB - A*(dx*dx + dy*dy)
+    local dD = e + 2*(B*dB - A*(ux*dx + uy*dy))
+    local ddD = 2*e
+    return function(fill)
+        local b, c, d = B, C, D
+        B, D, dD = B + dB, D + dD, dD + ddD
+        ux, uy = ux + dx, uy + dy
+        C = ux*ux + uy*uy
+        if not fill then return end
+        -- the positive root, without cancellation
+        local sqrtd = sqrt(max(d, 0))
+        local p
+        if b >= 0 then p = c/(b + sqrtd)
+        else p = (b - sqrtd)/A end
+        if p > 1 then return unpack(ramp[n]) end
+        return rampcolor(ramp, p)
+    end
+end
+
+-- sample the n pixels at x, x+1, ... on row y, leaving their colors in
+-- colors as r, g, b, a. each element only visits the pixels in its
+-- bounding box, and gets their winding numbers all at once
+local function samplespan(scene, x, y, n, colors)
+    for k = 1, 4*n do
+        colors[k] = 1.0
+    end
+    local boxes, elements, w = scene.boxes, scene.elements, scene.span
+    for i, element in ipairs(elements) do
+        local m = 4*(i-1)
+        if boxes[m+2] <= y and y <= boxes[m+4] then
+            -- one pixel more on each side, to stay clear of rounding
+            local k0 = max(1, math.ceil(boxes[m+1]-x))
+            local k1 = min(n, floor(boxes[m+3]-x)+2)
+            if k0 <= k1 then
+                local x0 = x+k0-1
+                element.implicitform:span(x0, y, k1-k0+1, w)
+                local paint, type = element.paint, element.type
+                local color = spancolor[paint.type](paint, x0, y)
+                for k = 1, k1-k0+1 do
+                    local fill = filled(w[k], type)
+                    local r, g, b, a = color(fill)
+                    if fill then
+                        local c = 4*(k0+k-2)
+                        local Cr, Cg, Cb, alpha = unpack(colors, c+1, c+4)
+                        a = paint.opacity*a
+                        colors[c+1] = r*a + Cr*alpha*(1-a)
+                        colors[c+2] = g*a + Cg*alpha*(1-a)
+                        colors[c+3] = b*a + Cb*alpha*(1-a)
+                        colors[c+4] = a + alpha*(1-a)
+                    end
+                end
+            end
+        end
+    end
+    return colors
+end
+
 -- load your own svg driver here and use it for debugging!
 local svg = dofile"assign/svg.lua"
 
+-- file this driver was loaded from, for the threads of -threads
+local DRIVER = debug.getinfo(1, "S").source:match("^@(.*)$")
+
+-- settings that change how the scene is prepared and sampled
+local function newsettings()
+    return { fronttoback = false, atlas = ATLAS_SIZE, tolerance = false,
+        fixed = false }
+end
+
+-- append the options that fill settings to a list of other options,
+-- followed by the catch all for anything unrecognized
+local function samplingoptions(settings, options)
+    options[#options+1] = { "^%-fronttoback$", function(d)
+        if not d then return false end
+        settings.fronttoback = true
+        return true
+    end }
+    options[#options+1] = { "^(%-atlas:(%d+)(.*))$", function(all, n, e)
+        if not n then return false end
+        assert(e == "", "invalid option " .. all)
+        settings.atlas = assert(tonumber(n), "invalid option " .. all)
+        return true
+    end }
+    options[#options+1] = { "^(%-flatten:(.+))$", function(all, n)
+        if not n then return false end
+        local tolerance = assert(tonumber(n), "invalid option " .. all)
+        assert(tolerance > 0, "invalid option " .. all)
+        settings.tolerance = tolerance
+        return true
+    end }
+    -- -fixed snaps control points to 1/256 of a pixel by default
+    options[#options+1] = { "^(%-fixed(.*))$", function(all, e)
+        if not e then return false end
+        local bits = FIXED_BITS
+        if e ~= "" then
+            bits = assert(tonumber(e:match("^:(%d+)$")),
+                "invalid option " .. all)
+            assert(bits <= 16, "invalid option " .. all)
+        end
+        settings.fixed = bits
+        return true
+    end }
+    options[#options+1] = { ".*", function(all)
+        error("unrecognized option " .. all)
+    end }
+    return options
+end
+
+local function processoptions(arguments, options)
+    for i, argument in ipairs(arguments) do
+        for j, option in ipairs(options) do
+            if option[2](argument:match(option[1])) then
+                break
+            end
+        end
+    end
+end
+
+-- keep a prepared scene and its last rendering alive, so that editing
+-- an element only re-samples the pixels whose centers fall in its old
+-- or new bounding box. elements given to the session are in scene
+-- coordinates, as built by the driver's fill and eofill
+function _M.session(scene, viewport, arguments)
+    local settings = newsettings()
+    processoptions(arguments or {}, samplingoptions(settings, {}))
+    local sample = settings.fronttoback and samplefronttoback or sample
+    checkscene(scene)
+    local xf = scene.xf
+    scene = preparescene(scene, settings.atlas, settings.tolerance,
+        settings.fixed)
+    local elements, boxes, tree = scene.elements, scene.boxes, scene.bvh
+    local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+    local width, height = vxmax-vxmin, vymax-vymin
+    local outputimage = image.image(width, height, "unorm8")
+    -- pixel rectangles still to be sampled, 4 numbers each
+    local dirty = { 1, 1, width, height }
+    local function touch(i)
+        local n = 4*(i-1)
+        local jmin = max(1, math.ceil(boxes[n+1]-vxmin+.5))
+        local imin = max(1, math.ceil(boxes[n+2]-vymin+.5))
+        local jmax = min(width, floor(boxes[n+3]-vxmin+.5))
+        local imax = min(height, floor(boxes[n+4]-vymin+.5))
+        if jmin <= jmax and imin <= imax then
+            local m = #dirty
+            dirty[m+1], dirty[m+2], dirty[m+3], dirty[m+4] =
+                jmin, imin, jmax, imax
+        end
+    end
+    local function place(i, element)
+        local n = 4*(i-1)
+        if element then
+            checkscene{ elements = { element } }
+            elements[i] = element
+            -- atlas entries of replaced elements are not reclaimed
+            boxes[n+1], boxes[n+2], boxes[n+3], boxes[n+4] =
+                prepareelement(scene, element, xf, settings.atlas,
+                    settings.tolerance, settings.fixed)
+        else
+            -- removed elements keep their index, but are never found
+            boxes[n+1], boxes[n+2] = math.huge, math.huge
+            boxes[n+3], boxes[n+4] = -math.huge, -math.huge
+        end
+    end
+    local function checkindex(i)
+        assert(type(i) == "number" and elements[i] and i == floor(i),
+            "invalid element index")
+    end
+    local session = {}
+    -- replace element i
+    function session:modify(i, element)
+        checkindex(i)
+        assert(element, "missing element")
+        touch(i)
+        place(i, element)
+        tree:update(i, unpack(boxes, 4*i-3, 4*i))
+        touch(i)
+    end
+    -- stop drawing element i
+    function session:remove(i)
+        checkindex(i)
+        touch(i)
+        place(i, false)
+        tree:update(i, unpack(boxes, 4*i-3, 4*i))
+    end
+    -- add an element on top of all others, and return its index
+    function session:add(element)
+        assert(element, "missing element")
+        local i = #elements+1
+        place(i, element)
+        assert(tree:append(unpack(boxes, 4*i-3, 4*i)) == i)
+        touch(i)
+        return i
+    end
+    -- bring the image up to date with all edits so far, and return it
+    -- with the number of pixels that had to be sampled
+    function session:render()
+        -- rectangles overlap, so they are cut into spans of each row,
+        -- and overlapping spans are merged before anything is sampled
+        local rows = {}
+        for k = 1, #dirty, 4 do
+            local jmin, imin, jmax, imax = unpack(dirty, k, k+3)
+            for i = imin, imax do
+                local spans = rows[i] or {}
+                spans[#spans+1] = { jmin, jmax }
+                rows[i] = spans
+            end
+        end
+        local count = 0
+        local function samplespan(i, jmin, jmax)
+            for j = jmin, jmax do
+                local x, y = vxmin+j-.5, vymin+i-.5
+                local r, g, b, a = sample(scene, x, y)
+                outputimage:set(j, i, r, g, b, a)
+            end
+            count = count + jmax-jmin+1
+        end
+        for i = 1, height do
+            local spans = rows[i]
+            if spans then
+                table.sort(spans, function(a, b) return a[1] < b[1] end)
+                local jmin, jmax = spans[1][1], spans[1][2]
+                for k = 2, #spans do
+                    local span = spans[k]
+                    if span[1] > jmax+1 then
+                        samplespan(i, jmin, jmax)
+                        jmin, jmax = span[1], span[2]
+                    else
+                        jmax = max(jmax, span[2])
+                    end
+                end
+                samplespan(i, jmin, jmax)
+            end
+        end
+        dirty = {}
+        return outputimage, count
+    end
+    return session
+end
+
+-- prepare a scene once, in its own coordinates, and render it under
+-- any number of views. each frame maps its pixel centers back into the
+-- scene, so paths are never monotonized or transformed again, e.g.
+--   local frames = driver.sequence(input.scene, {})
+--   local xf = driver.windowviewport(input.window, viewport)
+--   for k = 1, n do
+--       img = frames:frame(viewport, xf*driver.rotate(k*360/n), img)
+--   end
+-- the -flatten tolerance and the -fixed grid are then in scene units,
+-- and there is no atlas, since pixel centers no longer land on a grid
+-- in the scene
+function _M.sequence(scene, arguments)
+    local settings = newsettings()
+    processoptions(arguments or {}, samplingoptions(settings, {}))
+    local sample = settings.fronttoback and samplefronttoback or sample
+    checkscene(scene)
+    scene = preparescene(scene, 0, settings.tolerance, settings.fixed)
+    local sequence = {}
+    -- render the view of the prepared scene under xf, which maps scene
+    -- coordinates to pixels. reuses outputimage if it has the right size
+    function sequence:frame(viewport, xf, outputimage)
+        local inv = xf:inverse()
+        local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+        local width, height = vxmax-vxmin, vymax-vymin
+        if not outputimage or outputimage.width ~= width or
+            outputimage.height ~= height then
+            outputimage = image.image(width, height, "unorm8")
+        end
+        for i = 1, height do
+            for j = 1, width do
+                local x, y, w = inv:apply(vxmin+j-.5, vymin+i-.5)
+                outputimage:set(j, i, sample(scene, x/w, y/w))
+            end
+        end
+        return outputimage
+    end
+    return sequence
+end
+
+-- write a deep zoom image (DZI) pyramid, one tile at a time
+-- level maxlevel has full resolution, and each level below halves it
+-- pixels in coarser levels are point-sampled from the full resolution
+-- scene at the center of the area they cover, so no level ever needs
+-- more than a single tile worth of memory
+local function rendertiles(sample, viewport, output, name, tilesize)
+    local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+    local width, height = vxmax-vxmin, vymax-vymin
+    local maxlevel = 0
+    while 2^maxlevel < max(width, height) do maxlevel = maxlevel + 1 end
+    local dir = name .. "_files"
+    os.execute(string.format('mkdir "%s"', dir))
+    -- reuse tile images of the same dimensions
+    local images = {}
+    local function tileimage(w, h)
+        local key = w .. "x" .. h
+        local img = images[key]
+        if not img then
+            img = image.image(w, h, "unorm8")
+            images[key] = img
+        end
+        return img
+    end
+    local ntiles, done = 0, 0
+    for level = 0, maxlevel do
+        local s = 2^(maxlevel-level)
+        local lw, lh = math.ceil(width/s), math.ceil(height/s)
+        ntiles = ntiles + math.ceil(lw/tilesize)*math.ceil(lh/tilesize)
+    end
+    for level = maxlevel, 0, -1 do
+        local s = 2^(maxlevel-level)
+        local lw, lh = math.ceil(width/s), math.ceil(height/s)
+        os.execute(string.format('mkdir "%s/%d"', dir, level))
+        for row = 0, math.ceil(lh/tilesize)-1 do
+            for col = 0, math.ceil(lw/tilesize)-1 do
+                stderr("\r%d%%", floor(1000*done/ntiles)/10)
+                local x0, y0 = col*tilesize, row*tilesize
+                local tw = min(tilesize, lw-x0)
+                local th = min(tilesize, lh-y0)
+                local tile = tileimage(tw, th)
+                -- tile rows go top-down, image rows bottom-up
+                for i = 1, th do
+                    local y = max(vymax-(y0+th-i+.5)*s, vymin+.5)
+                    for j = 1, tw do
+                        local x = min(vxmin+(x0+j-.5)*s, vxmax-.5)
+                        tile:set(j, i, sample(x, y))
+                    end
+                end
+                local file = assert(io.open(string.format("%s/%d/%d_%d.png",
+                    dir, level, col, row), "wb"))
+                image.png.store8(file, tile)
+                file:close()
+                done = done + 1
+            end
+        end
+    end
+    stderr("\r100%%\n")
+    output:write(string.format([[
+<?xml version="1.0" encoding="UTF-8"?>
+<Image xmlns="http://schemas.microsoft.com/deepzoom/2008"
+  Format="png" Overlap="0" TileSize="%d">
+  <Size Width="%d" Height="%d"/>
+</Image>
+]], tilesize, width, height))
+    return ntiles
+end
+
+-- returns a function that samples row i of the viewport into row ii
+-- of rowimage
+local function newrowsampler(scene, viewport, sample, spans)
+    local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+    local width = vxmax-vxmin
+    local colors = {}
+    scene.span = {}
+    return function(i, rowimage, ii)
+        if spans then
+            -- the whole row at once, composited from the bottom up
+            samplespan(scene, vxmin+.5, vymin+i-.5, width, colors)
+            for j = 1, width do
+                rowimage:set(j, ii, unpack(colors, 4*j-3, 4*j))
+            end
+        else
+            for j = 1, width do
+                local x, y = vxmin+j-.5, vymin+i-.5
+                local r, g, b, a = sample(scene, x, y)
+                rowimage:set(j, ii, r, g, b, a)
+            end
+        end
+    end
+end
+
+-- used by bands.lua in each of the threads of -threads. options holds
+-- the settings and whether to sample by spans
+function _M.rows(scene, viewport, options)
+    local settings = options.settings
+    local sample = settings.fronttoback and samplefronttoback or sample
+    local cull = options.lod and
+        newculler(scene.xf, viewport, options.lod, settings.fixed)
+    scene = preparescene(scene, settings.atlas, settings.tolerance,
+        settings.fixed, cull)
+    return newrowsampler(scene, viewport, sample, options.spans)
+end
+
 function _M.render(scene, viewport, output, arguments)
     local maxdepth = MAX_DEPTH
     local scenetree = false
+    local tiles, tilesize = nil, 256
+    local stream = false
+    local encoder = image.png
+    local spans = false
+    local threads = 1
+    local lod = false
+    local settings = newsettings()
     -- dump arguments
     if #arguments > 0 then stderr("driver arguments:\n") end
     for i, argument in ipairs(arguments) do
@@ -946,30 +1812,100 @@ function _M.render(scene, viewport, output, arguments)
     end
     -- list of supported options
     -- you can add your own options as well
-    local options = {
+    local options = samplingoptions(settings, {
         { "^%-tosvg$", function(d)
             if not d then return false end
             scenetree = true
             return true
         end },
-        { ".*", function(all)
-            error("unrecognized option " .. all)
-        end }
-    }
-    -- process options
-    for i, argument in ipairs(arguments) do
-        for j, option in ipairs(options) do
-            if option[2](argument:match(option[1])) then
-                break
+        { "^%-stream$", function(d)
+            if not d then return false end
+            stream = true
+            return true
+        end },
+        { "^(%-format:(.+))$", function(all, name)
+            if not name then return false end
+            -- formats that can store and stream 8-bit rgba
+            assert(name == "png" or name == "pam" or name == "ppm" or
+                name == "qoi", "invalid option " .. all)
+            encoder = image[name]
+            return true
+        end },
+        { "^%-spans$", function(d)
+            if not d then return false end
+            spans = true
+            return true
+        end },
+        { "^(%-tiles:(.+))$", function(all, n)
+            if not n then return false end
+            tiles = n
+            return true
+        end },
+        { "^(%-tilesize:(%d+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "invalid option " .. all)
+            n = assert(tonumber(n), "invalid option " .. all)
+            assert(n >= 1, "invalid option " .. all)
+            tilesize = math.floor(n)
+            return true
+        end },
+        -- -lod:0 only leaves out what no pixel center would see
+        { "^(%-lod(.*))$", function(all, e)
+            if not e then return false end
+            lod = LOD_AREA
+            if e ~= "" then
+                lod = assert(tonumber(e:match("^:(.+)$")),
+                    "invalid option " .. all)
+                assert(lod >= 0, "invalid option " .. all)
             end
-        end
-    end
+            return true
+        end },
+        { "^(%-threads:(%d+)(.*))$", function(all, n, e)
+            if not n then return false end
+            assert(e == "", "invalid option " .. all)
+            n = assert(tonumber(n), "invalid option " .. all)
+            assert(n >= 1, "invalid option " .. all)
+            threads = math.floor(n)
+            return true
+        end },
+    })
+    processoptions(arguments, options)
+    assert(threads == 1 or not (scenetree or tiles or stream),
+        "-threads only works when rendering the whole image at once")
+    -- coarser tile levels sample between pixel centers
+    assert(not (lod and tiles), "-lod does not work with -tiles")
+    -- composite from the top element down if asked to
+    local sample = settings.fronttoback and samplefronttoback or sample
     -- create timer
     local time = chronos.chronos()
     -- make sure scene does not contain any unsuported content
     checkscene(scene)
+    if threads > 1 then
+        -- each thread prepares its own copy of the scene, and images
+        -- cannot be copied into other threads
+        for i, element in ipairs(scene.elements) do
+            assert(element.paint.type ~= "texture",
+                "-threads does not support textures")
+        end
+        local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
+        local outputimage = image.image(vxmax-vxmin, vymax-vymin, "unorm8")
+        require"bands".render(threads, DRIVER, outputimage, scene, viewport,
+            { settings = settings, spans = spans, lod = lod })
+        stderr("rendering with %d threads in %.3fs\n", threads,
+            time:elapsed())
+        time:reset()
+        encoder.store8(output, outputimage)
+        stderr("saved in %.3fs\n", time:elapsed())
+        return
+    end
     -- prepare scene for rendering
-    scene = preparescene(scene)
+    local total = #scene.elements
+    local cull = lod and newculler(scene.xf, viewport, lod, settings.fixed)
+    scene = preparescene(scene, settings.atlas, settings.tolerance,
+        settings.fixed, cull)
+    if cull then
+        stderr("%d of %d elements culled\n", total-#scene.elements, total)
+    end
     -- get viewport
     local vxmin, vymin, vxmax, vymax = unpack(viewport, 1, 4)
     -- get image width and height from viewport
@@ -982,22 +1918,43 @@ function _M.render(scene, viewport, output, arguments)
         stderr("scene to svg in %.3fs\n", time:elapsed())
         os.exit()
     end
+    if tiles then
+        -- write tile pyramid and its descriptor into output
+        local ntiles = rendertiles(function(x, y)
+            return sample(scene, x, y)
+        end, viewport, output, tiles, tilesize)
+        stderr("%d tiles in %.3fs\n", ntiles, time:elapsed())
+        return
+    end
+    local samplerow = newrowsampler(scene, viewport, sample, spans)
+    if stream then
+        -- render rows top to bottom, as the encoders want them,
+        -- and hand each one over while the next one is rendered
+        local rowimage = image.image(width, 1, "unorm8")
+        local rows = encoder.stream8(output, width, height)
+        for i = height, 1, -1 do
+            stderr("\r%d%%", floor(1000*(height-i+1)/height)/10)
+            samplerow(i, rowimage, 1)
+            rows:write(rowimage)
+        end
+        rows:close()
+        stderr("\n")
+        stderr("rendering and saving in %.3fs\n", time:elapsed())
+        return
+    end
     -- allocate output image
-    local outputimage = image.image(width, height)
+    -- it is only ever stored with 8 bits per channel, so keep it that way
+    local outputimage = image.image(width, height, "unorm8")
     -- render
     for i = 1, height do
         stderr("\r%d%%", floor(1000*i/height)/10)
-        for j = 1, width do
-            local x, y = vxmin+j-.5, vymin+i-.5
-            local r, g, b, a = sample(scene, x, y)
-            outputimage:set(j, i, r, g, b, a)
-        end
+        samplerow(i, outputimage, i)
     end
     stderr("\n")
     stderr("rendering in %.3fs\n", time:elapsed())
     time:reset()
     -- store output image
-    image.png.store8(output, outputimage)
+    encoder.store8(output, outputimage)
     stderr("saved in %.3fs\n", time:elapsed())
 end
 
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <limits>
+
+#include "bvh.h"
+
+namespace {
+
+const int BINS = 16;       // candidate split planes per node
+const int LEAF_SIZE = 2;   // never split nodes this small
+const int MAX_DEPTH = 48;  // bounds the traversal stack
+const double TRAVERSAL_COST = 1.0; // relative to a box test
+const int MIN_LOOSE = 32;  // boxes outside the tree before a rebuild,
+const int LOOSE_RATIO = 8; // or this fraction of all boxes if larger
+
+bvh::box empty(void) {
+    const double inf = std::numeric_limits<double>::infinity();
+    bvh::box b = { inf, inf, -inf, -inf };
+    return b;
+}
+
+void grow(bvh::box &b, const bvh::box &o) {
+    b.xmin = std::min(b.xmin, o.xmin);
+    b.ymin = std::min(b.ymin, o.ymin);
+    b.xmax = std::max(b.xmax, o.xmax);
+    b.ymax = std::max(b.ymax, o.ymax);
+}
+
+void grow(bvh::box &b, double x, double y) {
+    b.xmin = std::min(b.xmin, x);
+    b.ymin = std::min(b.ymin, y);
+    b.xmax = std::max(b.xmax, x);
+    b.ymax = std::max(b.ymax, y);
+}
+
+// in 2D, the half perimeter plays the role of the surface area.
+// unlike the area, it does not vanish for horizontal or vertical
+// slivers, which are common in vector art
+double cost(const bvh::box &b) {
+    if (b.xmin > b.xmax) return 0.;
+    return (b.xmax-b.xmin) + (b.ymax-b.ymin);
+}
+
+double center(const bvh::box &b, int axis) {
+    return axis == 0? .5*(b.xmin+b.xmax): .5*(b.ymin+b.ymax);
+}
+
+bool contains(const bvh::box &b, double x, double y) {
+    return b.xmin <= x && x <= b.xmax && b.ymin <= y && y <= b.ymax;
+}
+
+}
+
+void
+bvh::
+build(const std::vector<box> &boxes) {
+    m_boxes = boxes;
+    m_indices.clear();
+    m_nodes.clear();
+    m_parents.clear();
+    m_loose.clear();
+    m_leaves.assign(m_boxes.size(), -1);
+    for (int i = 0; i < static_cast<int>(m_boxes.size()); i++) {
+        const box &b = m_boxes[i];
+        if (b.xmin <= b.xmax && b.ymin <= b.ymax) m_indices.push_back(i);
+    }
+    if (m_indices.empty()) return;
+    m_nodes.reserve(2*m_indices.size());
+    m_parents.reserve(2*m_indices.size());
+    m_nodes.push_back(node());
+    m_parents.push_back(-1);
+    subdivide(0, 0, static_cast<int>(m_indices.size()), 0);
+    for (int n = 0; n < static_cast<int>(m_nodes.size()); n++) {
+        const node &nd = m_nodes[n];
+        for (int i = nd.first; i < nd.first+nd.count; i++) {
+            m_leaves[m_indices[i]] = n;
+        }
+    }
+}
+
+void
+bvh::
+subdivide(int n, int first, int count, int depth) {
+    box bounds = empty(), centers = empty();
+    for (int i = first; i < first+count; i++) {
+        const box &b = m_boxes[m_indices[i]];
+        grow(bounds, b);
+        grow(centers, center(b, 0), center(b, 1));
+    }
+    m_nodes[n].bounds = bounds;
+    m_nodes[n].first = first;
+    m_nodes[n].count = count;
+    if (count <= LEAF_SIZE || depth >= MAX_DEPTH) return;
+    // bin box centers along the axis where they spread the most
+    int axis = (centers.xmax-centers.xmin >= centers.ymax-centers.ymin)? 0: 1;
+    double lo = axis == 0? centers.xmin: centers.ymin;
+    double hi = axis == 0? centers.xmax: centers.ymax;
+    if (!(hi > lo)) return;
+    double scale = BINS/(hi-lo);
+    int bincount[BINS] = { 0 };
+    box binbounds[BINS];
+    std::fill(binbounds, binbounds+BINS, empty());
+    for (int i = first; i < first+count; i++) {
+        const box &b = m_boxes[m_indices[i]];
+        int k = std::min(BINS-1, static_cast<int>((center(b, axis)-lo)*scale));
+        bincount[k]++;
+        grow(binbounds[k], b);
+    }
+    // sweep from the right to get the cost of every right side,
+    // then from the left to find the cheapest split plane
+    double rightcost[BINS];
+    box right = empty();
+    int nright = 0;
+    for (int k = BINS-1; k > 0; k--) {
+        grow(right, binbounds[k]);
+        nright += bincount[k];
+        rightcost[k] = nright*cost(right);
+    }
+    box left = empty();
+    int nleft = 0, best = -1;
+    double bestcost = std::numeric_limits<double>::infinity();
+    for (int k = 0; k < BINS-1; k++) {
+        grow(left, binbounds[k]);
+        nleft += bincount[k];
+        double c = nleft*cost(left) + rightcost[k+1];
+        if (nleft > 0 && nleft < count && c < bestcost) {
+            bestcost = c;
+            best = k;
+        }
+    }
+    if (best < 0) return;
+    // splitting must beat testing every box in the node
+    double parent = cost(bounds);
+    if (TRAVERSAL_COST*parent + bestcost >= count*parent) return;
+    int *mid = std::partition(&m_indices[first], &m_indices[first]+count,
+        [&](int i) {
+            int k = static_cast<int>((center(m_boxes[i], axis)-lo)*scale);
+            return std::min(BINS-1, k) <= best;
+        });
+    int nfirst = static_cast<int>(mid-&m_indices[0]) - first;
+    int child = static_cast<int>(m_nodes.size());
+    m_nodes[n].first = child;
+    m_nodes[n].count = 0;
+    m_nodes.push_back(node());
+    m_nodes.push_back(node());
+    m_parents.push_back(n);
+    m_parents.push_back(n);
+    subdivide(child, first, nfirst, depth+1);
+    subdivide(child+1, first+nfirst, count-nfirst, depth+1);
+}
+
+void
+bvh::
+query(double x, double y, std::vector<int> &found) const {
+    found.clear();
+    if (m_nodes.empty()) return;
+    int stack[MAX_DEPTH+2];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const node &nd = m_nodes[stack[--top]];
+        if (!contains(nd.bounds, x, y)) continue;
+        if (nd.count > 0) {
+            for (int i = nd.first; i < nd.first+nd.count; i++) {
+                if (contains(m_boxes[m_indices[i]], x, y))
+                    found.push_back(m_indices[i]);
+            }
+        } else {
+            stack[top++] = nd.first+1;
+            stack[top++] = nd.first;
+        }
+    }
+    for (int i: m_loose) {
+        if (contains(m_boxes[i], x, y)) found.push_back(i);
+    }
+    std::sort(found.begin(), found.end());
+}
+
+void
+bvh::
+refit(int n) {
+    while (n >= 0) {
+        node &nd = m_nodes[n];
+        box bounds = empty();
+        if (nd.count > 0) {
+            for (int i = nd.first; i < nd.first+nd.count; i++) {
+                grow(bounds, m_boxes[m_indices[i]]);
+            }
+        } else {
+            grow(bounds, m_nodes[nd.first].bounds);
+            grow(bounds, m_nodes[nd.first+1].bounds);
+        }
+        nd.bounds = bounds;
+        n = m_parents[n];
+    }
+}
+
+// boxes outside the tree are cheap to add but slow to query,
+// so rebuild once there are too many of them
+void
+bvh::
+loosen(int i) {
+    if (std::find(m_loose.begin(), m_loose.end(), i) == m_loose.end()) {
+        m_loose.push_back(i);
+    }
+    int limit = std::max(MIN_LOOSE, size()/LOOSE_RATIO);
+    if (static_cast<int>(m_loose.size()) > limit) build(m_boxes);
+}
+
+void
+bvh::
+update(int i, const box &b) {
+    m_boxes[i] = b;
+    if (m_leaves[i] >= 0) refit(m_leaves[i]);
+    else if (b.xmin <= b.xmax && b.ymin <= b.ymax) loosen(i);
+}
+
+int
+bvh::
+append(const box &b) {
+    int i = size();
+    m_boxes.push_back(b);
+    m_leaves.push_back(-1);
+    if (b.xmin <= b.xmax && b.ymin <= b.ymax) loosen(i);
+    return i;
+}
@@ -0,0 +1,55 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+
+// bounding volume hierarchy over axis-aligned boxes
+// built with a binned surface area heuristic
+class bvh {
+public:
+    struct box {
+        double xmin, ymin, xmax, ymax;
+    };
+
+    bvh(void) { }
+
+    // boxes with xmin > xmax or ymin > ymax are empty and never found
+    void build(const std::vector<box> &boxes);
+
+    // replaces contents of found with the indices of all boxes
+    // containing x,y, in increasing order
+    void query(double x, double y, std::vector<int> &found) const;
+
+    // changes box i in place, refitting the nodes above it. an empty
+    // box removes it from queries without changing any indices
+    void update(int i, const box &b);
+
+    // adds a box with the next index. added boxes are kept outside the
+    // tree and tested one by one until there are enough of them to
+    // make rebuilding worth it
+    int append(const box &b);
+
+    int size(void) const { return static_cast<int>(m_boxes.size()); }
+    int nodes(void) const { return static_cast<int>(m_nodes.size()); }
+
+private:
+    // leaves have count > 0 and own m_indices[first..first+count)
+    // inner nodes have count == 0 and children first and first+1
+    struct node {
+        box bounds;
+        int first, count;
+    };
+
+    void subdivide(int n, int first, int count, int depth);
+    void refit(int n);
+    void loosen(int i);
+
+    std::vector<box> m_boxes;
+    std::vector<int> m_indices;
+    std::vector<node> m_nodes;
+    std::vector<int> m_parents; // of each node, -1 for the root
+    std::vector<int> m_leaves;  // holding each box, -1 if not in tree
+    std::vector<int> m_loose;   // boxes outside the tree
+};
+
+#endif // BVH_H
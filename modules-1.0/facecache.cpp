@@ -0,0 +1,176 @@
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "facecache.h"
+
+// a font file mapped into memory, shared by the faces that use it
+struct facecache::file {
+    std::string path;
+    const FT_Byte *data;
+    size_t size;
+    int refs;
+#ifdef _WIN32
+    HANDLE handle, mapping;
+#endif
+};
+
+// never destroyed, since faces may outlive static destructors
+facecache &facecache::instance(void) {
+    static facecache *cache = new facecache;
+    return *cache;
+}
+
+facecache::file *facecache::map(const std::string &path) {
+    std::map<std::string, file *>::iterator it = m_files.find(path);
+    if (it != m_files.end()) {
+        it->second->refs++;
+        return it->second;
+    }
+    file *f = new (std::nothrow) file;
+    if (!f) return NULL;
+    f->path = path;
+    f->refs = 1;
+#ifdef _WIN32
+    f->handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (f->handle == INVALID_HANDLE_VALUE ||
+        !GetFileSizeEx(f->handle, &size) || size.QuadPart == 0) {
+        if (f->handle != INVALID_HANDLE_VALUE) CloseHandle(f->handle);
+        delete f;
+        return NULL;
+    }
+    f->size = static_cast<size_t>(size.QuadPart);
+    f->mapping = CreateFileMappingA(f->handle, NULL, PAGE_READONLY, 0, 0,
+        NULL);
+    f->data = f->mapping? static_cast<const FT_Byte *>(
+        MapViewOfFile(f->mapping, FILE_MAP_READ, 0, 0, 0)): NULL;
+    if (!f->data) {
+        if (f->mapping) CloseHandle(f->mapping);
+        CloseHandle(f->handle);
+        delete f;
+        return NULL;
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        delete f;
+        return NULL;
+    }
+    f->size = static_cast<size_t>(st.st_size);
+    void *data = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if (data == MAP_FAILED) {
+        delete f;
+        return NULL;
+    }
+    f->data = static_cast<const FT_Byte *>(data);
+#endif
+    m_files[path] = f;
+    return f;
+}
+
+void facecache::unmap(file *f) {
+    if (--f->refs > 0) return;
+    m_files.erase(f->path);
+#ifdef _WIN32
+    UnmapViewOfFile(f->data);
+    CloseHandle(f->mapping);
+    CloseHandle(f->handle);
+#else
+    munmap(const_cast<FT_Byte *>(f->data), f->size);
+#endif
+    delete f;
+}
+
+void facecache::destroy(entry *e) {
+    m_faces.erase(e->m_key);
+    FT_Done_Face(e->m_face);
+    unmap(e->m_file);
+    delete e;
+}
+
+void facecache::evict(size_t keep) {
+    while (m_idle.size() > keep) {
+        entry *e = m_idle.back();
+        m_idle.pop_back();
+        destroy(e);
+    }
+}
+
+facecache::entry *facecache::acquire(const std::string &path, int index,
+        FT_Error &error) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    error = 0;
+    std::map<key, entry *>::iterator it = m_faces.find(key(path, index));
+    if (it != m_faces.end()) {
+        entry *e = it->second;
+        if (e->m_refs++ == 0) m_idle.erase(e->m_idle);
+        return e;
+    }
+    if (!m_library) {
+        error = FT_Init_FreeType(&m_library);
+        if (error) {
+            m_library = NULL;
+            return NULL;
+        }
+    }
+    file *f = map(path);
+    if (!f) {
+        error = FT_Err_Cannot_Open_Resource;
+        return NULL;
+    }
+    entry *e = new (std::nothrow) entry;
+    if (!e) {
+        unmap(f);
+        error = FT_Err_Out_Of_Memory;
+        return NULL;
+    }
+    error = FT_New_Memory_Face(m_library, f->data,
+        static_cast<FT_Long>(f->size), index, &e->m_face);
+    if (error) {
+        unmap(f);
+        delete e;
+        return NULL;
+    }
+    e->m_file = f;
+    e->m_refs = 1;
+    e->m_key = key(path, index);
+    m_faces[e->m_key] = e;
+    return e;
+}
+
+void facecache::release(entry *e) {
+    if (!e) return;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--e->m_refs > 0) return;
+    m_idle.push_front(e);
+    e->m_idle = m_idle.begin();
+    evict(m_limit);
+}
+
+size_t facecache::limit(size_t faces) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t old = m_limit;
+    m_limit = faces;
+    evict(m_limit);
+    return old;
+}
+
+size_t facecache::trim(void) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t n = m_idle.size();
+    evict(0);
+    return n;
+}
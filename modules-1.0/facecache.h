@@ -0,0 +1,72 @@
+#ifndef FACECACHE_H
+#define FACECACHE_H
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+// process-wide registry of FreeType faces keyed by path and face index.
+// font files are memory-mapped once, and faces are shared by every Lua
+// state and thread that asks for them. faces nobody references are
+// kept up to a limit, and evicted least recently used first
+class facecache final {
+public:
+    class entry;
+
+    static facecache &instance(void);
+
+    // referenced entry for face index of path, or null with error set
+    entry *acquire(const std::string &path, int index, FT_Error &error);
+    // drop a reference obtained from acquire
+    void release(entry *e);
+    // how many unreferenced faces to keep. returns the old limit
+    size_t limit(size_t faces);
+    // evict all unreferenced faces, returning how many there were
+    size_t trim(void);
+
+private:
+    struct file;
+    typedef std::pair<std::string, int> key;
+
+    facecache(void): m_library(NULL), m_limit(64) { }
+    facecache(const facecache &) = delete;
+    facecache &operator=(const facecache &) = delete;
+
+    file *map(const std::string &path);
+    void unmap(file *f);
+    void evict(size_t keep);
+    void destroy(entry *e);
+
+    std::mutex m_mutex;
+    FT_Library m_library;
+    std::map<key, entry *> m_faces;
+    std::map<std::string, file *> m_files;
+    std::list<entry *> m_idle; // most recently released first
+    size_t m_limit;
+};
+
+class facecache::entry final {
+public:
+    // FreeType faces are not thread safe, so hold lock() around any
+    // use of face()
+    FT_Face face(void) const { return m_face; }
+    std::mutex &lock(void) { return m_lock; }
+
+private:
+    friend class facecache;
+    entry(void): m_face(NULL), m_file(NULL), m_refs(0) { }
+
+    FT_Face m_face;
+    file *m_file;
+    int m_refs;
+    key m_key;
+    std::list<entry *>::iterator m_idle;
+    std::mutex m_lock;
+};
+
+#endif // FACECACHE_H
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <cmath>
+
+#include "flatten.h"
+
+namespace flatten {
+
+// number of uniform pieces that keep the error of chords through a
+// curve with second derivative bounded by dd within tol. a chord over
+// a parameter step h is off by at most dd*h^2/8
+static int pieces(double dd, double tol) {
+    double n = std::ceil(std::sqrt(dd/(8.*tol)));
+    if (!(n >= 1.)) return 1;
+    return n > MAX_PIECES? MAX_PIECES: static_cast<int>(n);
+}
+
+void quadratic(double x0, double y0, double x1, double y1,
+    double x2, double y2, double tol, std::vector<double> &out) {
+    // the second derivative is the constant 2*(p0 - 2*p1 + p2)
+    double dd = 2.*std::hypot(x0-2.*x1+x2, y0-2.*y1+y2);
+    int n = pieces(dd, tol);
+    for (int i = 1; i < n; i++) {
+        double t = double(i)/n, s = 1.-t;
+        double a = s*s, b = 2.*s*t, c = t*t;
+        out.push_back(a*x0+b*x1+c*x2);
+        out.push_back(a*y0+b*y1+c*y2);
+    }
+    out.push_back(x2);
+    out.push_back(y2);
+}
+
+void cubic(double x0, double y0, double x1, double y1, double x2,
+    double y2, double x3, double y3, double tol, std::vector<double> &out) {
+    // the second derivative goes linearly from 6*(p0 - 2*p1 + p2)
+    // to 6*(p1 - 2*p2 + p3), so it is largest at an end
+    double dd = 6.*std::max(std::hypot(x0-2.*x1+x2, y0-2.*y1+y2),
+        std::hypot(x1-2.*x2+x3, y1-2.*y2+y3));
+    int n = pieces(dd, tol);
+    for (int i = 1; i < n; i++) {
+        double t = double(i)/n, s = 1.-t;
+        double a = s*s*s, b = 3.*s*s*t, c = 3.*s*t*t, d = t*t*t;
+        out.push_back(a*x0+b*x1+c*x2+d*x3);
+        out.push_back(a*y0+b*y1+c*y2+d*y3);
+    }
+    out.push_back(x3);
+    out.push_back(y3);
+}
+
+// the curve stays inside the triangle of its control points when the
+// weight is positive, so it is flat enough once the middle control
+// point is within tol of the chord
+static bool flat(double x0, double y0, double x1, double y1, double w1,
+    double x2, double y2, double tol) {
+    if (w1 <= 0.) return false;
+    double cx = x1/w1-x0, cy = y1/w1-y0;
+    double dx = x2-x0, dy = y2-y0;
+    double len2 = dx*dx+dy*dy;
+    // the closest point of the chord to the control point
+    double t = len2 > 0.? (cx*dx+cy*dy)/len2: 0.;
+    t = std::min(1., std::max(0., t));
+    return std::hypot(cx-t*dx, cy-t*dy) <= tol;
+}
+
+// cuts the curve in half at the parameter midpoint until it is flat,
+// renormalizing both halves to unit end weights. depth 10 gives the
+// same MAX_PIECES limit as the uniform cuts
+static void rational(double x0, double y0, double x1, double y1,
+    double w1, double x2, double y2, double tol, int depth,
+    std::vector<double> &out) {
+    double wm = .5*(1.+w1);
+    if (depth >= 10 || wm <= 0. || flat(x0, y0, x1, y1, w1, x2, y2, tol)) {
+        out.push_back(x2);
+        out.push_back(y2);
+        return;
+    }
+    double xm = .25*(x0+2.*x1+x2)/wm, ym = .25*(y0+2.*y1+y2)/wm;
+    double r = 1./std::sqrt(wm);
+    rational(x0, y0, .5*(x0+x1)*r, .5*(y0+y1)*r, wm*r, xm, ym, tol,
+        depth+1, out);
+    rational(xm, ym, .5*(x1+x2)*r, .5*(y1+y2)*r, wm*r, x2, y2, tol,
+        depth+1, out);
+}
+
+void rational_quadratic(double x0, double y0, double x1, double y1,
+    double w1, double x2, double y2, double tol, std::vector<double> &out) {
+    rational(x0, y0, x1, y1, w1, x2, y2, tol, 0, out);
+}
+
+} // namespace flatten
@@ -0,0 +1,27 @@
+#ifndef FLATTEN_H
+#define FLATTEN_H
+
+#include <vector>
+
+// approximate curve segments by polylines whose distance to the curve
+// is at most tol. the vertices after the first control point are
+// appended to out as x1, y1, x2, y2, ..., and the last one is always
+// exactly the last control point. vertices are points on the curve,
+// in order, so monotonic segments give monotonic polylines
+namespace flatten {
+    // most pieces a single segment is cut into
+    const int MAX_PIECES = 1024;
+
+    void quadratic(double x0, double y0, double x1, double y1,
+        double x2, double y2, double tol, std::vector<double> &out);
+    // the middle control point x1, y1 is in homogeneous coordinates,
+    // already multiplied by w1
+    void rational_quadratic(double x0, double y0, double x1, double y1,
+        double w1, double x2, double y2, double tol,
+        std::vector<double> &out);
+    void cubic(double x0, double y0, double x1, double y1, double x2,
+        double y2, double x3, double y3, double tol,
+        std::vector<double> &out);
+} // namespace flatten
+
+#endif // FLATTEN_H
@@ -1,77 +1,309 @@
+#include <algorithm>
 #include <cstddef>
+#include <cstdlib>
+#include <new>
 #include "image.h"
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 namespace image {
 
-void RGBA::resize(int width, int height) {
-    size_t old_size = m_red.size();
-    size_t size = size_t(width*height);
-    assert(old_size == m_green.size() && old_size == m_blue.size() &&
-        old_size == m_alpha.size());
-    if (size > old_size || 2*size < old_size) {
-        m_red.resize(size);
-        m_green.resize(size);
-        m_blue.resize(size);
-        m_alpha.resize(size);
-        m_width = width;
-        m_height = height;
+// never destroyed, since images may outlive static destructors
+pool &pool::instance(void) {
+    static pool *p = new pool;
+    return *p;
+}
+
+static void *aligned_alloc_block(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, pool::ALIGNMENT);
+#else
+    void *block = NULL;
+    if (posix_memalign(&block, pool::ALIGNMENT, size) != 0) return NULL;
+    return block;
+#endif
+}
+
+static void aligned_free_block(void *block) {
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+// blocks come in four sizes per power of two, so at most a quarter
+// of a block goes unused. returns -1 if bytes is too large
+static int sizeclass(size_t bytes, size_t &size) {
+    for (int k = 6; k < int(sizeof(size_t)*8) - 1; k++) {
+        for (int m = 0; m < 4; m++) {
+            size = size_t(4+m) << (k-2);
+            if (size >= bytes) return 4*k+m;
+        }
+    }
+    return -1;
+}
+
+void *pool::acquire(size_t bytes, size_t &size) {
+    int k = sizeclass(bytes, size);
+    if (k < 0) return NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_free[k].empty()) {
+            void *block = m_free[k].back();
+            m_free[k].pop_back();
+            m_idle -= size;
+            return block;
+        }
+    }
+    return aligned_alloc_block(size);
+}
+
+void pool::release(void *block, size_t size) {
+    if (!block) return;
+    size_t actual = 0;
+    int k = sizeclass(size, actual);
+    assert(k >= 0 && actual == size);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_idle + size <= m_limit) {
+            m_free[k].push_back(block);
+            m_idle += size;
+            return;
+        }
+    }
+    aligned_free_block(block);
+}
+
+size_t pool::trim(void) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t freed = m_idle;
+    for (size_t k = 0; k < sizeof(m_free)/sizeof(m_free[0]); k++) {
+        for (size_t i = 0; i < m_free[k].size(); i++)
+            aligned_free_block(m_free[k][i]);
+        m_free[k].clear();
+    }
+    m_idle = 0;
+    return freed;
+}
+
+size_t pool::idle(void) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_idle;
+}
+
+void pool::limit(size_t bytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_limit = bytes;
+}
+
+template <typename F, alpha_mode A>
+basic_RGBA<F, A>::basic_RGBA(const basic_RGBA &other):
+    m_width(0), m_height(0), m_capacity(0), m_size(0),
+    m_red(NULL), m_green(NULL), m_blue(NULL), m_alpha(NULL) {
+    *this = other;
+}
+
+template <typename F, alpha_mode A>
+basic_RGBA<F, A> &basic_RGBA<F, A>::operator=(const basic_RGBA &other) {
+    if (this != &other) {
+        resize(other.m_width, other.m_height);
+        size_t n = size_t(m_width)*m_height*sizeof(type);
+        if (n > 0) {
+            memcpy(m_red, other.m_red, n);
+            memcpy(m_green, other.m_green, n);
+            memcpy(m_blue, other.m_blue, n);
+            memcpy(m_alpha, other.m_alpha, n);
+        }
     }
+    return *this;
 }
 
-void RGBA::load(int width, int height, const float *red,
+template <typename F, alpha_mode A>
+basic_RGBA<F, A>::~basic_RGBA() {
+    pool::instance().release(m_red, m_size);
+}
+
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::reallocate(size_t pixels, bool keep) {
+    type *data = NULL;
+    size_t size = 0, capacity = 0;
+    if (pixels > 0) {
+        // round planes up so each one starts aligned
+        const size_t align = pool::ALIGNMENT/sizeof(type);
+        pixels = (pixels + align-1)/align*align;
+        data = static_cast<type *>(pool::instance().acquire(
+            4*pixels*sizeof(type), size));
+        if (!data) throw std::bad_alloc();
+        capacity = size/(4*sizeof(type))/align*align;
+    }
+    size_t n = std::min(capacity, size_t(m_width)*m_height);
+    if (keep && n > 0) {
+        memcpy(data, m_red, n*sizeof(type));
+        memcpy(data+capacity, m_green, n*sizeof(type));
+        memcpy(data+2*capacity, m_blue, n*sizeof(type));
+        memcpy(data+3*capacity, m_alpha, n*sizeof(type));
+    }
+    pool::instance().release(m_red, m_size);
+    m_size = size;
+    m_capacity = capacity;
+    m_red = data;
+    m_green = data? data+capacity: NULL;
+    m_blue = data? data+2*capacity: NULL;
+    m_alpha = data? data+3*capacity: NULL;
+}
+
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::resize(int width, int height) {
+    assert(width >= 0 && height >= 0);
+    size_t pixels = size_t(width)*size_t(height);
+    if (pixels > m_capacity) reallocate(pixels, false);
+    m_width = width;
+    m_height = height;
+}
+
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::reserve(size_t pixels) {
+    if (pixels > m_capacity) reallocate(pixels, true);
+}
+
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::shrink(void) {
+    size_t pixels = size_t(m_width)*m_height;
+    if (pixels == 0) {
+        reallocate(0, false);
+        return;
+    }
+    // only worth it if the block would actually get smaller
+    size_t bytes = 4*pixels*sizeof(type);
+    if (2*bytes <= m_size) reallocate(pixels, true);
+}
+
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::clear(void) {
+    if (m_red) memset(m_red, 0, 4*m_capacity*sizeof(type));
+}
+
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::load(int width, int height, const float *red,
         const float *green, const float *blue, const float *alpha,
         int pitch, int advance) {
-    auto convert = [](float f) { return f; };
-    return load(width, height, red, green, blue, alpha,
-            pitch, advance, convert);
+    load_from<float32>(width, height, red, green, blue, alpha,
+            pitch, advance);
 }
 
-void RGBA::load(int width, int height, const unsigned short *red,
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::load(int width, int height, const unsigned short *red,
         const unsigned short *green, const unsigned short *blue,
         const unsigned short *alpha, int pitch, int advance) {
-    auto convert = [](unsigned short s) {
-        return (1.f/65535.f)*static_cast<float>(s); };
-    return load(width, height, red, green, blue, alpha,
-            pitch, advance, convert);
+    load_from<unorm16>(width, height, red, green, blue, alpha,
+            pitch, advance);
 }
 
-void RGBA::load(int width, int height, const unsigned char *red,
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::load(int width, int height, const unsigned char *red,
         const unsigned char *green, const unsigned char *blue,
         const unsigned char *alpha, int pitch, int advance) {
-    auto convert = [](unsigned char c) {
-        return (1.f/255.f)*static_cast<float>(c); };
-    return load(width, height, red, green, blue, alpha,
-            pitch, advance, convert);
+    resize(width, height);
+    if (!(red && green && blue && alpha)) return;
+    for (int i = 0; i < height; i++) {
+        load_row(i, red, green, blue, alpha, advance);
+        red += pitch;
+        green += pitch;
+        blue += pitch;
+        alpha += pitch;
+    }
 }
 
-void RGBA::store(int width, int height, float *red,
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::store(int width, int height, float *red,
         float *green, float *blue, float *alpha,
         int pitch, int advance) const {
-    auto convert = [](float f) { return f; };
-    return store(width, height, red, green, blue, alpha,
-            pitch, advance, convert);
+    assert(width == m_width && height == m_height);
+    if (!(red && green && blue && alpha)) return;
+    for (int i = 0; i < height; i++) {
+        int offset = i*pitch;
+        for (int j = 0; j < width; j++) {
+            store_to<float32>(i*width+j, red+offset, green+offset,
+                blue+offset, alpha+offset);
+            offset += advance;
+        }
+    }
 }
 
-void RGBA::store(int width, int height, unsigned short *red,
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::store(int width, int height, unsigned short *red,
         unsigned short *green, unsigned short *blue,
         unsigned short *alpha, int pitch, int advance) const {
-    auto convert = [](float f) {
-        f = f > 1.f? 1.f: (f < 0.f? 0.f: f);
-        return static_cast<unsigned short>(65535.f*f);
-    };
-    return store(width, height, red, green, blue, alpha,
-            pitch, advance, convert);
+    assert(width == m_width && height == m_height);
+    if (!(red && green && blue && alpha)) return;
+    for (int i = 0; i < height; i++) {
+        int offset = i*pitch;
+        for (int j = 0; j < width; j++) {
+            store_to<unorm16>(i*width+j, red+offset, green+offset,
+                blue+offset, alpha+offset);
+            offset += advance;
+        }
+    }
 }
 
-void RGBA::store(int width, int height, unsigned char *red,
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::store(int width, int height, unsigned char *red,
         unsigned char *green, unsigned char *blue,
         unsigned char *alpha, int pitch, int advance) const {
-    auto convert = [](float f) {
-        f = f > 1.f? 1.f: (f < 0.f? 0.f: f);
-        return static_cast<unsigned char>(255.f*f);
-    };
-    return store(width, height, red, green, blue, alpha,
-            pitch, advance, convert);
+    assert(width == m_width && height == m_height);
+    if (!(red && green && blue && alpha)) return;
+    for (int i = 0; i < height; i++) {
+        int offset = i*pitch;
+        for (int j = 0; j < width; j++) {
+            store_to<unorm8>(i*width+j, red+offset, green+offset,
+                blue+offset, alpha+offset);
+            offset += advance;
+        }
+    }
+}
+
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::store_row(int row, float *red, float *green,
+        float *blue, float *alpha, int advance) const {
+    assert(row >= 0 && row < m_height);
+    int offset = 0;
+    for (int j = 0; j < m_width; j++) {
+        store_to<float32>(row*m_width+j, red+offset, green+offset,
+            blue+offset, alpha+offset);
+        offset += advance;
+    }
 }
 
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::store_row(int row, unsigned short *red,
+        unsigned short *green, unsigned short *blue,
+        unsigned short *alpha, int advance) const {
+    assert(row >= 0 && row < m_height);
+    int offset = 0;
+    for (int j = 0; j < m_width; j++) {
+        store_to<unorm16>(row*m_width+j, red+offset, green+offset,
+            blue+offset, alpha+offset);
+        offset += advance;
+    }
+}
+
+template <typename F, alpha_mode A>
+void basic_RGBA<F, A>::store_row(int row, unsigned char *red,
+        unsigned char *green, unsigned char *blue,
+        unsigned char *alpha, int advance) const {
+    assert(row >= 0 && row < m_height);
+    int offset = 0;
+    for (int j = 0; j < m_width; j++) {
+        store_to<unorm8>(row*m_width+j, red+offset, green+offset,
+            blue+offset, alpha+offset);
+        offset += advance;
+    }
+}
+
+#define IMAGE_INSTANTIATE(F, A) template class basic_RGBA<F, alpha_mode::A>;
+IMAGE_FOR_EACH_RGBA(IMAGE_INSTANTIATE)
+#undef IMAGE_INSTANTIATE
+
 }  // namespace image
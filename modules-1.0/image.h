@@ -2,21 +2,155 @@
 #define IMAGE_H
 
 #include <vector>
+#include <mutex>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 
 namespace image {
 
-class RGBA final {
+// recycles the aligned blocks that hold image planes. block sizes
+// are rounded up to a few classes, and idle blocks are kept up to a
+// limit in bytes
+class pool final {
 public:
-    RGBA(void): m_width(0), m_height(0) { }
-    virtual ~RGBA() { }
+    static const size_t ALIGNMENT = 64;
 
-    const std::vector<float> &red(void) const { return m_red; }
-    const std::vector<float> &green(void) const { return m_green; }
-    const std::vector<float> &blue(void) const { return m_blue; }
-    const std::vector<float> &alpha(void) const { return m_alpha; }
+    static pool &instance(void);
 
+    // block of at least bytes, or null. size receives its actual size
+    void *acquire(size_t bytes, size_t &size);
+    // give block back for reuse
+    void release(void *block, size_t size);
+    // free all idle blocks and return how many bytes that was
+    size_t trim(void);
+    size_t idle(void);
+    void limit(size_t bytes);
+
+private:
+    pool(void): m_idle(0), m_limit(size_t(256) << 20) { }
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+
+    std::mutex m_mutex;
+    std::vector<void *> m_free[4*sizeof(size_t)*8]; // by size class
+    size_t m_idle, m_limit;
+};
+
+// how color channels are stored relative to alpha
+enum class alpha_mode { straight, premultiplied };
+
+// channel formats. each names its storage type and how it
+// converts to and from float. unorm formats clamp to [0,1] and round
+// to nearest, so that every level survives a trip through float
+struct float32 {
+    typedef float type;
+    static float decode(type v) { return v; }
+    static type encode(float f) { return f; }
+};
+
+struct float16 {
+    typedef unsigned short type;
+    static float decode(type h);
+    static type encode(float f);
+};
+
+struct unorm16 {
+    typedef unsigned short type;
+    static float decode(type s) {
+        return (1.f/65535.f)*static_cast<float>(s);
+    }
+    static type encode(float f) {
+        f = f > 1.f? 1.f: (f < 0.f? 0.f: f);
+        return static_cast<type>(65535.f*f+.5f);
+    }
+};
+
+struct unorm8 {
+    typedef unsigned char type;
+    static float decode(type c) {
+        return (1.f/255.f)*static_cast<float>(c);
+    }
+    static type encode(float f) {
+        f = f > 1.f? 1.f: (f < 0.f? 0.f: f);
+        return static_cast<type>(255.f*f+.5f);
+    }
+};
+
+// conversion between channel formats, resolved at compile time.
+// a format converts to itself by copying, others go through float
+template <typename S, typename D> struct convert {
+    static typename D::type apply(typename S::type v) {
+        return D::encode(S::decode(v));
+    }
+};
+
+template <typename F> struct convert<F, F> {
+    static typename F::type apply(typename F::type v) { return v; }
+};
+
+// exact rounding of v*255/65535, so that 16-bit values written from
+// 8-bit ones, i.e., c*257, come back as c
+template <> struct convert<unorm16, unorm8> {
+    static unorm8::type apply(unorm16::type v) {
+        return static_cast<unorm8::type>((v*255u+32895u) >> 16);
+    }
+};
+
+// 8-bit channels take one lookup per value into any format
+template <typename F> struct table8 {
+    typename F::type value[256];
+    float decoded[256];
+    table8(void) {
+        for (int v = 0; v < 256; v++) {
+            unorm8::type c = static_cast<unorm8::type>(v);
+            value[v] = convert<unorm8, F>::apply(c);
+            decoded[v] = unorm8::decode(c);
+        }
+    }
+    static const table8 &instance(void) {
+        static const table8 table;
+        return table;
+    }
+};
+
+// planar RGBA image with channels stored in format F.
+// get and set always work with straight alpha floats
+template <typename F, alpha_mode A = alpha_mode::straight>
+class basic_RGBA final {
+public:
+    typedef F format;
+    typedef typename F::type type;
+    static const bool premultiplied = A == alpha_mode::premultiplied;
+
+    basic_RGBA(void): m_width(0), m_height(0), m_capacity(0), m_size(0),
+        m_red(NULL), m_green(NULL), m_blue(NULL), m_alpha(NULL) { }
+    basic_RGBA(const basic_RGBA &other);
+    basic_RGBA &operator=(const basic_RGBA &other);
+    virtual ~basic_RGBA();
+
+    // planes hold width*height values each, row by row
+    const type *red(void) const { return m_red; }
+    const type *green(void) const { return m_green; }
+    const type *blue(void) const { return m_blue; }
+    const type *alpha(void) const { return m_alpha; }
+    type *red(void) { return m_red; }
+    type *green(void) { return m_green; }
+    type *blue(void) { return m_blue; }
+    type *alpha(void) { return m_alpha; }
+
+    // sets dimensions, leaving contents unspecified. allocates
+    // only if width*height is more than the current capacity
     void resize(int width, int height);
+    // makes room for pixels values per plane, keeping contents
+    void reserve(size_t pixels);
+    // gives unused capacity back to the pool, keeping contents
+    void shrink(void);
+    // number of pixels that fit without allocating
+    size_t capacity(void) const { return m_capacity; }
+    // zero all channels
+    void clear(void);
 
     void get(int x, int y, float &r, float &g, float &b, float &a) const;
     void get(int x, int y, float &r, float &g, float &b) const;
@@ -25,6 +159,7 @@ public:
     int width(void) const { return m_width; }
     int height(void) const { return m_height; }
 
+    // raw access: convert maps between T and the storage type
     template <typename T, typename C> void load(int width, int height,
             const T *red, const T *green, const T *blue, const T *alpha,
             int pitch, int advance, const C &convert);
@@ -33,6 +168,11 @@ public:
             T *red, T *green, T *blue, T *alpha,
             int pitch, int advance, const C &convert) const;
 
+    template <typename T, typename C> void store_row(int row,
+            T *red, T *green, T *blue, T *alpha,
+            int advance, const C &convert) const;
+
+    // buffers below hold straight alpha float32, unorm16, or unorm8
     void load(int width, int height, const float *red,
             const float *green, const float *blue, const float *alpha,
             int pitch, int advance);
@@ -57,39 +197,154 @@ public:
             unsigned char *green, unsigned char *blue,
             unsigned char *alpha, int pitch, int advance) const;
 
+    // fill one row (0 is the bottom row) of an already sized image
+    void load_row(int row, const unsigned short *red,
+            const unsigned short *green, const unsigned short *blue,
+            const unsigned short *alpha, int advance);
+
+    void load_row(int row, const unsigned char *red,
+            const unsigned char *green, const unsigned char *blue,
+            const unsigned char *alpha, int advance);
+
+    void store_row(int row, float *red, float *green, float *blue,
+            float *alpha, int advance) const;
+
+    void store_row(int row, unsigned short *red,
+            unsigned short *green, unsigned short *blue,
+            unsigned short *alpha, int advance) const;
+
+    void store_row(int row, unsigned char *red,
+            unsigned char *green, unsigned char *blue,
+            unsigned char *alpha, int advance) const;
+
 private:
+    template <typename S> void load_from(int width, int height,
+            const typename S::type *red, const typename S::type *green,
+            const typename S::type *blue, const typename S::type *alpha,
+            int pitch, int advance);
+
+    template <typename D> void store_to(int index, typename D::type *red,
+            typename D::type *green, typename D::type *blue,
+            typename D::type *alpha) const;
+
+    // replaces the block with room for pixels values per plane
+    void reallocate(size_t pixels, bool keep);
+
     int m_width, m_height;
-    std::vector<float> m_red, m_green, m_blue, m_alpha;
+    size_t m_capacity; // values per plane
+    size_t m_size; // bytes in block, all planes back to back
+    type *m_red, *m_green, *m_blue, *m_alpha;
 };
 
+typedef basic_RGBA<float32> RGBA;
+typedef basic_RGBA<float16> RGBA16F;
+typedef basic_RGBA<unorm16> RGBA16;
+typedef basic_RGBA<unorm8> RGBA8;
+typedef basic_RGBA<float32, alpha_mode::premultiplied> pRGBA;
+typedef basic_RGBA<float16, alpha_mode::premultiplied> pRGBA16F;
+typedef basic_RGBA<unorm16, alpha_mode::premultiplied> pRGBA16;
+typedef basic_RGBA<unorm8, alpha_mode::premultiplied> pRGBA8;
+
+// invokes X(format, alpha_mode) for every image type the modules support
+#define IMAGE_FOR_EACH_RGBA(X) \
+    X(float32, straight) X(float16, straight) \
+    X(unorm16, straight) X(unorm8, straight) \
+    X(float32, premultiplied) X(float16, premultiplied) \
+    X(unorm16, premultiplied) X(unorm8, premultiplied)
+
 inline
-void RGBA::set(int x, int y, float r, float g, float b, float a) {
-    int i = y*m_width+x;
-    m_red[i] = r;
-    m_green[i] = g;
-    m_blue[i] = b;
-    m_alpha[i] = a;
+float float16::decode(type h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1f;
+    uint32_t m = h & 0x3ff;
+    uint32_t x;
+    if (e == 0) {
+        // zero or subnormal
+        float f = static_cast<float>(m)*(1.f/16777216.f);
+        return sign? -f: f;
+    } else if (e == 31) {
+        x = sign | 0x7f800000 | (m << 13);
+    } else {
+        x = sign | ((e + 112) << 23) | (m << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// rounds to nearest even
+inline
+float16::type float16::encode(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mag = x & 0x7fffffff;
+    // infinity or nan
+    if (mag >= 0x7f800000)
+        return static_cast<type>(sign | 0x7c00 | (mag > 0x7f800000? 0x200: 0));
+    // overflows to infinity
+    if (mag >= 0x477ff000)
+        return static_cast<type>(sign | 0x7c00);
+    // subnormal or zero
+    if (mag < 0x38800000) {
+        if (mag < 0x33000000) return static_cast<type>(sign);
+        uint32_t m = (mag & 0x7fffff) | 0x800000;
+        int shift = 126 - static_cast<int>(mag >> 23);
+        uint32_t h = m >> shift;
+        uint32_t rest = m & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if (rest > half || (rest == half && (h & 1))) h++;
+        return static_cast<type>(sign | h);
+    }
+    uint32_t r = mag - 0x38000000;
+    uint32_t h = r >> 13;
+    uint32_t rest = r & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;
+    return static_cast<type>(sign | h);
 }
 
+template <typename F, alpha_mode A>
 inline
-void RGBA::get(int x, int y, float &r, float &g, float &b) const {
+void basic_RGBA<F, A>::set(int x, int y, float r, float g, float b, float a) {
     int i = y*m_width+x;
-    r = m_red[i];
-    g = m_green[i];
-    b = m_blue[i];
+    if (premultiplied) {
+        r *= a;
+        g *= a;
+        b *= a;
+    }
+    m_red[i] = F::encode(r);
+    m_green[i] = F::encode(g);
+    m_blue[i] = F::encode(b);
+    m_alpha[i] = F::encode(a);
 }
 
+template <typename F, alpha_mode A>
 inline
-void RGBA::get(int x, int y, float &r, float &g, float &b, float &a) const {
+void basic_RGBA<F, A>::get(int x, int y, float &r, float &g, float &b) const {
+    float a;
+    get(x, y, r, g, b, a);
+}
+
+template <typename F, alpha_mode A>
+inline
+void basic_RGBA<F, A>::get(int x, int y, float &r, float &g, float &b,
+    float &a) const {
     int i = y*m_width+x;
-    r = m_red[i];
-    g = m_green[i];
-    b = m_blue[i];
-    a = m_alpha[i];
+    r = F::decode(m_red[i]);
+    g = F::decode(m_green[i]);
+    b = F::decode(m_blue[i]);
+    a = F::decode(m_alpha[i]);
+    if (premultiplied) {
+        float s = a > 0.f? 1.f/a: 0.f;
+        r *= s;
+        g *= s;
+        b *= s;
+    }
 }
 
+template <typename F, alpha_mode A>
 template <typename T, typename C>
-void RGBA::load(int width, int height,
+void basic_RGBA<F, A>::load(int width, int height,
     const T *red, const T *green, const T *blue, const T *alpha,
     int pitch, int advance, const C &convert) {
     resize(width, height);
@@ -112,9 +367,10 @@ void RGBA::load(int width, int height,
     }
 }
 
+template <typename F, alpha_mode A>
 template <typename T, typename C>
-void RGBA::store(int width, int height, T *red, T *green, T *blue,
-    T *alpha, int pitch, int advance, const C &convert) const {
+void basic_RGBA<F, A>::store(int width, int height, T *red, T *green,
+    T *blue, T *alpha, int pitch, int advance, const C &convert) const {
     assert(width == m_width && height == m_height);
     if (red && green && blue && alpha) {
         for (int i = 0; i < height; i++) {
@@ -135,6 +391,127 @@ void RGBA::store(int width, int height, T *red, T *green, T *blue,
     }
 }
 
+template <typename F, alpha_mode A>
+template <typename T, typename C>
+void basic_RGBA<F, A>::store_row(int row, T *red, T *green, T *blue,
+    T *alpha, int advance, const C &convert) const {
+    assert(row >= 0 && row < m_height);
+    int offset = 0;
+    for (int j = 0; j < m_width; j++) {
+        int index = row*m_width+j;
+        red[offset] = convert(m_red[index]);
+        green[offset] = convert(m_green[index]);
+        blue[offset] = convert(m_blue[index]);
+        alpha[offset] = convert(m_alpha[index]);
+        offset += advance;
+    }
+}
+
+template <typename F, alpha_mode A>
+template <typename S>
+void basic_RGBA<F, A>::load_from(int width, int height,
+    const typename S::type *red, const typename S::type *green,
+    const typename S::type *blue, const typename S::type *alpha,
+    int pitch, int advance) {
+    resize(width, height);
+    if (!(red && green && blue && alpha)) return;
+    for (int i = 0; i < height; i++) {
+        int offset = 0;
+        for (int j = 0; j < width; j++) {
+            int index = i*width+j;
+            if (premultiplied) {
+                float a = S::decode(alpha[offset]);
+                m_red[index] = F::encode(a*S::decode(red[offset]));
+                m_green[index] = F::encode(a*S::decode(green[offset]));
+                m_blue[index] = F::encode(a*S::decode(blue[offset]));
+            } else {
+                m_red[index] = convert<S, F>::apply(red[offset]);
+                m_green[index] = convert<S, F>::apply(green[offset]);
+                m_blue[index] = convert<S, F>::apply(blue[offset]);
+            }
+            m_alpha[index] = convert<S, F>::apply(alpha[offset]);
+            offset += advance;
+        }
+        red += pitch;
+        green += pitch;
+        blue += pitch;
+        alpha += pitch;
+    }
+}
+
+template <typename F, alpha_mode A>
+inline
+void basic_RGBA<F, A>::load_row(int row, const unsigned char *red,
+    const unsigned char *green, const unsigned char *blue,
+    const unsigned char *alpha, int advance) {
+    assert(row >= 0 && row < m_height);
+    const table8<F> &t = table8<F>::instance();
+    size_t first = size_t(row)*m_width;
+    type *r = m_red+first, *g = m_green+first, *b = m_blue+first,
+        *a = m_alpha+first;
+    int offset = 0;
+    for (int j = 0; j < m_width; j++) {
+        unsigned char o = alpha[offset];
+        if (premultiplied && o != 255) {
+            float s = t.decoded[o];
+            r[j] = F::encode(s*t.decoded[red[offset]]);
+            g[j] = F::encode(s*t.decoded[green[offset]]);
+            b[j] = F::encode(s*t.decoded[blue[offset]]);
+        } else {
+            r[j] = t.value[red[offset]];
+            g[j] = t.value[green[offset]];
+            b[j] = t.value[blue[offset]];
+        }
+        a[j] = t.value[o];
+        offset += advance;
+    }
+}
+
+template <typename F, alpha_mode A>
+inline
+void basic_RGBA<F, A>::load_row(int row, const unsigned short *red,
+    const unsigned short *green, const unsigned short *blue,
+    const unsigned short *alpha, int advance) {
+    assert(row >= 0 && row < m_height);
+    size_t first = size_t(row)*m_width;
+    int offset = 0;
+    for (int j = 0; j < m_width; j++) {
+        size_t index = first+j;
+        if (premultiplied) {
+            float a = unorm16::decode(alpha[offset]);
+            m_red[index] = F::encode(a*unorm16::decode(red[offset]));
+            m_green[index] = F::encode(a*unorm16::decode(green[offset]));
+            m_blue[index] = F::encode(a*unorm16::decode(blue[offset]));
+        } else {
+            m_red[index] = convert<unorm16, F>::apply(red[offset]);
+            m_green[index] = convert<unorm16, F>::apply(green[offset]);
+            m_blue[index] = convert<unorm16, F>::apply(blue[offset]);
+        }
+        m_alpha[index] = convert<unorm16, F>::apply(alpha[offset]);
+        offset += advance;
+    }
+}
+
+template <typename F, alpha_mode A>
+template <typename D>
+inline
+void basic_RGBA<F, A>::store_to(int index, typename D::type *red,
+    typename D::type *green, typename D::type *blue,
+    typename D::type *alpha) const {
+    if (premultiplied) {
+        float a = F::decode(m_alpha[index]);
+        float s = a > 0.f? 1.f/a: 0.f;
+        *red = D::encode(s*F::decode(m_red[index]));
+        *green = D::encode(s*F::decode(m_green[index]));
+        *blue = D::encode(s*F::decode(m_blue[index]));
+    } else {
+        *red = convert<F, D>::apply(m_red[index]);
+        *green = convert<F, D>::apply(m_green[index]);
+        *blue = convert<F, D>::apply(m_blue[index]);
+    }
+    *alpha = convert<F, D>::apply(m_alpha[index]);
+}
+
 } // namespace image
 
 #endif // IMAGE_H
@@ -0,0 +1,34 @@
+#ifndef IMAGEBUFFER_H
+#define IMAGEBUFFER_H
+
+/* plain C view of the pixels of an image from the image module.
+ * img:buffer() returns a light userdata pointing to one of these.
+ * it lives inside the image, so it is valid for as long as the image
+ * is, but the plane pointers change whenever the image is resized,
+ * reserved, or shrunk: call img:buffer() again after that.
+ * image.cdef holds the same declarations for the LuaJIT FFI */
+
+#include <stddef.h>
+
+#define IMAGE_BUFFER_VERSION 1
+
+/* channel formats */
+#define IMAGE_BUFFER_FLOAT32 0 /* float */
+#define IMAGE_BUFFER_FLOAT16 1 /* IEEE half, in an unsigned short */
+#define IMAGE_BUFFER_UNORM16 2 /* unsigned short, 65535 is 1 */
+#define IMAGE_BUFFER_UNORM8 3  /* unsigned char, 255 is 1 */
+
+typedef struct image_buffer {
+    int version;       /* IMAGE_BUFFER_VERSION */
+    int width, height; /* in pixels */
+    int format;        /* one of the channel formats above */
+    int premultiplied; /* 1 if color is multiplied by alpha */
+    int element;       /* bytes per channel value */
+    ptrdiff_t stride;  /* channel values from one row to the next */
+    ptrdiff_t advance; /* channel values from one pixel to the next */
+    /* one plane per channel. row 0 is the bottom row, so channel c
+     * of pixel x,y is at c[y*stride+x*advance] */
+    void *red, *green, *blue, *alpha;
+} image_buffer;
+
+#endif /* IMAGEBUFFER_H */
@@ -0,0 +1,95 @@
+#ifndef IMAGEIO_H
+#define IMAGEIO_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// what the png, netpbm, and qoi codecs have in common
+namespace imageio {
+
+    // byte sources and sinks, returning how many bytes were moved
+    class FileReader {
+    public:
+        FileReader(FILE *file): m_file(file) { }
+        size_t operator()(char *out, size_t len) {
+            return fread(out, 1, len, m_file);
+        }
+    private:
+        FILE *m_file;
+    };
+
+    class FileWriter {
+    public:
+        FileWriter(FILE *file): m_file(file) { }
+        size_t operator()(const char *in, size_t len) {
+            return fwrite(in, 1, len, m_file);
+        }
+    private:
+        FILE *m_file;
+    };
+
+    class StringWriter {
+    public:
+        StringWriter(std::string &memory): m_memory(memory) { }
+        size_t operator()(const char *in, size_t len) {
+            m_memory.append(in, len);
+            return len;
+        }
+    private:
+        std::string &m_memory;
+    };
+
+    class StringReader {
+    public:
+        StringReader(const std::string &memory):
+            m_memory(memory), m_done(0) { }
+        size_t operator()(char *out, size_t len) {
+            if (len > m_memory.size() - m_done)
+                len = m_memory.size() - m_done;
+            if (len > 0) memcpy(out, &m_memory[m_done], len);
+            m_done += len;
+            return len;
+        }
+    private:
+        const std::string &m_memory;
+        size_t m_done;
+    };
+
+    // streaming output, one row at a time
+    class stream {
+    public:
+        virtual ~stream() { }
+        // queue a row of rgba (0 is the bottom row) as the next row
+        // in the file. rows must be queued in file order: top to
+        // bottom for png, pam, ppm, and qoi, bottom to top for pfm
+        template <typename I> int write(const I &rgba, int row) {
+            void *data = acquire(rgba.width(), rgba.height(), row);
+            if (!data) return 0;
+            if (depth() == 32) {
+                float *d = static_cast<float *>(data);
+                rgba.store_row(row, d, d+1, d+2, d+3, 4);
+            } else if (depth() == 16) {
+                unsigned short *d = static_cast<unsigned short *>(data);
+                rgba.store_row(row, d, d+1, d+2, d+3, 4);
+            } else {
+                unsigned char *d = static_cast<unsigned char *>(data);
+                rgba.store_row(row, d, d+1, d+2, d+3, 4);
+            }
+            return release();
+        }
+        // wait for the encoder to finish
+        virtual int close(void) = 0;
+    protected:
+        // wait for room and return where the row goes, or null on error.
+        // rows are 4 interleaved channels, straight alpha
+        virtual void *acquire(int width, int height, int row) = 0;
+        // hand the row over to the encoder
+        virtual int release(void) = 0;
+        // bits per channel in the row buffers: 8, 16, or 32 for float
+        virtual int depth(void) const = 0;
+    };
+
+} // namespace imageio
+
+#endif // IMAGEIO_H
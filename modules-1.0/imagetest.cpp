@@ -0,0 +1,37 @@
+#include <cstdio>
+
+#include "image.h"
+
+using namespace image;
+
+// every 8-bit level must come back as itself after going through
+// format F, either by conversion or by setting and getting a pixel
+template <typename F> static int roundtrip(const char *name) {
+    basic_RGBA<F> img;
+    img.resize(256, 1);
+    for (int c = 0; c < 256; c++) {
+        float f = unorm8::decode(static_cast<unorm8::type>(c));
+        img.set(c, 0, f, f, f, f);
+    }
+    int failed = 0;
+    for (int c = 0; c < 256; c++) {
+        unorm8::type v = static_cast<unorm8::type>(c);
+        typename F::type s = convert<unorm8, F>::apply(v);
+        float r, g, b, a;
+        img.get(c, 0, r, g, b, a);
+        if (convert<F, unorm8>::apply(s) != v || unorm8::encode(r) != v ||
+            unorm8::encode(a) != v) failed++;
+    }
+    if (failed) fprintf(stderr, "%s: %d of 256 levels lost\n", name, failed);
+    return failed;
+}
+
+int main(void) {
+    int failed = roundtrip<float32>("float32") +
+        roundtrip<float16>("float16") +
+        roundtrip<unorm16>("unorm16") +
+        roundtrip<unorm8>("unorm8");
+    if (failed) return 1;
+    printf("all levels survive\n");
+    return 0;
+}
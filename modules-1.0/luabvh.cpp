@@ -0,0 +1,162 @@
+#include <new>
+#include <vector>
+#include <lua.hpp>
+#include <lauxlib.h>
+
+#include "bvh.h"
+#include "luabvh.h"
+
+// the tree, plus scratch space for query results
+struct luabvh {
+    bvh tree;
+    std::vector<int> found;
+};
+
+static luabvh *checkbvh(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    if (!lua_getmetatable(L, idx)) lua_pushnil(L);
+    if (!lua_compare(L, -1, lua_upvalueindex(1), LUA_OPEQ))
+        luaL_argerror(L, idx, "expected bvh");
+    lua_pop(L, 1);
+    return reinterpret_cast<luabvh *>(lua_touserdata(L, idx));
+}
+
+// tree:query(x, y [, found]) fills found (or a new table) with
+// the 1-based indices of boxes containing x,y in increasing order,
+// and returns the table and the number of indices in it
+static int querybvh(lua_State *L) {
+    luabvh *b = checkbvh(L, 1);
+    double x = luaL_checknumber(L, 2);
+    double y = luaL_checknumber(L, 3);
+    if (lua_isnoneornil(L, 4)) {
+        lua_settop(L, 3);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        lua_settop(L, 4);
+    }
+    b->tree.query(x, y, b->found);
+    int n = static_cast<int>(b->found.size());
+    for (int i = 0; i < n; i++) {
+        lua_pushinteger(L, b->found[i]+1);
+        lua_rawseti(L, 4, i+1);
+    }
+    lua_pushinteger(L, n);
+    return 2;
+}
+
+static bvh::box checkbox(lua_State *L, int idx) {
+    bvh::box b;
+    b.xmin = luaL_checknumber(L, idx);
+    b.ymin = luaL_checknumber(L, idx+1);
+    b.xmax = luaL_checknumber(L, idx+2);
+    b.ymax = luaL_checknumber(L, idx+3);
+    return b;
+}
+
+// tree:update(i, xmin, ymin, xmax, ymax) moves box i. an empty box
+// (xmin > xmax or ymin > ymax) is never found again
+static int updatebvh(lua_State *L) {
+    luabvh *b = checkbvh(L, 1);
+    int i = static_cast<int>(luaL_checkinteger(L, 2));
+    luaL_argcheck(L, i >= 1 && i <= b->tree.size(), 2, "out of range");
+    b->tree.update(i-1, checkbox(L, 3));
+    return 0;
+}
+
+// tree:append(xmin, ymin, xmax, ymax) adds a box and returns its index
+static int appendbvh(lua_State *L) {
+    luabvh *b = checkbvh(L, 1);
+    lua_pushinteger(L, b->tree.append(checkbox(L, 2))+1);
+    return 1;
+}
+
+static int sizebvh(lua_State *L) {
+    luabvh *b = checkbvh(L, 1);
+    lua_pushinteger(L, b->tree.size());
+    return 1;
+}
+
+static const luaL_Reg methodsbvh[] = {
+    {"query", querybvh},
+    {"update", updatebvh},
+    {"append", appendbvh},
+    {"size", sizebvh},
+    {NULL, NULL}
+};
+
+static int gcbvh(lua_State *L) {
+    luabvh *b = checkbvh(L, 1);
+    b->~luabvh();
+    return 0;
+}
+
+static int tostringbvh(lua_State *L) {
+    luabvh *b = checkbvh(L, 1);
+    lua_pushfstring(L, "bvh{%d boxes, %d nodes}", b->tree.size(),
+        b->tree.nodes());
+    return 1;
+}
+
+static const luaL_Reg metabvh[] = {
+    {"__gc", gcbvh},
+    {"__tostring", tostringbvh},
+    {NULL, NULL}
+};
+
+// bvh.bvh(boxes) builds a tree from a flat array of boxes
+// {xmin1, ymin1, xmax1, ymax1, xmin2, ...}
+static int newbvh(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int n = static_cast<int>(luaL_len(L, 1));
+    if (n % 4 != 0) luaL_argerror(L, 1, "expected 4 numbers per box");
+    // check everything before allocating, since errors longjmp
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        if (!lua_isnumber(L, -1)) luaL_argerror(L, 1, "expected numbers");
+        lua_pop(L, 1);
+    }
+    std::vector<bvh::box> boxes(n/4);
+    for (int i = 0; i < n/4; i++) {
+        double v[4];
+        for (int j = 0; j < 4; j++) {
+            lua_rawgeti(L, 1, 4*i+j+1);
+            v[j] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        boxes[i].xmin = v[0]; boxes[i].ymin = v[1];
+        boxes[i].xmax = v[2]; boxes[i].ymax = v[3];
+    }
+    void *p = lua_newuserdata(L, sizeof(luabvh));
+    luabvh *b = new (p) luabvh;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+    b->tree.build(boxes);
+    return 1;
+}
+
+static const luaL_Reg mod[] = {
+    {"bvh", newbvh},
+    {NULL, NULL}
+};
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_bvh(lua_State *L) {
+    lua_newtable(L); // mod
+    lua_newtable(L); // mod meta
+    lua_newtable(L); // mod meta index
+    lua_pushvalue(L, -2); // mod meta index meta
+    luaL_setfuncs(L, methodsbvh, 1); // mod meta index
+    lua_setfield(L, -2, "__index"); // mod meta
+    lua_pushvalue(L, -1); // mod meta meta
+    luaL_setfuncs(L, metabvh, 1); // mod meta
+    lua_pushvalue(L, -1); // mod meta meta
+    lua_setfield(L, -3, "meta"); // mod meta
+    luaL_setfuncs(L, mod, 1); // mod
+    return 1;
+}
@@ -0,0 +1,14 @@
+#ifndef LUABVH_H
+#define LUABVH_H
+
+#include <lua.hpp>
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_bvh(lua_State *L);
+
+#endif // LUABVH_H
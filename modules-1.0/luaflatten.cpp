@@ -0,0 +1,89 @@
+#include <vector>
+#include <lua.hpp>
+#include <lauxlib.h>
+
+#include "flatten.h"
+#include "luaflatten.h"
+
+// checks the tolerance and output table, which follow n coordinates
+static double checktolerance(lua_State *L, int n) {
+    double tol = luaL_checknumber(L, n+1);
+    if (!(tol > 0.)) luaL_argerror(L, n+1, "expected positive tolerance");
+    if (lua_isnoneornil(L, n+2)) {
+        lua_settop(L, n+1);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, n+2, LUA_TTABLE);
+        lua_settop(L, n+2);
+    }
+    return tol;
+}
+
+// fills the output table on top of the stack with the vertices, and
+// returns it and the number of vertices. entries past 2*n are left
+// alone, so tables can be reused
+static int pushvertices(lua_State *L, const std::vector<double> &out) {
+    int n = static_cast<int>(out.size());
+    for (int i = 0; i < n; i++) {
+        lua_pushnumber(L, out[i]);
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_pushinteger(L, n/2);
+    return 2;
+}
+
+static void checkcoords(lua_State *L, int n, double *v) {
+    for (int i = 0; i < n; i++) {
+        v[i] = luaL_checknumber(L, i+1);
+    }
+}
+
+// flatten.quadratic(x0, y0, x1, y1, x2, y2, tol [, out])
+static int quadratic(lua_State *L) {
+    double v[6];
+    checkcoords(L, 6, v);
+    double tol = checktolerance(L, 6);
+    std::vector<double> out;
+    flatten::quadratic(v[0], v[1], v[2], v[3], v[4], v[5], tol, out);
+    return pushvertices(L, out);
+}
+
+// flatten.rational_quadratic(x0, y0, x1, y1, w1, x2, y2, tol [, out])
+static int rational_quadratic(lua_State *L) {
+    double v[7];
+    checkcoords(L, 7, v);
+    double tol = checktolerance(L, 7);
+    std::vector<double> out;
+    flatten::rational_quadratic(v[0], v[1], v[2], v[3], v[4], v[5], v[6],
+        tol, out);
+    return pushvertices(L, out);
+}
+
+// flatten.cubic(x0, y0, x1, y1, x2, y2, x3, y3, tol [, out])
+static int cubic(lua_State *L) {
+    double v[8];
+    checkcoords(L, 8, v);
+    double tol = checktolerance(L, 8);
+    std::vector<double> out;
+    flatten::cubic(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], tol,
+        out);
+    return pushvertices(L, out);
+}
+
+static const luaL_Reg mod[] = {
+    {"quadratic", quadratic},
+    {"rational_quadratic", rational_quadratic},
+    {"cubic", cubic},
+    {NULL, NULL}
+};
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_flatten(lua_State *L) {
+    luaL_newlib(L, mod);
+    return 1;
+}
@@ -0,0 +1,14 @@
+#ifndef LUAFLATTEN_H
+#define LUAFLATTEN_H
+
+#include <lua.hpp>
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_flatten(lua_State *L);
+
+#endif // LUAFLATTEN_H
@@ -1,4 +1,7 @@
 #include <cstdio>
+#include <new>
+#include <string>
+#include <vector>
 #include <lua.hpp>
 #include <lauxlib.h>
 
@@ -8,10 +11,11 @@
 #include FT_GLYPH_H
 #include FT_BBOX_H
 
-#define LIBRARYIDX (lua_upvalueindex(1))
+#define FACESIDX (lua_upvalueindex(1))
 #define METAFACEIDX (lua_upvalueindex(2))
 
 #include "luafreetype.h"
+#include "facecache.h"
 
 // FT_Outline_Decompose
 
@@ -22,25 +26,27 @@ static int indexface(lua_State *L) {
     return 1;
 }
 
-FT_Face *checkface(lua_State *L, int idx) {
+// face userdata hold a reference into the shared face cache
+static facecache::entry **checkface(lua_State *L, int idx) {
     idx = lua_absindex(L, idx);
     if (!lua_getmetatable(L, idx)) lua_pushnil(L);
     if (!lua_compare(L, -1, METAFACEIDX, LUA_OPEQ))
         luaL_argerror(L, idx, "expected face");
     lua_pop(L, 1);
-    return reinterpret_cast<FT_Face *>(lua_touserdata(L, idx));
+    return reinterpret_cast<facecache::entry **>(lua_touserdata(L, idx));
 }
 
 static int tostringface(lua_State *L) {
-    FT_Face *face = checkface(L, 1);
-    lua_pushfstring(L, "face{%s,%s}", (*face)->family_name,
-            (*face)->style_name);
+    FT_Face face = (*checkface(L, 1))->face();
+    lua_pushfstring(L, "face{%s,%s}", face->family_name,
+            face->style_name);
     return 1;
 }
 
 static int  gcface(lua_State *L) {
-    FT_Face *face = checkface(L, 1);
-    FT_Done_Face(*face);
+    facecache::entry **e = checkface(L, 1);
+    facecache::instance().release(*e);
+    *e = NULL;
     return 0;
 }
 
@@ -123,29 +129,58 @@ static bool isc(int tag) {
     return (!(tag&0x1) && (tag&0x2));
 }
 
-static void copyglyphattribs(lua_State *L, FT_GlyphSlot glyph, int idx) {
+// glyph data is copied out of the face while it is locked, so no Lua
+// call (which may longjmp past the unlock) happens with the lock held.
+// the copy lives on per thread, so nothing leaks if one does
+struct glyphcopy {
+    std::vector<FT_Vector> points;
+    std::vector<char> tags;
+    std::vector<short> contours;
+    FT_Glyph_Metrics metrics;
+    FT_Pos linearHoriAdvance, linearVertAdvance;
+    FT_Outline outline;
+};
+
+static thread_local glyphcopy g_glyph;
+
+static void copyglyph(FT_GlyphSlot slot, glyphcopy &glyph) {
+    const FT_Outline &outline = slot->outline;
+    glyph.points.assign(outline.points, outline.points+outline.n_points);
+    glyph.tags.assign(outline.tags, outline.tags+outline.n_points);
+    glyph.contours.assign(outline.contours,
+        outline.contours+outline.n_contours);
+    glyph.metrics = slot->metrics;
+    glyph.linearHoriAdvance = slot->linearHoriAdvance;
+    glyph.linearVertAdvance = slot->linearVertAdvance;
+    glyph.outline = outline;
+    glyph.outline.points = glyph.points.data();
+    glyph.outline.tags = glyph.tags.data();
+    glyph.outline.contours = glyph.contours.data();
+}
+
+static void copyglyphattribs(lua_State *L, const glyphcopy &glyph, int idx) {
     idx = lua_absindex(L, idx);
     lua_newtable(L);
-    lua_pushinteger(L, glyph->metrics.width);
+    lua_pushinteger(L, glyph.metrics.width);
     lua_setfield(L, -2, "width");
-    lua_pushinteger(L, glyph->metrics.height);
+    lua_pushinteger(L, glyph.metrics.height);
     lua_setfield(L, -2, "height");
-    lua_pushinteger(L, glyph->metrics.horiBearingX);
+    lua_pushinteger(L, glyph.metrics.horiBearingX);
     lua_setfield(L, -2, "horiBearingX");
-    lua_pushinteger(L, glyph->metrics.horiBearingY);
+    lua_pushinteger(L, glyph.metrics.horiBearingY);
     lua_setfield(L, -2, "horiBearingY");
-    lua_pushinteger(L, glyph->metrics.horiAdvance);
+    lua_pushinteger(L, glyph.metrics.horiAdvance);
     lua_setfield(L, -2, "horiAdvance");
-    lua_pushinteger(L, glyph->metrics.vertBearingX);
+    lua_pushinteger(L, glyph.metrics.vertBearingX);
     lua_setfield(L, -2, "vertBearingX");
-    lua_pushinteger(L, glyph->metrics.vertBearingY);
+    lua_pushinteger(L, glyph.metrics.vertBearingY);
     lua_setfield(L, -2, "vertBearingY");
-    lua_pushinteger(L, glyph->metrics.vertAdvance);
+    lua_pushinteger(L, glyph.metrics.vertAdvance);
     lua_setfield(L, -2, "vertAdvance");
     lua_setfield(L, idx, "metrics");
-    lua_pushnumber(L, glyph->linearHoriAdvance);
+    lua_pushnumber(L, glyph.linearHoriAdvance);
     lua_setfield(L, idx, "linearHoriAdvance");
-    lua_pushnumber(L, glyph->linearVertAdvance);
+    lua_pushnumber(L, glyph.linearVertAdvance);
     lua_setfield(L, idx, "linearVertAdvance");
 }
 
@@ -210,15 +245,27 @@ static void copyglyphoutline(lua_State *L, FT_Outline outline, int tabidx) {
 }
 
 static int glyphface(lua_State *L) {
-    FT_Face face = *checkface(L, 1);
-    int index = FT_Get_Char_Index(face, luaL_checkinteger(L, 2));
-    if (!FT_Load_Glyph(face, index,
-        FT_LOAD_LINEAR_DESIGN |
-        FT_LOAD_NO_SCALE |
-        FT_LOAD_IGNORE_TRANSFORM)) {
+    facecache::entry *e = *checkface(L, 1);
+    FT_ULong code = static_cast<FT_ULong>(luaL_checkinteger(L, 2));
+    bool loaded = false;
+    try {
+        std::lock_guard<std::mutex> lock(e->lock());
+        FT_Face face = e->face();
+        int index = FT_Get_Char_Index(face, code);
+        if (!FT_Load_Glyph(face, index,
+            FT_LOAD_LINEAR_DESIGN |
+            FT_LOAD_NO_SCALE |
+            FT_LOAD_IGNORE_TRANSFORM)) {
+            copyglyph(face->glyph, g_glyph);
+            loaded = true;
+        }
+    } catch (std::bad_alloc &) {
+        return luaL_error(L, "out of memory");
+    }
+    if (loaded) {
         lua_newtable(L);
-        copyglyphoutline(L, face->glyph->outline, -1);
-        copyglyphattribs(L, face->glyph, -1);
+        copyglyphoutline(L, g_glyph.outline, -1);
+        copyglyphattribs(L, g_glyph, -1);
         lua_pushvalue(L, 1);
         lua_setfield(L, -2, "face");
         return 1;
@@ -229,20 +276,24 @@ static int glyphface(lua_State *L) {
 }
 
 static int kernface(lua_State *L) {
-    FT_Face face = *checkface(L, 1);
-    int previndex = FT_Get_Char_Index(face, luaL_checkinteger(L, 2));
-    int index = FT_Get_Char_Index(face, luaL_checkinteger(L, 3));
-    if (FT_HAS_KERNING(face)) {
-        FT_Vector delta;
-        FT_Get_Kerning(face, previndex, index, FT_KERNING_UNSCALED, &delta);
-        lua_pushinteger(L, delta.x);
-        lua_pushinteger(L, delta.y);
-        return 2;
-    } else {
-        lua_pushinteger(L, 0);
-        lua_pushinteger(L, 0);
-        return 2;
+    facecache::entry *e = *checkface(L, 1);
+    FT_ULong prevcode = static_cast<FT_ULong>(luaL_checkinteger(L, 2));
+    FT_ULong code = static_cast<FT_ULong>(luaL_checkinteger(L, 3));
+    FT_Vector delta;
+    delta.x = delta.y = 0;
+    {
+        std::lock_guard<std::mutex> lock(e->lock());
+        FT_Face face = e->face();
+        if (FT_HAS_KERNING(face)) {
+            int previndex = FT_Get_Char_Index(face, prevcode);
+            int index = FT_Get_Char_Index(face, code);
+            FT_Get_Kerning(face, previndex, index, FT_KERNING_UNSCALED,
+                &delta);
+        }
     }
+    lua_pushinteger(L, delta.x);
+    lua_pushinteger(L, delta.y);
+    return 2;
 }
 
 static const luaL_Reg methodsface[] = {
@@ -251,11 +302,7 @@ static const luaL_Reg methodsface[] = {
     {NULL, NULL}
 };
 
-FT_Library upvaluelibrary(lua_State *L) {
-    return *reinterpret_cast<FT_Library *>(lua_touserdata(L, LIBRARYIDX));
-}
-
-void copyfaceattribs(lua_State *L, FT_Face face, int idx) {
+static void copyfaceattribs(lua_State *L, FT_Face face, int idx) {
     idx = lua_absindex(L, idx);
     lua_pushinteger(L, face->num_faces);
     lua_setfield(L, idx, "num_faces");
@@ -299,51 +346,70 @@ void copyfaceattribs(lua_State *L, FT_Face face, int idx) {
     lua_setfield(L, idx, "bbox");
 }
 
+// faces are cached per Lua state as well, so asking for the same
+// face twice returns the same userdata and uservalue table
 int newface(lua_State *L) {
     const char *path = luaL_checkstring(L, 1);
     int face_index = luaL_optinteger(L, 2, 0);
-    FT_Face *face = reinterpret_cast<FT_Face *>(
-        lua_newuserdata(L, sizeof(FT_Face)));
-    if (FT_New_Face(upvaluelibrary(L), path, face_index, face))
-        luaL_error(L, "error loading face %d of %s", face_index, path);
+    lua_pushfstring(L, "%d:%s", face_index, path); // key
+    lua_pushvalue(L, -1); // key key
+    lua_rawget(L, FACESIDX); // key face
+    if (!lua_isnil(L, -1)) return 1;
+    lua_pop(L, 1); // key
+    facecache::entry **e = reinterpret_cast<facecache::entry **>(
+        lua_newuserdata(L, sizeof(facecache::entry *))); // key face
+    *e = NULL;
     lua_pushvalue(L, METAFACEIDX);
     lua_setmetatable(L, -2);
-    if (!FT_IS_SCALABLE((*face)))
+    FT_Error error = 0;
+    *e = facecache::instance().acquire(path, face_index, error);
+    if (!*e)
+        luaL_error(L, "error loading face %d of %s", face_index, path);
+    FT_Face face = (*e)->face();
+    if (!FT_IS_SCALABLE(face))
         luaL_error(L, "error face %d of %s is not scalable", face_index, path);
-    if (FT_IS_TRICKY((*face)))
+    if (FT_IS_TRICKY(face))
         luaL_error(L, "face %d of %s is 'tricky' and not supported",
             face_index, path);
-    FT_Set_Char_Size((*face), 0, 0, 0, 0); // dummy call
+    {
+        std::lock_guard<std::mutex> lock((*e)->lock());
+        FT_Set_Char_Size(face, 0, 0, 0, 0); // dummy call
+    }
     lua_newtable(L);
-    lua_pushvalue(L, LIBRARYIDX);
+    lua_pushvalue(L, FACESIDX);
     lua_pushvalue(L, METAFACEIDX);
     luaL_setfuncs(L, methodsface, 2);
-    copyfaceattribs(L, *face, -1);
+    copyfaceattribs(L, face, -1);
     lua_setuservalue(L, -2);
+    lua_pushvalue(L, -2); // key face key
+    lua_pushvalue(L, -2); // key face key face
+    lua_rawset(L, FACESIDX); // key face
+    return 1;
+}
+
+// evict every face no Lua state is using, returning how many
+static int trimfaces(lua_State *L) {
+    lua_pushinteger(L, static_cast<lua_Integer>(
+        facecache::instance().trim()));
+    return 1;
+}
+
+// how many unused faces to keep, returning the old limit
+static int limitfaces(lua_State *L) {
+    int n = luaL_checkint(L, 1);
+    if (n < 0) luaL_argerror(L, 1, "invalid limit");
+    lua_pushinteger(L, static_cast<lua_Integer>(
+        facecache::instance().limit(static_cast<size_t>(n))));
     return 1;
 }
 
 static const luaL_Reg modfreetype2[] = {
     {"face", newface},
+    {"trim", trimfaces},
+    {"limit", limitfaces},
     {NULL, NULL}
 };
 
-int gclibrary(lua_State *L) {
-    FT_Done_FreeType(*reinterpret_cast<FT_Library *>(lua_touserdata(L, 1)));
-    return 0;
-}
-
-static void newlibrary(lua_State *L) {
-    FT_Library *library = reinterpret_cast<FT_Library *>(
-        lua_newuserdata(L, sizeof(FT_Library)));
-    if (FT_Init_FreeType(library))
-        luaL_error(L, "error loading FreeType");
-    lua_newtable(L);
-    lua_pushcfunction(L, gclibrary);
-    lua_setfield(L, -2, "__gc");
-    lua_setmetatable(L, -2);
-}
-
 extern "C"
 #ifndef _WIN32
 __attribute__((visibility("default")))
@@ -352,11 +418,15 @@ __declspec(dllexport)
 #endif
 int luaopen_freetype(lua_State *L) {
     lua_newtable(L); // module
-    newlibrary(L); // module library
-    lua_newtable(L); // module library facemeta
-    lua_pushvalue(L, -2); // module library facemeta library
-    lua_pushvalue(L, -2); // module library facemeta library facemeta
-    luaL_setfuncs(L, metaface, 2); // module library facemeta
+    lua_newtable(L); // module faces
+    lua_newtable(L); // module faces facesmeta
+    lua_pushliteral(L, "v"); // module faces facesmeta "v"
+    lua_setfield(L, -2, "__mode"); // module faces facesmeta
+    lua_setmetatable(L, -2); // module faces
+    lua_newtable(L); // module faces facemeta
+    lua_pushvalue(L, -2); // module faces facemeta faces
+    lua_pushvalue(L, -2); // module faces facemeta faces facemeta
+    luaL_setfuncs(L, metaface, 2); // module faces facemeta
     luaL_setfuncs(L, modfreetype2, 2); // module
     return 1;
 }
@@ -1,11 +1,19 @@
 #include <cstdio>
 #include <new>
+#include <string>
+#include <type_traits>
 #include <lua.hpp>
 #include <lauxlib.h>
 
 #include "luaimage.h"
 #include "image.h"
+#include "imagebuffer.h"
 #include "pngio.h"
+#include "pnmio.h"
+#include "qoiio.h"
+
+#define METAIMAGEIDX (lua_upvalueindex(1))
+#define METASTREAMIDX (lua_upvalueindex(2))
 
 static FILE* checkfile(lua_State *L, int idx) {
     luaL_Stream *ls = (luaL_Stream *) luaL_checkudata(L, idx, LUA_FILEHANDLE);
@@ -13,13 +21,152 @@ static FILE* checkfile(lua_State *L, int idx) {
     return ls->f;
 }
 
-static image::RGBA *checkimage(lua_State *L, int idx) {
+// images of every format share one metatable. the userdata
+// holds a tag for the format followed by the image itself
+struct anyimage {
+    int format; // index into formatnames
+    int premultiplied; // index into alphanames
+    image_buffer view; // handed out by img:buffer()
+    std::aligned_storage<sizeof(image::RGBA), alignof(image::RGBA)>::type rgba;
+    template <typename I> I &as(void) { return *reinterpret_cast<I *>(&rgba); }
+};
+
+#define CHECKLAYOUT(F, A) \
+    static_assert(sizeof(image::basic_RGBA<image::F, image::alpha_mode::A>) \
+        == sizeof(image::RGBA) && \
+        alignof(image::basic_RGBA<image::F, image::alpha_mode::A>) == \
+        alignof(image::RGBA), "image layouts differ");
+IMAGE_FOR_EACH_RGBA(CHECKLAYOUT)
+#undef CHECKLAYOUT
+
+// in the same order as the IMAGE_BUFFER_ formats
+static const char *const formatnames[] = {
+    "float", "half", "unorm16", "unorm8", NULL
+};
+
+static const char *const alphanames[] = {
+    "straight", "premultiplied", NULL
+};
+
+// call v with the image in its actual type
+template <typename V> static int visitimage(anyimage *u, V &v) {
+    switch (2*u->format + u->premultiplied) {
+        case 0: return v(u->as<image::RGBA>());
+        case 1: return v(u->as<image::pRGBA>());
+        case 2: return v(u->as<image::RGBA16F>());
+        case 3: return v(u->as<image::pRGBA16F>());
+        case 4: return v(u->as<image::RGBA16>());
+        case 5: return v(u->as<image::pRGBA16>());
+        case 6: return v(u->as<image::RGBA8>());
+        default: return v(u->as<image::pRGBA8>());
+    }
+}
+
+struct newvisitor {
+    template <typename I> int operator()(I &img) {
+        new (&img) I;
+        return 0;
+    }
+};
+
+struct deletevisitor {
+    template <typename I> int operator()(I &img) {
+        img.~I();
+        return 0;
+    }
+};
+
+struct sizevisitor {
+    int width, height;
+    template <typename I> int operator()(I &img) {
+        width = img.width();
+        height = img.height();
+        return 0;
+    }
+};
+
+// allocation failures come back as 0 instead of exceptions
+struct resizevisitor {
+    int width, height;
+    template <typename I> int operator()(I &img) {
+        try {
+            img.resize(width, height);
+        } catch (std::bad_alloc &) {
+            return 0;
+        }
+        return 1;
+    }
+};
+
+struct reservevisitor {
+    size_t pixels;
+    template <typename I> int operator()(I &img) {
+        try {
+            img.reserve(pixels);
+        } catch (std::bad_alloc &) {
+            return 0;
+        }
+        return 1;
+    }
+};
+
+struct shrinkvisitor {
+    template <typename I> int operator()(I &img) {
+        try {
+            img.shrink();
+        } catch (std::bad_alloc &) {
+            return 0;
+        }
+        return 1;
+    }
+};
+
+struct capacityvisitor {
+    size_t capacity;
+    template <typename I> int operator()(I &img) {
+        capacity = img.capacity();
+        return 0;
+    }
+};
+
+struct clearvisitor {
+    template <typename I> int operator()(I &img) {
+        img.clear();
+        return 0;
+    }
+};
+
+struct setvisitor {
+    int x, y;
+    float r, g, b, a;
+    template <typename I> int operator()(I &img) {
+        img.set(x, y, r, g, b, a);
+        return 0;
+    }
+};
+
+struct getvisitor {
+    int x, y;
+    float r, g, b, a;
+    template <typename I> int operator()(I &img) {
+        img.get(x, y, r, g, b, a);
+        return 0;
+    }
+};
+
+static anyimage *checkimage(lua_State *L, int idx) {
     idx = lua_absindex(L, idx);
     if (!lua_getmetatable(L, idx)) lua_pushnil(L);
     if (!lua_compare(L, -1, lua_upvalueindex(1), LUA_OPEQ))
         luaL_argerror(L, idx, "expected image");
     lua_pop(L, 1);
-    return reinterpret_cast<image::RGBA *>(lua_touserdata(L, idx));
+    return reinterpret_cast<anyimage *>(lua_touserdata(L, idx));
+}
+
+static sizevisitor imagesize(anyimage *img) {
+    sizevisitor size;
+    visitimage(img, size);
+    return size;
 }
 
 static void saveimagedimensions(lua_State *L, int idx, int width, int height) {
@@ -32,112 +179,423 @@ static void saveimagedimensions(lua_State *L, int idx, int width, int height) {
 }
 
 static int setimage(lua_State *L) {
-    image::RGBA *img = checkimage(L, 1);
+    anyimage *img = checkimage(L, 1);
+    sizevisitor size = imagesize(img);
     int x = luaL_checkinteger(L, 2);
-    if (x < 1 || x > img->width()) luaL_argerror(L, 2, "out of bounds");
+    if (x < 1 || x > size.width) luaL_argerror(L, 2, "out of bounds");
     int y = luaL_checkinteger(L, 3);
-    if (y < 1 || y > img->height()) luaL_argerror(L, 2, "out of bounds");
-    float r = static_cast<float>(luaL_checknumber(L, 4));
-    float g = static_cast<float>(luaL_checknumber(L, 5));
-    float b = static_cast<float>(luaL_checknumber(L, 6));
-    float a = static_cast<float>(luaL_optnumber(L, 7, 1.f));
-    img->set(x-1, y-1, r, g, b, a);
+    if (y < 1 || y > size.height) luaL_argerror(L, 2, "out of bounds");
+    setvisitor set;
+    set.x = x-1;
+    set.y = y-1;
+    set.r = static_cast<float>(luaL_checknumber(L, 4));
+    set.g = static_cast<float>(luaL_checknumber(L, 5));
+    set.b = static_cast<float>(luaL_checknumber(L, 6));
+    set.a = static_cast<float>(luaL_optnumber(L, 7, 1.f));
+    visitimage(img, set);
     return 0;
 }
 
 static int getimage(lua_State *L) {
-    image::RGBA *img = checkimage(L, 1);
+    anyimage *img = checkimage(L, 1);
+    sizevisitor size = imagesize(img);
     int x = luaL_checkinteger(L, 2);
-    if (x < 1 || x > img->width()) luaL_argerror(L, 2, "out of bounds");
+    if (x < 1 || x > size.width) luaL_argerror(L, 2, "out of bounds");
     int y = luaL_checkinteger(L, 3);
-    if (y < 1 || y > img->height()) luaL_argerror(L, 2, "out of bounds");
-    float r, g, b, a;
-    img->get(x-1, y-1, r, g, b, a);
-    lua_pushnumber(L, r);
-    lua_pushnumber(L, g);
-    lua_pushnumber(L, b);
-    lua_pushnumber(L, a);
+    if (y < 1 || y > size.height) luaL_argerror(L, 2, "out of bounds");
+    getvisitor get;
+    get.x = x-1;
+    get.y = y-1;
+    visitimage(img, get);
+    lua_pushnumber(L, get.r);
+    lua_pushnumber(L, get.g);
+    lua_pushnumber(L, get.b);
+    lua_pushnumber(L, get.a);
     return 4;
 }
 
+static int formatimage(lua_State *L) {
+    anyimage *img = checkimage(L, 1);
+    lua_pushstring(L, formatnames[img->format]);
+    lua_pushstring(L, alphanames[img->premultiplied]);
+    return 2;
+}
+
+struct buffervisitor {
+    image_buffer *view;
+    template <typename I> int operator()(I &img) {
+        view->width = img.width();
+        view->height = img.height();
+        view->element = static_cast<int>(sizeof(typename I::type));
+        view->stride = img.width();
+        view->advance = 1;
+        view->red = img.red();
+        view->green = img.green();
+        view->blue = img.blue();
+        view->alpha = img.alpha();
+        return 0;
+    }
+};
+
+// light userdata pointing to the image_buffer view of the pixels
+static int bufferimage(lua_State *L) {
+    anyimage *img = checkimage(L, 1);
+    img->view.version = IMAGE_BUFFER_VERSION;
+    img->view.format = img->format;
+    img->view.premultiplied = img->premultiplied;
+    buffervisitor buffer;
+    buffer.view = &img->view;
+    visitimage(img, buffer);
+    lua_pushlightuserdata(L, &img->view);
+    return 1;
+}
+
+// contents are unspecified after a resize
+static int resizeimage(lua_State *L) {
+    anyimage *img = checkimage(L, 1);
+    int width = luaL_checkint(L, 2);
+    if (width <= 0) luaL_argerror(L, 2, "invalid width");
+    int height = luaL_checkint(L, 3);
+    if (height <= 0) luaL_argerror(L, 3, "invalid height");
+    resizevisitor resize;
+    resize.width = width;
+    resize.height = height;
+    if (!visitimage(img, resize)) luaL_error(L, "out of memory");
+    saveimagedimensions(L, 1, width, height);
+    return 0;
+}
+
+static int reserveimage(lua_State *L) {
+    anyimage *img = checkimage(L, 1);
+    lua_Number pixels = luaL_checknumber(L, 2);
+    if (pixels < 0) luaL_argerror(L, 2, "invalid size");
+    reservevisitor reserve;
+    reserve.pixels = static_cast<size_t>(pixels);
+    if (!visitimage(img, reserve)) luaL_error(L, "out of memory");
+    return 0;
+}
+
+static int shrinkimage(lua_State *L) {
+    anyimage *img = checkimage(L, 1);
+    shrinkvisitor shrink;
+    if (!visitimage(img, shrink)) luaL_error(L, "out of memory");
+    return 0;
+}
+
+static int capacityimage(lua_State *L) {
+    anyimage *img = checkimage(L, 1);
+    capacityvisitor capacity;
+    visitimage(img, capacity);
+    lua_pushnumber(L, static_cast<lua_Number>(capacity.capacity));
+    return 1;
+}
+
+static int clearimage(lua_State *L) {
+    anyimage *img = checkimage(L, 1);
+    clearvisitor clear;
+    visitimage(img, clear);
+    return 0;
+}
+
 static const luaL_Reg methodsimage[] = {
     {"set", setimage},
     {"get", getimage},
+    {"format", formatimage},
+    {"buffer", bufferimage},
+    {"resize", resizeimage},
+    {"reserve", reserveimage},
+    {"shrink", shrinkimage},
+    {"capacity", capacityimage},
+    {"clear", clearimage},
     {NULL, NULL}
 };
 
-static image::RGBA *pushimage(lua_State *L) {
-    void *p = lua_newuserdata(L, sizeof(image::RGBA));
-    new (p) image::RGBA;
+// optional format and alpha mode arguments start at idx
+static anyimage *pushimage(lua_State *L, int idx) {
+    int format = luaL_checkoption(L, idx, "float", formatnames);
+    int premultiplied = luaL_checkoption(L, idx+1, "straight", alphanames);
+    anyimage *img = reinterpret_cast<anyimage *>(
+        lua_newuserdata(L, sizeof(anyimage)));
+    img->format = format;
+    img->premultiplied = premultiplied;
+    newvisitor construct;
+    visitimage(img, construct);
     lua_pushvalue(L, lua_upvalueindex(1));
     lua_setmetatable(L, -2);
     lua_newtable(L);
     lua_pushvalue(L, lua_upvalueindex(1));
     luaL_setfuncs(L, methodsimage, 1);
     lua_setuservalue(L, -2);
-    return reinterpret_cast<image::RGBA *>(p);
+    return img;
 }
 
-static int loadpng(lua_State *L) {
+// codecs put each format behind the same static functions
+template <int depth> struct png {
+    template <typename I> static int load(FILE *file, I &img) {
+        return pngio::load(file, img);
+    }
+    template <typename I> static int load(const std::string &memory, I &img) {
+        return pngio::load(memory, img);
+    }
+    template <typename I> static int store(FILE *file, const I &img) {
+        return depth == 16? pngio::store16(file, img):
+            pngio::store8(file, img);
+    }
+    template <typename I> static int store(std::string &memory,
+            const I &img) {
+        return depth == 16? pngio::store16(memory, img):
+            pngio::store8(memory, img);
+    }
+    static imageio::stream *stream(FILE *file, int width, int height) {
+        return depth == 16? pngio::stream16(file, width, height):
+            pngio::stream8(file, width, height);
+    }
+};
+
+template <int depth, pnmio::kind k> struct pnm {
+    template <typename I> static int load(FILE *file, I &img) {
+        return pnmio::load(file, img);
+    }
+    template <typename I> static int load(const std::string &memory, I &img) {
+        return pnmio::load(memory, img);
+    }
+    template <typename I> static int store(FILE *file, const I &img) {
+        return depth == 16? pnmio::store16(file, img, k):
+            pnmio::store8(file, img, k);
+    }
+    template <typename I> static int store(std::string &memory,
+            const I &img) {
+        return depth == 16? pnmio::store16(memory, img, k):
+            pnmio::store8(memory, img, k);
+    }
+    static imageio::stream *stream(FILE *file, int width, int height) {
+        return depth == 16? pnmio::stream16(file, width, height, k):
+            pnmio::stream8(file, width, height, k);
+    }
+};
+
+struct pfm {
+    template <typename I> static int load(FILE *file, I &img) {
+        return pnmio::load(file, img);
+    }
+    template <typename I> static int load(const std::string &memory, I &img) {
+        return pnmio::load(memory, img);
+    }
+    template <typename I> static int store(FILE *file, const I &img) {
+        return pnmio::storef(file, img);
+    }
+    template <typename I> static int store(std::string &memory,
+            const I &img) {
+        return pnmio::storef(memory, img);
+    }
+    static imageio::stream *stream(FILE *file, int width, int height) {
+        return pnmio::streamf(file, width, height);
+    }
+};
+
+struct qoi {
+    template <typename I> static int load(FILE *file, I &img) {
+        return qoiio::load(file, img);
+    }
+    template <typename I> static int load(const std::string &memory, I &img) {
+        return qoiio::load(memory, img);
+    }
+    template <typename I> static int store(FILE *file, const I &img) {
+        return qoiio::store8(file, img);
+    }
+    template <typename I> static int store(std::string &memory,
+            const I &img) {
+        return qoiio::store8(memory, img);
+    }
+    static imageio::stream *stream(FILE *file, int width, int height) {
+        return qoiio::stream8(file, width, height);
+    }
+};
+
+template <typename C> struct loadvisitor {
+    FILE *file;
+    const std::string *memory;
+    template <typename I> int operator()(I &img) {
+        try {
+            return memory? C::load(*memory, img): C::load(file, img);
+        } catch (std::bad_alloc &) {
+            return 0;
+        }
+    }
+};
+
+template <typename C> static int loadcodec(lua_State *L) {
+    loadvisitor<C> load;
+    load.file = NULL;
+    load.memory = NULL;
     // try to load from string
     if (lua_isstring(L, 1)) {
+        anyimage *img = pushimage(L, 2);
         size_t len = 0;
         const char *str = lua_tolstring(L, 1, &len);
-        image::RGBA *img = pushimage(L);
-        if (!pngio::load(std::string(str, len), *img))
+        std::string memory(str, len);
+        load.memory = &memory;
+        if (!visitimage(img, load)) {
+            memory = std::string();
             luaL_argerror(L, 1, "load from memory failed");
-        saveimagedimensions(L, -1, img->width(), img->height());
+        }
+        sizevisitor size = imagesize(img);
+        saveimagedimensions(L, -1, size.width, size.height);
         return 1;
     // else try to load from file
     } else {
-        FILE *f = checkfile(L, 1);
-        image::RGBA *img = pushimage(L);
-        if (!pngio::load(f, *img))
+        load.file = checkfile(L, 1);
+        anyimage *img = pushimage(L, 2);
+        if (!visitimage(img, load))
             luaL_argerror(L, 1, "load from file failed");
-        saveimagedimensions(L, -1, img->width(), img->height());
+        sizevisitor size = imagesize(img);
+        saveimagedimensions(L, -1, size.width, size.height);
         return 1;
     }
 }
 
-static int store16png(lua_State *L) {
-    FILE *f = checkfile(L, 1);
-    image::RGBA *img = checkimage(L, 2);
-    if (!pngio::store16(f, *img)) luaL_error(L, "store to file failed");
+// stores to file if given, else to string
+template <typename C> struct storevisitor {
+    FILE *file;
+    std::string *memory;
+    template <typename I> int operator()(I &img) {
+        return file? C::store(file, img): C::store(*memory, img);
+    }
+};
+
+template <typename C> static int storecodec(lua_State *L) {
+    storevisitor<C> store;
+    store.file = checkfile(L, 1);
+    store.memory = NULL;
+    anyimage *img = checkimage(L, 2);
+    if (!visitimage(img, store)) luaL_error(L, "store to file failed");
     lua_pushnumber(L, 1);
     return 1;
 }
 
-static int store8png(lua_State *L) {
-    FILE *f = checkfile(L, 1);
-    image::RGBA *img = checkimage(L, 2);
-    if (!pngio::store8(f, *img)) luaL_error(L, "store to file failed");
+template <typename C> static int stringcodec(lua_State *L) {
+    anyimage *img = checkimage(L, 1);
+    std::string str;
+    storevisitor<C> store;
+    store.file = NULL;
+    store.memory = &str;
+    int ok = visitimage(img, store);
+    if (ok) lua_pushlstring(L, str.data(), str.length());
+    else str = std::string();
+    if (!ok) luaL_error(L, "store to memory failed");
+    return 1;
+}
+
+static imageio::stream **checkstream(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    if (!lua_getmetatable(L, idx)) lua_pushnil(L);
+    if (!lua_compare(L, -1, METASTREAMIDX, LUA_OPEQ))
+        luaL_argerror(L, idx, "expected stream");
+    lua_pop(L, 1);
+    return reinterpret_cast<imageio::stream **>(lua_touserdata(L, idx));
+}
+
+struct writevisitor {
+    imageio::stream *s;
+    int row;
+    template <typename I> int operator()(I &img) {
+        return s->write(img, row);
+    }
+};
+
+static int writestream(lua_State *L) {
+    imageio::stream **s = checkstream(L, 1);
+    if (!*s) luaL_argerror(L, 1, "stream is closed");
+    anyimage *img = checkimage(L, 2);
+    int row = luaL_optint(L, 3, 1);
+    if (row < 1 || row > imagesize(img).height)
+        luaL_argerror(L, 3, "out of bounds");
+    writevisitor write;
+    write.s = *s;
+    write.row = row-1;
+    if (!visitimage(img, write)) luaL_error(L, "store to stream failed");
     lua_pushnumber(L, 1);
     return 1;
 }
 
-static int string8png(lua_State *L) {
-    image::RGBA *img = checkimage(L, 1);
-    std::string str;
-    if (!pngio::store8(str, *img)) luaL_error(L, "store to memory failed");
-    lua_pushlstring(L, str.data(), str.length());
+static int closestream(lua_State *L) {
+    imageio::stream **s = checkstream(L, 1);
+    if (!*s) luaL_argerror(L, 1, "stream is closed");
+    int ok = (*s)->close();
+    delete *s;
+    *s = NULL;
+    // release file
+    lua_pushnil(L);
+    lua_setuservalue(L, 1);
+    if (!ok) luaL_error(L, "store to stream failed");
+    lua_pushnumber(L, 1);
     return 1;
 }
 
-static int string16png(lua_State *L) {
-    image::RGBA *img = checkimage(L, 1);
-    std::string str;
-    if (!pngio::store16(str, *img)) luaL_error(L, "store to memory failed");
-    lua_pushlstring(L, str.data(), str.length());
+static int gcstream(lua_State *L) {
+    imageio::stream **s = checkstream(L, 1);
+    delete *s;
+    *s = NULL;
+    return 0;
+}
+
+static int tostringstream(lua_State *L) {
+    imageio::stream **s = checkstream(L, 1);
+    lua_pushfstring(L, "stream{%p}", *s);
     return 1;
 }
 
+static const luaL_Reg methodsstream[] = {
+    {"write", writestream},
+    {"close", closestream},
+    {NULL, NULL}
+};
+
+static const luaL_Reg metastream[] = {
+    {"__gc", gcstream},
+    {"__tostring", tostringstream},
+    {NULL, NULL}
+};
+
+typedef imageio::stream *(*newstreamfn)(FILE *file, int width, int height);
+
+static int pushstream(lua_State *L, newstreamfn newstream) {
+    FILE *f = checkfile(L, 1);
+    int width = luaL_checkint(L, 2);
+    if (width <= 0) luaL_argerror(L, 2, "invalid width");
+    int height = luaL_checkint(L, 3);
+    if (height <= 0) luaL_argerror(L, 3, "invalid height");
+    imageio::stream **s = reinterpret_cast<imageio::stream **>(
+        lua_newuserdata(L, sizeof(imageio::stream *)));
+    *s = NULL;
+    lua_pushvalue(L, METASTREAMIDX);
+    lua_setmetatable(L, -2);
+    // keep file alive while stream is open
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setuservalue(L, -2);
+    *s = newstream(f, width, height);
+    return 1;
+}
+
+template <typename C> static int streamcodec(lua_State *L) {
+    return pushstream(L, C::stream);
+}
+
 static int newimage(lua_State *L) {
     int width = luaL_checkint(L, 1);
     if (width <= 0) luaL_argerror(L, 1, "invalid width");
     int height = luaL_checkint(L, 2);
     if (height <= 0) luaL_argerror(L, 2, "invalid height");
-    image::RGBA *img = pushimage(L);
-    img->resize(width, height);
+    anyimage *img = pushimage(L, 3);
+    resizevisitor resize;
+    resize.width = width;
+    resize.height = height;
+    if (!visitimage(img, resize)) luaL_error(L, "out of memory");
+    // recycled buffers hold old pixels
+    clearvisitor clear;
+    visitimage(img, clear);
     saveimagedimensions(L, -1, width, height);
     return 1;
 }
@@ -150,14 +608,22 @@ static int indeximage(lua_State *L) {
 }
 
 static int tostringimage(lua_State *L) {
-    image::RGBA* img = checkimage(L, 1);
-    lua_pushfstring(L, "image{%d,%d}", img->width(), img->height());
+    anyimage *img = checkimage(L, 1);
+    sizevisitor size = imagesize(img);
+    if (img->format == 0 && !img->premultiplied) {
+        lua_pushfstring(L, "image{%d,%d}", size.width, size.height);
+    } else {
+        lua_pushfstring(L, "image{%d,%d,%s%s}", size.width, size.height,
+            formatnames[img->format],
+            img->premultiplied? ",premultiplied": "");
+    }
     return 1;
 }
 
 static int gcimage(lua_State *L) {
-    image::RGBA* img = checkimage(L, 1);
-    img->~RGBA();
+    anyimage *img = checkimage(L, 1);
+    deletevisitor destroy;
+    visitimage(img, destroy);
     return 0;
 }
 
@@ -168,17 +634,104 @@ static const luaL_Reg metaimage[] = {
     {NULL, NULL}
 };
 
+// free the buffers idle in the pool, returning how many bytes that was
+static int trimimage(lua_State *L) {
+    lua_pushnumber(L, static_cast<lua_Number>(image::pool::instance().trim()));
+    return 1;
+}
+
+// declarations from imagebuffer.h, for ffi.cdef
+static const char imagecdef[] =
+    "typedef struct image_buffer {\n"
+    "    int version;\n"
+    "    int width, height;\n"
+    "    int format;\n"
+    "    int premultiplied;\n"
+    "    int element;\n"
+    "    ptrdiff_t stride;\n"
+    "    ptrdiff_t advance;\n"
+    "    void *red, *green, *blue, *alpha;\n"
+    "} image_buffer;\n";
+
 static const luaL_Reg modimage[] = {
     {"image", newimage},
+    {"trim", trimimage},
     {NULL, NULL}
 };
 
+// png.threads([n]) sets how many threads encode large images, with 0
+// meaning one per core, and returns how many will be used
+static int threadspng(lua_State *L) {
+    if (!lua_isnoneornil(L, 1)) {
+        int n = luaL_checkint(L, 1);
+        if (n < 0) luaL_argerror(L, 1, "invalid number of threads");
+        pngio::set_threads(n);
+    }
+    lua_pushinteger(L, pngio::threads());
+    return 1;
+}
+
 static const luaL_Reg modpng[] = {
-    {"load", loadpng},
-    {"store8", store8png},
-    {"store16", store16png},
-    {"string8", string8png},
-    {"string16", string16png},
+    {"threads", threadspng},
+    {"load", loadcodec< png<8> >},
+    {"store8", storecodec< png<8> >},
+    {"store16", storecodec< png<16> >},
+    {"string8", stringcodec< png<8> >},
+    {"string16", stringcodec< png<16> >},
+    {"stream8", streamcodec< png<8> >},
+    {"stream16", streamcodec< png<16> >},
+    {NULL, NULL}
+};
+
+static const luaL_Reg modpam[] = {
+    {"load", loadcodec< pnm<8, pnmio::PAM> >},
+    {"store8", storecodec< pnm<8, pnmio::PAM> >},
+    {"store16", storecodec< pnm<16, pnmio::PAM> >},
+    {"string8", stringcodec< pnm<8, pnmio::PAM> >},
+    {"string16", stringcodec< pnm<16, pnmio::PAM> >},
+    {"stream8", streamcodec< pnm<8, pnmio::PAM> >},
+    {"stream16", streamcodec< pnm<16, pnmio::PAM> >},
+    {NULL, NULL}
+};
+
+static const luaL_Reg modppm[] = {
+    {"load", loadcodec< pnm<8, pnmio::PPM> >},
+    {"store8", storecodec< pnm<8, pnmio::PPM> >},
+    {"store16", storecodec< pnm<16, pnmio::PPM> >},
+    {"string8", stringcodec< pnm<8, pnmio::PPM> >},
+    {"string16", stringcodec< pnm<16, pnmio::PPM> >},
+    {"stream8", streamcodec< pnm<8, pnmio::PPM> >},
+    {"stream16", streamcodec< pnm<16, pnmio::PPM> >},
+    {NULL, NULL}
+};
+
+// pfm rows go bottom to top, so stream them in that order
+static const luaL_Reg modpfm[] = {
+    {"load", loadcodec<pfm>},
+    {"store", storecodec<pfm>},
+    {"string", stringcodec<pfm>},
+    {"stream", streamcodec<pfm>},
+    {NULL, NULL}
+};
+
+static const luaL_Reg modqoi[] = {
+    {"load", loadcodec<qoi>},
+    {"store8", storecodec<qoi>},
+    {"string8", stringcodec<qoi>},
+    {"stream8", streamcodec<qoi>},
+    {NULL, NULL}
+};
+
+// image.png, image.pam, etc
+static const struct {
+    const char *name;
+    const luaL_Reg *funcs;
+} modcodecs[] = {
+    {"png", modpng},
+    {"pam", modpam},
+    {"ppm", modppm},
+    {"pfm", modpfm},
+    {"qoi", modqoi},
     {NULL, NULL}
 };
 
@@ -197,10 +750,25 @@ int luaopen_image(lua_State *L) {
     lua_setfield(L, -3, "name"); // modimage metaimage
     lua_pushvalue(L, -1); // modimage metaimage metaimage
     luaL_setfuncs(L, metaimage, 1); // modimage metaimage
-    lua_newtable(L); // modimage metaimage modpng
-    lua_pushvalue(L, -2); // modimage metaimage modpng metaimage
-    luaL_setfuncs(L, modpng, 1); // modimage metaimage modpng
-    lua_setfield(L, -3, "png"); // modimage metaimage
+    lua_newtable(L); // modimage metaimage metastream
+    lua_newtable(L); // modimage metaimage metastream index
+    lua_pushvalue(L, -3); // modimage metaimage metastream index metaimage
+    lua_pushvalue(L, -3); // modimage metaimage metastream index metaimage metastream
+    luaL_setfuncs(L, methodsstream, 2); // modimage metaimage metastream index
+    lua_setfield(L, -2, "__index"); // modimage metaimage metastream
+    lua_pushvalue(L, -2); // modimage metaimage metastream metaimage
+    lua_pushvalue(L, -2); // modimage metaimage metastream metaimage metastream
+    luaL_setfuncs(L, metastream, 2); // modimage metaimage metastream
+    for (int i = 0; modcodecs[i].name; i++) {
+        lua_newtable(L); // modimage metaimage metastream modcodec
+        lua_pushvalue(L, -3); // modimage metaimage metastream modcodec metaimage
+        lua_pushvalue(L, -3); // modimage metaimage metastream modcodec metaimage metastream
+        luaL_setfuncs(L, modcodecs[i].funcs, 2); // modimage metaimage metastream modcodec
+        lua_setfield(L, -4, modcodecs[i].name); // modimage metaimage metastream
+    }
+    lua_pop(L, 1); // modimage metaimage
     luaL_setfuncs(L, modimage, 1); // modimage
+    lua_pushstring(L, imagecdef); // modimage cdef
+    lua_setfield(L, -2, "cdef"); // modimage
     return 1;
 }
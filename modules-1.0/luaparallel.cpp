@@ -0,0 +1,433 @@
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <lua.hpp>
+#include <lauxlib.h>
+
+#include "parallel.h"
+#include "luaparallel.h"
+
+// the pixels of an image from the image module, through img:buffer()
+static const image_buffer *checkbuffer(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    luaL_checktype(L, idx, LUA_TUSERDATA);
+    lua_getfield(L, idx, "buffer");
+    if (!lua_isfunction(L, -1)) luaL_argerror(L, idx, "expected image");
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 1);
+    const image_buffer *b =
+        reinterpret_cast<const image_buffer *>(lua_touserdata(L, -1));
+    if (!b || b->version != IMAGE_BUFFER_VERSION)
+        luaL_argerror(L, idx, "expected image");
+    lua_pop(L, 1);
+    return b;
+}
+
+// snapshots are flat strings holding nil, booleans, numbers, strings,
+// and tables. each table is written out once, and referred to by its
+// order of appearance from then on, so that shared tables stay shared.
+// tables with metatables carry the name of the metatable instead
+enum {
+    TAG_NIL = 'n', TAG_FALSE = 'f', TAG_TRUE = 't', TAG_NUMBER = 'd',
+    TAG_STRING = 's', TAG_TABLE = 'T', TAG_REF = 'r', TAG_END = 'e'
+};
+
+static void put(std::string &out, const void *p, size_t n) {
+    out.append(reinterpret_cast<const char *>(p), n);
+}
+
+// appends the value at idx to out, and returns an error message, if any.
+// seen maps the tables written so far to their order of appearance.
+// errors are returned, not raised, so that out is always destroyed
+static const char *encode(lua_State *L, int idx, int seen, int &count,
+    std::string &out) {
+    idx = lua_absindex(L, idx);
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL:
+            out += static_cast<char>(TAG_NIL);
+            return NULL;
+        case LUA_TBOOLEAN:
+            out += static_cast<char>(lua_toboolean(L, idx)?
+                TAG_TRUE: TAG_FALSE);
+            return NULL;
+        case LUA_TNUMBER: {
+            double v = lua_tonumber(L, idx);
+            out += static_cast<char>(TAG_NUMBER);
+            put(out, &v, sizeof(v));
+            return NULL;
+        }
+        case LUA_TSTRING: {
+            size_t n = 0;
+            const char *s = lua_tolstring(L, idx, &n);
+            out += static_cast<char>(TAG_STRING);
+            put(out, &n, sizeof(n));
+            out.append(s, n);
+            return NULL;
+        }
+        case LUA_TTABLE:
+            break;
+        default:
+            return "cannot snapshot functions, userdata, or threads";
+    }
+    if (!lua_checkstack(L, 4)) return "tables nested too deep";
+    lua_pushvalue(L, idx);
+    lua_rawget(L, seen);
+    if (!lua_isnil(L, -1)) {
+        int ref = static_cast<int>(lua_tointeger(L, -1));
+        lua_pop(L, 1);
+        out += static_cast<char>(TAG_REF);
+        put(out, &ref, sizeof(ref));
+        return NULL;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, idx);
+    lua_pushinteger(L, ++count);
+    lua_rawset(L, seen);
+    out += static_cast<char>(TAG_TABLE);
+    size_t n = 0;
+    if (lua_getmetatable(L, idx)) {
+        lua_pushliteral(L, "name");
+        lua_rawget(L, -2);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            lua_pop(L, 2);
+            return "cannot snapshot tables with unnamed metatables";
+        }
+        const char *name = lua_tolstring(L, -1, &n);
+        put(out, &n, sizeof(n));
+        out.append(name, n);
+        lua_pop(L, 2);
+    } else {
+        put(out, &n, sizeof(n));
+    }
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        const char *err = encode(L, -2, seen, count, out);
+        if (!err) err = encode(L, -1, seen, count, out);
+        if (err) {
+            lua_pop(L, 2);
+            return err;
+        }
+        lua_pop(L, 1);
+    }
+    out += static_cast<char>(TAG_END);
+    return NULL;
+}
+
+// parallel.snapshot(value) returns a string from which parallel.restore
+// rebuilds the value, in this or in any other Lua state
+static int snapshotparallel(lua_State *L) {
+    luaL_checkany(L, 1);
+    lua_settop(L, 1);
+    lua_newtable(L); // seen
+    const char *err = NULL;
+    {
+        std::string out;
+        int count = 0;
+        err = encode(L, 1, 2, count, out);
+        if (!err) lua_pushlstring(L, out.data(), out.size());
+    }
+    if (err) luaL_argerror(L, 1, err);
+    return 1;
+}
+
+struct reader {
+    const char *p, *end;
+};
+
+static void get(lua_State *L, reader &r, void *v, size_t n) {
+    if (static_cast<size_t>(r.end-r.p) < n) luaL_error(L, "invalid snapshot");
+    memcpy(v, r.p, n);
+    r.p += n;
+}
+
+// pushes the next value in the snapshot. refs holds the tables restored
+// so far, in order, and metas the metatables by name
+static void decode(lua_State *L, reader &r, int refs, int metas, int &count) {
+    luaL_checkstack(L, 4, "tables nested too deep");
+    char tag = 0;
+    get(L, r, &tag, 1);
+    switch (tag) {
+        case TAG_NIL:
+            lua_pushnil(L);
+            return;
+        case TAG_FALSE:
+        case TAG_TRUE:
+            lua_pushboolean(L, tag == TAG_TRUE);
+            return;
+        case TAG_NUMBER: {
+            double v = 0.;
+            get(L, r, &v, sizeof(v));
+            lua_pushnumber(L, v);
+            return;
+        }
+        case TAG_STRING: {
+            size_t n = 0;
+            get(L, r, &n, sizeof(n));
+            if (static_cast<size_t>(r.end-r.p) < n)
+                luaL_error(L, "invalid snapshot");
+            lua_pushlstring(L, r.p, n);
+            r.p += n;
+            return;
+        }
+        case TAG_REF: {
+            int ref = 0;
+            get(L, r, &ref, sizeof(ref));
+            lua_rawgeti(L, refs, ref);
+            if (!lua_istable(L, -1)) luaL_error(L, "invalid snapshot");
+            return;
+        }
+        case TAG_TABLE:
+            break;
+        default:
+            luaL_error(L, "invalid snapshot");
+    }
+    size_t n = 0;
+    get(L, r, &n, sizeof(n));
+    if (static_cast<size_t>(r.end-r.p) < n) luaL_error(L, "invalid snapshot");
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, refs, ++count);
+    if (n > 0) {
+        lua_pushlstring(L, r.p, n);
+        r.p += n;
+        lua_pushvalue(L, -1);
+        lua_rawget(L, metas);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "unknown metatable %s", lua_tostring(L, -2));
+        lua_setmetatable(L, -3);
+        lua_pop(L, 1);
+    }
+    while (r.p < r.end && *r.p != TAG_END) {
+        decode(L, r, refs, metas, count);
+        decode(L, r, refs, metas, count);
+        lua_rawset(L, -3);
+    }
+    get(L, r, &tag, 1);
+}
+
+// parallel.restore(snapshot [, metas]) looks metatables up by name in metas
+static int restoreparallel(lua_State *L) {
+    size_t len = 0;
+    const char *s = luaL_checklstring(L, 1, &len);
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+    }
+    lua_newtable(L); // refs
+    reader r;
+    r.p = s;
+    r.end = s+len;
+    int count = 0;
+    decode(L, r, 3, 2, count);
+    if (r.p != r.end) luaL_error(L, "invalid snapshot");
+    return 1;
+}
+
+// what the threads rendering one image share
+struct shared {
+    parallel::queue rows;
+    image_buffer target;
+    std::mutex mutex;
+    std::string error;
+    shared(int height, int band): rows(height, band) { }
+};
+
+// only the first error is kept, and it stops everyone
+static void fail(shared *s, const char *msg) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    if (s->error.empty()) s->error = msg? msg: "unknown error";
+    s->rows.cancel();
+}
+
+// plain values handed to every worker
+struct argument {
+    int type;
+    double number;
+    std::string string;
+};
+
+static shared *checkworker(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    if (!lua_getmetatable(L, idx)) lua_pushnil(L);
+    if (!lua_compare(L, -1, lua_upvalueindex(1), LUA_OPEQ))
+        luaL_argerror(L, idx, "expected worker");
+    lua_pop(L, 1);
+    return *reinterpret_cast<shared **>(lua_touserdata(L, idx));
+}
+
+// worker:next() returns the first and last rows of the next band, or
+// nothing when there is no more work, so that
+//   for first, last in worker.next, worker do ... end
+// goes over all the bands this worker gets
+static int nextworker(lua_State *L) {
+    shared *s = checkworker(L, 1);
+    int first = 0, last = 0;
+    if (!s->rows.next(first, last)) return 0;
+    lua_pushinteger(L, first+1);
+    lua_pushinteger(L, last+1);
+    return 2;
+}
+
+// worker:store(img, ii, i) copies row ii of img into row i of the image
+// being rendered. img must have the same width and format
+static int storeworker(lua_State *L) {
+    shared *s = checkworker(L, 1);
+    const image_buffer *src = checkbuffer(L, 2);
+    if (!parallel::compatible(*src, s->target))
+        luaL_argerror(L, 2, "image width or format differs");
+    int ii = luaL_checkint(L, 3);
+    if (ii < 1 || ii > src->height) luaL_argerror(L, 3, "out of bounds");
+    int i = luaL_checkint(L, 4);
+    if (i < 1 || i > s->target.height) luaL_argerror(L, 4, "out of bounds");
+    parallel::copyrow(*src, ii-1, s->target, i-1);
+    return 0;
+}
+
+static const luaL_Reg methodsworker[] = {
+    {"next", nextworker},
+    {"store", storeworker},
+    {NULL, NULL}
+};
+
+static int traceback(lua_State *L) {
+    const char *msg = lua_tostring(L, 1);
+    if (msg) luaL_traceback(L, L, msg, 1);
+    else lua_pushliteral(L, "(error object is not a string)");
+    return 1;
+}
+
+struct job {
+    shared *s;
+    const std::string *source;
+    const std::vector<argument> *arguments;
+    int index;
+};
+
+// runs protected in the new state of a worker: loads the source and
+// calls it with the worker, its index, and the arguments
+static int startworker(lua_State *L) {
+    const job *j = reinterpret_cast<const job *>(lua_touserdata(L, 1));
+    luaL_openlibs(L);
+    shared **w = reinterpret_cast<shared **>(
+        lua_newuserdata(L, sizeof(shared *)));
+    *w = j->s;
+    lua_newtable(L); // meta
+    lua_newtable(L); // meta index
+    lua_pushvalue(L, -2); // meta index meta
+    luaL_setfuncs(L, methodsworker, 1); // meta index
+    lua_setfield(L, -2, "__index"); // meta
+    lua_setmetatable(L, -2);
+    if (luaL_loadbuffer(L, j->source->data(), j->source->size(),
+        "=worker") != LUA_OK) lua_error(L);
+    lua_insert(L, -2);
+    lua_pushinteger(L, j->index);
+    const std::vector<argument> &a = *j->arguments;
+    luaL_checkstack(L, static_cast<int>(a.size()), "too many arguments");
+    for (size_t k = 0; k < a.size(); k++) {
+        switch (a[k].type) {
+            case LUA_TBOOLEAN: lua_pushboolean(L, a[k].number != 0.); break;
+            case LUA_TNUMBER: lua_pushnumber(L, a[k].number); break;
+            case LUA_TSTRING:
+                lua_pushlstring(L, a[k].string.data(), a[k].string.size());
+                break;
+            default: lua_pushnil(L); break;
+        }
+    }
+    lua_call(L, static_cast<int>(a.size())+2, 0);
+    return 0;
+}
+
+static void runworker(job j) {
+    lua_State *L = luaL_newstate();
+    if (!L) {
+        fail(j.s, "not enough memory");
+        return;
+    }
+    lua_pushcfunction(L, traceback);
+    lua_pushcfunction(L, startworker);
+    lua_pushlightuserdata(L, &j);
+    if (lua_pcall(L, 1, 0, 1) != LUA_OK) fail(j.s, lua_tostring(L, -1));
+    lua_close(L);
+}
+
+// parallel.run(n, source, img, band, ...) renders img with n threads,
+// each running source in its own Lua state. source is called with a
+// worker, the index of its thread, and the extra arguments, which must
+// be nil, booleans, numbers, or strings. workers take bands of rows
+// from a shared queue and store them right into img. an error in any
+// worker stops all of them, and is raised once they are all done
+static int runparallel(lua_State *L) {
+    int n = luaL_checkint(L, 1);
+    if (n < 1) luaL_argerror(L, 1, "invalid number of threads");
+    size_t len = 0;
+    const char *source = luaL_checklstring(L, 2, &len);
+    const image_buffer *target = checkbuffer(L, 3);
+    int band = luaL_checkint(L, 4);
+    if (band < 1) luaL_argerror(L, 4, "invalid band");
+    int top = lua_gettop(L);
+    for (int i = 5; i <= top; i++) {
+        int t = lua_type(L, i);
+        if (t != LUA_TNIL && t != LUA_TBOOLEAN && t != LUA_TNUMBER &&
+            t != LUA_TSTRING) luaL_argerror(L, i, "expected plain value");
+    }
+    bool failed = false;
+    {
+        std::string src(source, len);
+        std::vector<argument> arguments(top >= 5? top-4: 0);
+        for (int i = 5; i <= top; i++) {
+            argument &a = arguments[i-5];
+            a.type = lua_type(L, i);
+            a.number = a.type == LUA_TBOOLEAN? lua_toboolean(L, i):
+                a.type == LUA_TNUMBER? lua_tonumber(L, i): 0.;
+            if (a.type == LUA_TSTRING) {
+                size_t m = 0;
+                const char *s = lua_tolstring(L, i, &m);
+                a.string.assign(s, m);
+            }
+        }
+        shared s(target->height, band);
+        s.target = *target;
+        std::vector<std::thread> threads;
+        try {
+            for (int i = 0; i < n; i++) {
+                job j;
+                j.s = &s;
+                j.source = &src;
+                j.arguments = &arguments;
+                j.index = i+1;
+                threads.push_back(std::thread(runworker, j));
+            }
+        } catch (std::system_error &) {
+            fail(&s, "cannot start thread");
+        }
+        for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+        failed = !s.error.empty();
+        if (failed) lua_pushlstring(L, s.error.data(), s.error.size());
+    }
+    if (failed) return lua_error(L);
+    return 0;
+}
+
+static const luaL_Reg mod[] = {
+    {"snapshot", snapshotparallel},
+    {"restore", restoreparallel},
+    {"run", runparallel},
+    {NULL, NULL}
+};
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_parallel(lua_State *L) {
+    luaL_newlib(L, mod);
+    return 1;
+}
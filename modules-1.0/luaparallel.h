@@ -0,0 +1,14 @@
+#ifndef LUAPARALLEL_H
+#define LUAPARALLEL_H
+
+#include <lua.hpp>
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_parallel(lua_State *L);
+
+#endif // LUAPARALLEL_H
@@ -0,0 +1,128 @@
+#include <vector>
+#include <lua.hpp>
+#include <lauxlib.h>
+
+#include "primitive.h"
+#include "luaprimitive.h"
+
+static primitive::shape **checkprimitive(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    if (!lua_getmetatable(L, idx)) lua_pushnil(L);
+    if (!lua_compare(L, -1, lua_upvalueindex(1), LUA_OPEQ))
+        luaL_argerror(L, idx, "expected primitive");
+    lua_pop(L, 1);
+    return reinterpret_cast<primitive::shape **>(lua_touserdata(L, idx));
+}
+
+// shape:winding(x, y) returns the winding number of the shape at x, y
+static int windingprimitive(lua_State *L) {
+    primitive::shape *s = *checkprimitive(L, 1);
+    double x = luaL_checknumber(L, 2);
+    double y = luaL_checknumber(L, 3);
+    lua_pushinteger(L, s->winding(x, y));
+    return 1;
+}
+
+static const luaL_Reg methodsprimitive[] = {
+    {"winding", windingprimitive},
+    {NULL, NULL}
+};
+
+static int gcprimitive(lua_State *L) {
+    primitive::shape **s = checkprimitive(L, 1);
+    delete *s;
+    *s = nullptr;
+    return 0;
+}
+
+static int tostringprimitive(lua_State *L) {
+    checkprimitive(L, 1);
+    lua_pushfstring(L, "primitive{%p}", lua_touserdata(L, 1));
+    return 1;
+}
+
+static const luaL_Reg metaprimitive[] = {
+    {"__gc", gcprimitive},
+    {"__tostring", tostringprimitive},
+    {NULL, NULL}
+};
+
+// pushes an empty userdata for a shape. it owns the shape as soon as
+// it gets one, so that nothing leaks if anything after it fails
+static primitive::shape **pushprimitive(lua_State *L) {
+    primitive::shape **s = reinterpret_cast<primitive::shape **>(
+        lua_newuserdata(L, sizeof(primitive::shape *)));
+    *s = nullptr;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+    return s;
+}
+
+// primitive.triangle(x1, y1, x2, y2, x3, y3)
+static int newtriangle(lua_State *L) {
+    double v[6];
+    for (int i = 0; i < 6; i++) v[i] = luaL_checknumber(L, i+1);
+    primitive::shape **s = pushprimitive(L);
+    *s = new primitive::triangle(v[0], v[1], v[2], v[3], v[4], v[5]);
+    return 1;
+}
+
+// primitive.polygon{x1, y1, x2, y2, ...}
+static int newpolygon(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int n = static_cast<int>(luaL_len(L, 1));
+    if (n % 2 != 0) luaL_argerror(L, 1, "expected 2 numbers per vertex");
+    // check everything before allocating, since errors longjmp
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        if (!lua_isnumber(L, -1)) luaL_argerror(L, 1, "expected numbers");
+        lua_pop(L, 1);
+    }
+    primitive::shape **s = pushprimitive(L);
+    std::vector<double> xy(n);
+    for (int i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i+1);
+        xy[i] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+    *s = new primitive::polygon(xy);
+    return 1;
+}
+
+// primitive.ellipse(a, b, c, d, e, f) is the unit circle under
+//   x = a*u + b*v + c, y = d*u + e*v + f
+static int newellipse(lua_State *L) {
+    double v[6];
+    for (int i = 0; i < 6; i++) v[i] = luaL_checknumber(L, i+1);
+    primitive::shape **s = pushprimitive(L);
+    *s = new primitive::ellipse(v[0], v[1], v[2], v[3], v[4], v[5]);
+    return 1;
+}
+
+static const luaL_Reg mod[] = {
+    {"triangle", newtriangle},
+    {"polygon", newpolygon},
+    {"ellipse", newellipse},
+    {NULL, NULL}
+};
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_primitive(lua_State *L) {
+    lua_newtable(L); // mod
+    lua_newtable(L); // mod meta
+    lua_newtable(L); // mod meta index
+    lua_pushvalue(L, -2); // mod meta index meta
+    luaL_setfuncs(L, methodsprimitive, 1); // mod meta index
+    lua_setfield(L, -2, "__index"); // mod meta
+    lua_pushvalue(L, -1); // mod meta meta
+    luaL_setfuncs(L, metaprimitive, 1); // mod meta
+    lua_pushvalue(L, -1); // mod meta meta
+    lua_setfield(L, -3, "meta"); // mod meta
+    luaL_setfuncs(L, mod, 1); // mod
+    return 1;
+}
@@ -0,0 +1,14 @@
+#ifndef LUAPRIMITIVE_H
+#define LUAPRIMITIVE_H
+
+#include <lua.hpp>
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_primitive(lua_State *L);
+
+#endif // LUAPRIMITIVE_H
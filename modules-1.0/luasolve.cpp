@@ -0,0 +1,167 @@
+#include <vector>
+#include <lua.hpp>
+#include <lauxlib.h>
+
+#include "solve.h"
+#include "luasolve.h"
+
+static int pushroots(lua_State *L, int n, const double *ts) {
+    lua_pushinteger(L, n);
+    for (int i = 0; i < 2*n; i++) {
+        lua_pushnumber(L, ts[i]);
+    }
+    return 2*n+1;
+}
+
+// solve.quadratic(a, b, c [, delta]) returns n, t1, s1, .. tn, sn
+// exactly like quadratic.lua
+static int quadratic(lua_State *L) {
+    double a = luaL_checknumber(L, 1);
+    double b = luaL_checknumber(L, 2);
+    double c = luaL_checknumber(L, 3);
+    double ts[4];
+    int n;
+    if (lua_isnoneornil(L, 4)) n = solve::quadratic(a, b, c, ts);
+    else n = solve::quadratic(a, b, c, luaL_checknumber(L, 4), ts);
+    return pushroots(L, n, ts);
+}
+
+// solve.cubic(a, b, c, d) returns n, t1, s1, .. tn, sn
+// exactly like cubic.lua
+static int cubic(lua_State *L) {
+    double a = luaL_checknumber(L, 1);
+    double b = luaL_checknumber(L, 2);
+    double c = luaL_checknumber(L, 3);
+    double d = luaL_checknumber(L, 4);
+    double ts[6];
+    return pushroots(L, solve::cubic(a, b, c, d, ts), ts);
+}
+
+// reads a flat array of coefficients, degree+1 per equation, into
+// one array per power. checks everything first, since errors longjmp
+static size_t checkcoefs(lua_State *L, int idx, int degree,
+    std::vector<double> *powers) {
+    luaL_checktype(L, idx, LUA_TTABLE);
+    int n = static_cast<int>(luaL_len(L, idx));
+    if (n % (degree+1) != 0) {
+        luaL_argerror(L, idx, degree == 2? "expected 3 numbers per equation":
+            "expected 4 numbers per equation");
+    }
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, idx, i);
+        if (!lua_isnumber(L, -1)) luaL_argerror(L, idx, "expected numbers");
+        lua_pop(L, 1);
+    }
+    size_t m = n/(degree+1);
+    for (int j = 0; j <= degree; j++) {
+        powers[j].resize(m);
+    }
+    for (size_t i = 0; i < m; i++) {
+        for (int j = 0; j <= degree; j++) {
+            lua_rawgeti(L, idx, static_cast<int>(i*(degree+1)+j+1));
+            powers[j][i] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+    }
+    return m;
+}
+
+// uses the table at idx for output, or a new one
+static void outtable(lua_State *L, int idx) {
+    if (lua_isnoneornil(L, idx)) {
+        lua_settop(L, idx-1);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, idx, LUA_TTABLE);
+        lua_settop(L, idx);
+    }
+}
+
+// writes n, t1, s1, .. for each equation into the output table,
+// padded with zeros to the same number of entries per equation
+static void storeroots(lua_State *L, int idx, size_t m, int stride,
+    const std::vector<int> &counts, const std::vector<double> &ts) {
+    int k = 1;
+    for (size_t i = 0; i < m; i++) {
+        lua_pushinteger(L, counts[i]);
+        lua_rawseti(L, idx, k++);
+        for (int j = 0; j < stride; j++) {
+            lua_pushnumber(L, j < 2*counts[i]? ts[i*stride+j]: 0.);
+            lua_rawseti(L, idx, k++);
+        }
+    }
+}
+
+// solve.quadratics({a1, b1, c1, a2, ...} [, out]) fills out (or a new
+// table) with n, t1, s1, t2, s2 for each equation, and returns it
+static int quadratics(lua_State *L) {
+    std::vector<double> powers[3];
+    outtable(L, 2);
+    size_t m = checkcoefs(L, 1, 2, powers);
+    std::vector<int> counts(m);
+    std::vector<double> ts(4*m);
+    if (m > 0) {
+        solve::quadratics(m, powers[0].data(), powers[1].data(),
+            powers[2].data(), counts.data(), ts.data());
+    }
+    storeroots(L, 2, m, 4, counts, ts);
+    return 1;
+}
+
+// solve.cubics({a1, b1, c1, d1, a2, ...} [, out]) fills out (or a new
+// table) with n, t1, s1, t2, s2, t3, s3 for each equation, and returns it
+static int cubics(lua_State *L) {
+    std::vector<double> powers[4];
+    outtable(L, 2);
+    size_t m = checkcoefs(L, 1, 3, powers);
+    std::vector<int> counts(m);
+    std::vector<double> ts(6*m);
+    if (m > 0) {
+        solve::cubics(m, powers[0].data(), powers[1].data(),
+            powers[2].data(), powers[3].data(), counts.data(), ts.data());
+    }
+    storeroots(L, 2, m, 6, counts, ts);
+    return 1;
+}
+
+// solve.unitroots({a1, b1, c1, a2, ...} [, t]) appends to t (or a new
+// table) the roots of all quadratics that lie in the open interval
+// (0, 1), and returns t and the number of roots appended
+static int unitroots(lua_State *L) {
+    std::vector<double> powers[3];
+    outtable(L, 2);
+    size_t m = checkcoefs(L, 1, 2, powers);
+    std::vector<double> t(2*m);
+    size_t n = 0;
+    if (m > 0) {
+        n = solve::unitroots(m, powers[0].data(), powers[1].data(),
+            powers[2].data(), t.data());
+    }
+    int k = static_cast<int>(luaL_len(L, 2));
+    for (size_t i = 0; i < n; i++) {
+        lua_pushnumber(L, t[i]);
+        lua_rawseti(L, 2, ++k);
+    }
+    lua_pushinteger(L, static_cast<lua_Integer>(n));
+    return 2;
+}
+
+static const luaL_Reg mod[] = {
+    {"quadratic", quadratic},
+    {"cubic", cubic},
+    {"quadratics", quadratics},
+    {"cubics", cubics},
+    {"unitroots", unitroots},
+    {NULL, NULL}
+};
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_solve(lua_State *L) {
+    luaL_newlib(L, mod);
+    return 1;
+}
@@ -0,0 +1,14 @@
+#ifndef LUASOLVE_H
+#define LUASOLVE_H
+
+#include <lua.hpp>
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_solve(lua_State *L);
+
+#endif // LUASOLVE_H
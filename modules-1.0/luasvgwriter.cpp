@@ -0,0 +1,256 @@
+#include <cstring>
+#include <lua.hpp>
+#include <lauxlib.h>
+
+#include "svgwriter.h"
+#include "luasvgwriter.h"
+
+static FILE* checkfile(lua_State *L, int idx) {
+    luaL_Stream *ls = (luaL_Stream *) luaL_checkudata(L, idx, LUA_FILEHANDLE);
+    if (ls->closef == NULL) luaL_argerror(L, idx, "file is closed");
+    return ls->f;
+}
+
+static svgwriter::writer **checkwriter(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    if (!lua_getmetatable(L, idx)) lua_pushnil(L);
+    if (!lua_compare(L, -1, lua_upvalueindex(1), LUA_OPEQ))
+        luaL_argerror(L, idx, "expected writer");
+    lua_pop(L, 1);
+    return reinterpret_cast<svgwriter::writer **>(lua_touserdata(L, idx));
+}
+
+// whether the file of an open writer is still open. Lua code can close
+// it behind the writer's back, and nothing may be written to it then
+static bool openfile(lua_State *L, int idx) {
+    lua_getuservalue(L, idx);
+    lua_rawgeti(L, -1, 1);
+    luaL_Stream *ls = (luaL_Stream *) lua_touserdata(L, -1);
+    lua_pop(L, 2);
+    return ls && ls->closef != NULL;
+}
+
+// the writer, checked to be open and to have an open file, which is
+// what any method that may write needs
+static svgwriter::writer *checkopenwriter(lua_State *L, int idx) {
+    svgwriter::writer **w = checkwriter(L, idx);
+    if (!*w) luaL_argerror(L, idx, "writer is closed");
+    if (!openfile(L, idx)) luaL_argerror(L, idx, "file is closed");
+    return *w;
+}
+
+// writer:write(...) takes strings and numbers, like file:write, but
+// numbers come out as the shortest decimal that reads back the same
+static int writewriter(lua_State *L) {
+    svgwriter::writer *w = checkopenwriter(L, 1);
+    int n = lua_gettop(L);
+    bool ok = true;
+    for (int i = 2; i <= n; i++) {
+        if (lua_type(L, i) == LUA_TNUMBER) {
+            ok = w->number(lua_tonumber(L, i)) && ok;
+        } else {
+            size_t len = 0;
+            const char *s = luaL_checklstring(L, i, &len);
+            ok = w->text(s, len) && ok;
+        }
+    }
+    if (!ok) luaL_error(L, "write to file failed");
+    lua_settop(L, 1);
+    return 1;
+}
+
+static double datum(lua_State *L, int data, lua_Integer k) {
+    lua_rawgeti(L, data, static_cast<int>(k));
+    double v = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return v;
+}
+
+static void numbers(svgwriter::writer *w, lua_State *L, int data,
+    lua_Integer o, int n) {
+    for (int i = 0; i < n; i++) {
+        w->number(datum(L, data, o+i));
+        w->text(" ", 1);
+    }
+}
+
+// writer:path(shape, tosvg) writes the contents of the d attribute of
+// a path, going over its instructions directly instead of iterating.
+// tosvg converts rational quadratic segments into svg arc parameters,
+// and is only needed when there are any
+static int pathwriter(lua_State *L) {
+    svgwriter::writer *w = checkopenwriter(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 3);
+    lua_getfield(L, 2, "instructions"); // 4
+    lua_getfield(L, 2, "offsets"); // 5
+    lua_getfield(L, 2, "data"); // 6
+    for (int i = 4; i <= 6; i++) {
+        if (!lua_istable(L, i)) luaL_argerror(L, 2, "expected path");
+    }
+    int n = static_cast<int>(luaL_len(L, 4));
+    char previous = 0;
+    for (int j = 1; j <= n; j++) {
+        lua_rawgeti(L, 4, j);
+        const char *s = lua_tostring(L, -1);
+        if (!s) luaL_argerror(L, 2, "invalid instruction");
+        // the string stays alive in the instructions table
+        lua_pop(L, 1);
+        lua_Integer o = static_cast<lua_Integer>(datum(L, 5, j));
+        if (strcmp(s, "begin_open_contour") == 0 ||
+            strcmp(s, "begin_closed_contour") == 0) {
+            w->text("M ", 2);
+            numbers(w, L, 6, o+1, 2);
+            previous = 'M';
+        } else if (strcmp(s, "linear_segment") == 0) {
+            if (previous != 'L') w->text("L ", 2);
+            numbers(w, L, 6, o+2, 2);
+            previous = 'L';
+        } else if (strcmp(s, "quadratic_segment") == 0) {
+            if (previous != 'Q') w->text("Q ", 2);
+            numbers(w, L, 6, o+2, 4);
+            previous = 'Q';
+        } else if (strcmp(s, "rational_quadratic_segment") == 0) {
+            if (lua_isnil(L, 3)) luaL_argerror(L, 3, "expected tosvg");
+            if (previous != 'A') w->text("A ", 2);
+            lua_pushvalue(L, 3);
+            for (int k = 0; k < 7; k++) {
+                lua_rawgeti(L, 6, static_cast<int>(o+k));
+            }
+            lua_call(L, 7, 5);
+            // tosvg could have closed the file
+            if (!openfile(L, 1)) luaL_argerror(L, 1, "file is closed");
+            for (int k = -5; k < 0; k++) {
+                w->number(lua_tonumber(L, k));
+                w->text(" ", 1);
+            }
+            lua_pop(L, 5);
+            numbers(w, L, 6, o+5, 2);
+            previous = 'A';
+        } else if (strcmp(s, "cubic_segment") == 0) {
+            if (previous != 'C') w->text("C ", 2);
+            numbers(w, L, 6, o+2, 6);
+            previous = 'C';
+        } else if (strcmp(s, "end_open_contour") == 0) {
+            previous = 0;
+        } else if (strcmp(s, "end_closed_contour") == 0) {
+            if (previous != 'Z') w->text("Z ", 2);
+            previous = 'Z';
+        } else {
+            luaL_error(L, "unhandled instruction '%s'", s);
+        }
+    }
+    // failures stick, so checking once at the end is enough
+    if (!w->ok()) luaL_error(L, "write to file failed");
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int flushwriter(lua_State *L) {
+    svgwriter::writer *w = checkopenwriter(L, 1);
+    if (!w->flush()) luaL_error(L, "write to file failed");
+    lua_settop(L, 1);
+    return 1;
+}
+
+// flushes and lets go of the file, which stays open. the writer is
+// released even if its file was closed first, but then nothing is
+// written and the buffered text is lost
+static int closewriter(lua_State *L) {
+    svgwriter::writer **w = checkwriter(L, 1);
+    if (!*w) luaL_argerror(L, 1, "writer is closed");
+    bool open = openfile(L, 1);
+    bool ok = open && (*w)->flush();
+    delete *w;
+    *w = NULL;
+    // release file
+    lua_pushnil(L);
+    lua_setuservalue(L, 1);
+    if (!open) luaL_argerror(L, 1, "file is closed");
+    if (!ok) luaL_error(L, "write to file failed");
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+static const luaL_Reg methodswriter[] = {
+    {"write", writewriter},
+    {"path", pathwriter},
+    {"flush", flushwriter},
+    {"close", closewriter},
+    {NULL, NULL}
+};
+
+// only frees the buffer. by now the file may have been closed, or
+// even collected, so whatever was not flushed is dropped
+static int gcwriter(lua_State *L) {
+    svgwriter::writer **w = checkwriter(L, 1);
+    delete *w;
+    *w = NULL;
+    return 0;
+}
+
+static int tostringwriter(lua_State *L) {
+    svgwriter::writer **w = checkwriter(L, 1);
+    lua_pushfstring(L, "writer{%p}", *w);
+    return 1;
+}
+
+static const luaL_Reg metawriter[] = {
+    {"__gc", gcwriter},
+    {"__tostring", tostringwriter},
+    {NULL, NULL}
+};
+
+// svgwriter.writer(file [, size]) buffers size bytes at a time
+static int newwriter(lua_State *L) {
+    FILE *f = checkfile(L, 1);
+    lua_Number size = luaL_optnumber(L, 2, 1 << 16);
+    if (size < 1) luaL_argerror(L, 2, "invalid size");
+    svgwriter::writer **w = reinterpret_cast<svgwriter::writer **>(
+        lua_newuserdata(L, sizeof(svgwriter::writer *)));
+    *w = NULL;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+    // keep file alive while writer is open
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setuservalue(L, -2);
+    *w = new svgwriter::writer(f, static_cast<size_t>(size));
+    return 1;
+}
+
+// svgwriter.format(v) is the string writer:write uses for number v
+static int formatnumber(lua_State *L) {
+    char buf[svgwriter::FORMAT_SIZE];
+    int n = svgwriter::format(luaL_checknumber(L, 1), buf);
+    lua_pushlstring(L, buf, static_cast<size_t>(n));
+    return 1;
+}
+
+static const luaL_Reg mod[] = {
+    {"writer", newwriter},
+    {"format", formatnumber},
+    {NULL, NULL}
+};
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_svgwriter(lua_State *L) {
+    lua_newtable(L); // mod
+    lua_newtable(L); // mod meta
+    lua_newtable(L); // mod meta index
+    lua_pushvalue(L, -2); // mod meta index meta
+    luaL_setfuncs(L, methodswriter, 1); // mod meta index
+    lua_setfield(L, -2, "__index"); // mod meta
+    lua_pushvalue(L, -1); // mod meta meta
+    luaL_setfuncs(L, metawriter, 1); // mod meta
+    lua_pushvalue(L, -1); // mod meta meta
+    lua_setfield(L, -3, "meta"); // mod meta
+    luaL_setfuncs(L, mod, 1); // mod
+    return 1;
+}
@@ -0,0 +1,14 @@
+#ifndef LUASVGWRITER_H
+#define LUASVGWRITER_H
+
+#include <lua.hpp>
+
+extern "C"
+#ifndef _WIN32
+__attribute__((visibility("default")))
+#else
+__declspec(dllexport)
+#endif
+int luaopen_svgwriter(lua_State *L);
+
+#endif // LUASVGWRITER_H
@@ -0,0 +1,50 @@
+#include <algorithm>
+#include <cstring>
+
+#include "parallel.h"
+
+namespace parallel {
+
+queue::queue(int rows, int band):
+    m_next(0), m_cancelled(false), m_rows(rows), m_band(std::max(band, 1)) {
+}
+
+bool queue::next(int &first, int &last) {
+    if (m_cancelled.load()) return false;
+    first = m_next.fetch_add(m_band);
+    if (first >= m_rows) return false;
+    last = std::min(first+m_band, m_rows)-1;
+    return true;
+}
+
+void queue::cancel(void) {
+    m_cancelled.store(true);
+}
+
+bool compatible(const image_buffer &src, const image_buffer &dst) {
+    return src.version == IMAGE_BUFFER_VERSION &&
+        dst.version == IMAGE_BUFFER_VERSION &&
+        src.width == dst.width && src.format == dst.format &&
+        src.premultiplied == dst.premultiplied &&
+        src.element == dst.element;
+}
+
+void copyrow(const image_buffer &src, int sy, const image_buffer &dst,
+    int dy) {
+    const void *splanes[4] = { src.red, src.green, src.blue, src.alpha };
+    void *dplanes[4] = { dst.red, dst.green, dst.blue, dst.alpha };
+    size_t e = static_cast<size_t>(src.element);
+    for (int c = 0; c < 4; c++) {
+        const char *s = static_cast<const char *>(splanes[c])+sy*src.stride*e;
+        char *d = static_cast<char *>(dplanes[c])+dy*dst.stride*e;
+        if (src.advance == 1 && dst.advance == 1) {
+            memcpy(d, s, src.width*e);
+        } else {
+            for (int x = 0; x < src.width; x++) {
+                memcpy(d+x*dst.advance*e, s+x*src.advance*e, e);
+            }
+        }
+    }
+}
+
+} // namespace parallel
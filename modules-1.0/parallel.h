@@ -0,0 +1,33 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <atomic>
+
+#include "imagebuffer.h"
+
+// pieces shared by the threads that render one image together
+namespace parallel {
+    // hands out bands of rows, in order, to whoever asks first
+    class queue {
+    public:
+        queue(int rows, int band);
+        // next band of rows, from first to last, 0-based and inclusive.
+        // false once all rows were handed out, or after cancel
+        bool next(int &first, int &last);
+        void cancel(void);
+    private:
+        std::atomic<int> m_next;
+        std::atomic<bool> m_cancelled;
+        int m_rows, m_band;
+    };
+
+    // whether rows of one image can be copied into the other as they are
+    bool compatible(const image_buffer &src, const image_buffer &dst);
+
+    // copy row sy of src into row dy of dst. threads can copy into
+    // different rows of the same image at the same time
+    void copyrow(const image_buffer &src, int sy, const image_buffer &dst,
+        int dy);
+} // namespace parallel
+
+#endif // PARALLEL_H
@@ -1,7 +1,14 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <vector>
+#include <new>
+#include <atomic>
+#include <system_error>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <png.h>
 #include <zlib.h>
 
@@ -16,6 +23,16 @@ static char *mystrdup(const char *str) {
 
 static std::vector<png_text> g_text;
 
+// number of rows in flight between renderer and encoder
+static const int STREAM_ROWS = 8;
+
+// filtered bytes each thread of the parallel encoder deflates at a
+// time. images smaller than two stripes go through libpng
+static const size_t STRIPE_BYTES = size_t(1) << 20;
+
+// threads for the parallel encoder, 0 for one per core
+static std::atomic<int> g_threads(0);
+
 static void user_error_fn(png_structp png_ptr,
 	png_const_charp error_msg) {
 	(void) png_ptr;
@@ -32,52 +49,10 @@ template <typename T> int to_bit_depth(void);
 template <> int to_bit_depth<png_uint_16>(void) { return 16; }
 template <> int to_bit_depth<png_byte>(void) { return 8; }
 
-class FileReader {
-public:
-    FileReader(FILE *file): m_file(file) { }
-    size_t operator()(char *out, size_t len) {
-        return fread(out, 1, len, m_file);
-    }
-private:
-    FILE *m_file;
-};
-
-class FileWriter {
-public:
-    FileWriter(FILE *file): m_file(file) { }
-    size_t operator()(char *in, size_t len) {
-        return fwrite(in, 1, len, m_file);
-    }
-private:
-    FILE *m_file;
-};
-
-class StringWriter {
-public:
-    StringWriter(std::string &memory): m_memory(memory) { }
-    size_t operator()(char *in, size_t len) {
-        m_memory.insert(m_memory.end(), in, in+len);
-        return len;
-    }
-private:
-    std::string &m_memory;
-};
-
-class StringReader {
-public:
-    StringReader(const std::string &memory): m_memory(memory), m_done(0) { }
-    size_t operator()(char *out, size_t len) {
-        size_t end = m_done + len;
-        end > m_memory.size()? m_memory.size(): end;
-        len = end - m_done;
-        memcpy(out, &m_memory[m_done], len);
-        m_done += len;
-        return len;
-    }
-private:
-    const std::string &m_memory;
-    size_t m_done;
-};
+using imageio::FileReader;
+using imageio::FileWriter;
+using imageio::StringReader;
+using imageio::StringWriter;
 
 template <typename IO>
 void io_fn(png_structp png_ptr, png_bytep out, png_size_t len) {
@@ -94,6 +69,208 @@ void io_fn(png_structp png_ptr, png_bytep out, png_size_t len) {
     }
 }
 
+static void put32(unsigned long v, png_byte *b) {
+    b[0] = static_cast<png_byte>(v >> 24);
+    b[1] = static_cast<png_byte>(v >> 16);
+    b[2] = static_cast<png_byte>(v >> 8);
+    b[3] = static_cast<png_byte>(v);
+}
+
+template <typename W>
+static bool write_chunk(W &writer, const char *type, const png_byte *data,
+        size_t len) {
+    png_byte head[8], tail[4];
+    put32(static_cast<unsigned long>(len), head);
+    memcpy(head+4, type, 4);
+    uLong crc = crc32(0L, head+4, 4);
+    if (len > 0) crc = crc32(crc, data, static_cast<uInt>(len));
+    put32(crc, tail);
+    return writer(reinterpret_cast<char *>(head), 8) == 8 &&
+        (len == 0 || writer(reinterpret_cast<const char *>(data), len)
+            == len) &&
+        writer(reinterpret_cast<char *>(tail), 4) == 4;
+}
+
+// png row i (0 is the top row) as big endian bytes
+template <typename I>
+static void raw_row(const I &rgba, int i, std::vector<png_byte> &,
+        png_byte *row) {
+    rgba.store_row(rgba.height()-1-i, row, row+1, row+2, row+3, 4);
+}
+
+template <typename I>
+static void raw_row(const I &rgba, int i, std::vector<png_uint_16> &tmp,
+        png_byte *row) {
+    png_uint_16 *t = tmp.data();
+    rgba.store_row(rgba.height()-1-i, t, t+1, t+2, t+3, 4);
+    for (size_t k = 0; k < tmp.size(); k++) {
+        row[2*k] = static_cast<png_byte>(t[k] >> 8);
+        row[2*k+1] = static_cast<png_byte>(t[k] & 0xff);
+    }
+}
+
+static int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+// filters row into out (filter type byte first), picking the filter
+// with the smallest sum of absolute values, as libpng does
+static void filter_row(const png_byte *row, const png_byte *prev,
+        size_t len, size_t bpp, png_byte *out, png_byte *candidate) {
+    unsigned long best = ~0UL;
+    for (int f = 0; f < 5; f++) {
+        png_byte *c = f == 0? out+1: candidate;
+        unsigned long sum = 0;
+        for (size_t k = 0; k < len; k++) {
+            int a = k >= bpp? row[k-bpp]: 0;
+            int b = prev[k];
+            int d = k >= bpp? prev[k-bpp]: 0;
+            int v = row[k];
+            switch (f) {
+                case 1: v -= a; break;
+                case 2: v -= b; break;
+                case 3: v -= (a + b) >> 1; break;
+                case 4: v -= paeth(a, b, d); break;
+            }
+            png_byte x = static_cast<png_byte>(v);
+            c[k] = x;
+            sum += x < 128? x: 256 - x;
+        }
+        if (sum < best) {
+            best = sum;
+            out[0] = static_cast<png_byte>(f);
+            if (f != 0) memcpy(out+1, candidate, len);
+        }
+    }
+}
+
+// filters and deflates png rows first to last-1. unless it is the last
+// stripe, the output ends with a sync flush rather than a final block,
+// so stripes can be concatenated into a single deflate stream
+template <typename T, typename I>
+static int deflate_stripe(const I &rgba, int first, int last, bool final,
+        std::string &out, uLong &adler) {
+    size_t len = size_t(rgba.width())*4*sizeof(T);
+    std::vector<png_byte> prev(len, 0), row(len), filtered(len+1),
+        candidate(len);
+    std::vector<T> tmp(size_t(rgba.width())*4);
+    // filters look at the row above, which belongs to another stripe
+    if (first > 0) raw_row(rgba, first-1, tmp, prev.data());
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // raw deflate: the zlib header and checksum are added once
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+            Z_FILTERED) != Z_OK) return 0;
+    adler = adler32(0L, NULL, 0);
+    png_byte buffer[1 << 16];
+    int ret = Z_OK;
+    for (int i = first; i < last && ret != Z_STREAM_ERROR; i++) {
+        raw_row(rgba, i, tmp, row.data());
+        filter_row(row.data(), prev.data(), len, 4*sizeof(T),
+            filtered.data(), candidate.data());
+        adler = adler32(adler, filtered.data(), static_cast<uInt>(len+1));
+        z.next_in = filtered.data();
+        z.avail_in = static_cast<uInt>(len+1);
+        int flush = i < last-1? Z_NO_FLUSH: (final? Z_FINISH: Z_SYNC_FLUSH);
+        do {
+            z.next_out = buffer;
+            z.avail_out = sizeof(buffer);
+            ret = deflate(&z, flush);
+            if (ret == Z_STREAM_ERROR) break;
+            out.append(reinterpret_cast<char *>(buffer),
+                sizeof(buffer) - z.avail_out);
+        } while (z.avail_out == 0);
+        prev.swap(row);
+    }
+    deflateEnd(&z);
+    return ret != Z_STREAM_ERROR && z.avail_in == 0;
+}
+
+// writes the same chunks as the libpng path, but deflates stripes of
+// rows on nthreads threads, pigz style
+template <typename T, typename W, typename I>
+static int write_parallel(W &writer, const I &rgba, int nthreads) {
+    int width = rgba.width(), height = rgba.height();
+    size_t rowbytes = size_t(width)*4*sizeof(T)+1;
+    int rows = static_cast<int>(std::max(size_t(1), STRIPE_BYTES/rowbytes));
+    int nstripes = (height + rows-1)/rows;
+    std::vector<std::string> out(nstripes);
+    std::vector<uLong> adler(nstripes);
+    std::vector<int> ok(nstripes, 0);
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int s = next++; s < nstripes; s = next++) {
+            int first = s*rows, last = std::min(height, first+rows);
+            try {
+                ok[s] = deflate_stripe<T>(rgba, first, last,
+                    s == nstripes-1, out[s], adler[s]);
+            } catch (std::bad_alloc &) {
+                ok[s] = 0;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int k = 1; k < std::min(nthreads, nstripes); k++) {
+        try {
+            threads.push_back(std::thread(work));
+        } catch (std::system_error &) {
+            break;
+        }
+    }
+    work();
+    for (size_t k = 0; k < threads.size(); k++) threads[k].join();
+    for (int s = 0; s < nstripes; s++) if (!ok[s]) return 0;
+    // zlib header, then the checksum of all stripes at the very end
+    uLong sum = adler[0];
+    for (int s = 1; s < nstripes; s++) {
+        int n = std::min(height, (s+1)*rows) - s*rows;
+        sum = adler32_combine(sum, adler[s], z_off_t(n)*z_off_t(rowbytes));
+    }
+    out[0].insert(0, "\x78\x9c", 2);
+    png_byte tail[4];
+    put32(sum, tail);
+    out[nstripes-1].append(reinterpret_cast<char *>(tail), 4);
+    // same metadata libpng writes for us in the serial path
+    static const png_byte signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    if (writer(reinterpret_cast<const char *>(signature), 8) != 8)
+        return 0;
+    png_byte ihdr[13];
+    put32(static_cast<unsigned long>(width), ihdr);
+    put32(static_cast<unsigned long>(height), ihdr+4);
+    ihdr[8] = static_cast<png_byte>(8*sizeof(T));
+    ihdr[9] = PNG_COLOR_TYPE_RGB_ALPHA;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    png_byte gama[4], chrm[32];
+    put32(45455, gama);
+    static const unsigned long xy[8] = { 31270, 32900, 64000, 33000,
+        30000, 60000, 15000, 6000 };
+    for (int k = 0; k < 8; k++) put32(xy[k], chrm+4*k);
+    png_byte srgb = PNG_sRGB_INTENT_RELATIVE;
+    if (!write_chunk(writer, "IHDR", ihdr, sizeof(ihdr)) ||
+        !write_chunk(writer, "gAMA", gama, sizeof(gama)) ||
+        !write_chunk(writer, "cHRM", chrm, sizeof(chrm)) ||
+        !write_chunk(writer, "sRGB", &srgb, 1)) return 0;
+    for (size_t k = 0; k < g_text.size(); k++) {
+        std::string text(g_text[k].key);
+        text.push_back('\0');
+        text.append(g_text[k].text);
+        if (!write_chunk(writer, "tEXt",
+            reinterpret_cast<const png_byte *>(text.data()), text.size()))
+            return 0;
+    }
+    for (int s = 0; s < nstripes; s++) {
+        if (!write_chunk(writer, "IDAT",
+            reinterpret_cast<const png_byte *>(out[s].data()),
+            out[s].size())) return 0;
+        out[s] = std::string();
+    }
+    return write_chunk(writer, "IEND", NULL, 0);
+}
+
 namespace pngio {
 
     void free_text(void) {
@@ -134,10 +311,21 @@ namespace pngio {
         }
     }
 
-    template <typename R> int load(R &reader, image::RGBA &rgba) {
+    void set_threads(int n) {
+        g_threads = n > 0? n: 0;
+    }
+
+    int threads(void) {
+        int n = g_threads;
+        if (n == 0) n = static_cast<int>(std::thread::hardware_concurrency());
+        return n > 0? n: 1;
+    }
+
+    template <typename R, typename I> int read(R &reader, I &rgba) {
         // temporary image storage
         png_uint_16 ** volatile row_pointers = NULL;
         png_uint_16 * volatile data = NULL;
+        png_byte * volatile row = NULL;
         // libpng structures
         png_structp png_ptr = NULL;
         png_infop info_ptr = NULL;
@@ -167,6 +355,7 @@ namespace pngio {
             png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
             free(row_pointers);
             free(data);
+            free(row);
             return 0;
         }
         png_set_read_fn(png_ptr, &reader, io_fn<R>);
@@ -178,28 +367,24 @@ namespace pngio {
         // get dimensions
         int height = png_get_image_height(png_ptr, info_ptr);
         int width = png_get_image_width(png_ptr, info_ptr);
-        // allocate temporary image buffer and row_pointers
-        data = reinterpret_cast<png_uint_16 *>(
-            malloc(height*width*4*sizeof(png_uint_16)));
-        row_pointers = reinterpret_cast<png_uint_16 **>(
-            malloc(height*sizeof(png_uint_16 *)));
-        // try to allocate output image
-        if (!data || !row_pointers) {
-            // might as well use the same error handling as libpng...
-            longjmp(png_jmpbuf(png_ptr), 1);
-        }
-        // set row pointers to flip image
-        for (int i = 0; i < height; i++) {
-            row_pointers[i] = &data[(height-1-i)*width*4];
-        }
         // set all transformations required to read from any
-        // format into RGBA16
+        // format into RGBA, at 8 bits per channel if the source
+        // has no more than that, else at 16
         int color_type = png_get_color_type(png_ptr, info_ptr);
         int bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+        // interlaced images need every pass in memory at once, so
+        // they still go through the whole image at 16 bits
+        bool interlaced =
+            png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
+        int depth = (bit_depth == 16 || interlaced)? 16: 8;
         if (color_type == PNG_COLOR_TYPE_PALETTE) {
             png_set_palette_to_rgb(png_ptr);
         }
 
+        if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
+            png_set_expand_gray_1_2_4_to_8(png_ptr);
+        }
+
         if (color_type == PNG_COLOR_TYPE_GRAY ||
             color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
             png_set_gray_to_rgb(png_ptr);
@@ -211,7 +396,7 @@ namespace pngio {
             png_set_add_alpha(png_ptr, 0xFFFF, PNG_FILLER_AFTER);
         }
 
-        if (bit_depth < 16) {
+        if (depth == 16 && bit_depth < 16) {
             png_set_expand_16(png_ptr);
         }
 
@@ -222,34 +407,73 @@ namespace pngio {
         // should we flip endianness?
         long int a = 1;
         int swap = (*((unsigned char *) &a) == 1);
-        if (swap) {
+        if (swap && depth == 16) {
             png_set_swap(png_ptr);
         }
-        // read image
-        png_read_image(png_ptr, (png_bytepp) row_pointers);
-        // save to image object
-        rgba.load(width, height, data, data+1, data+2, data+3, 4*width, 4);
+        if (!interlaced) {
+            // decode row by row straight into the image
+            png_read_update_info(png_ptr, info_ptr);
+            try {
+                rgba.resize(width, height);
+            } catch (std::bad_alloc &) {
+                longjmp(png_jmpbuf(png_ptr), 1);
+            }
+            row = reinterpret_cast<png_byte *>(
+                malloc(png_get_rowbytes(png_ptr, info_ptr)));
+            if (!row) longjmp(png_jmpbuf(png_ptr), 1);
+            for (int i = 0; i < height; i++) {
+                png_read_row(png_ptr, row, NULL);
+                if (depth == 8) {
+                    png_byte *r = row;
+                    rgba.load_row(height-1-i, r, r+1, r+2, r+3, 4);
+                } else {
+                    png_uint_16 *r = reinterpret_cast<png_uint_16 *>(row);
+                    rgba.load_row(height-1-i, r, r+1, r+2, r+3, 4);
+                }
+            }
+        } else {
+            // allocate temporary image buffer and row_pointers
+            data = reinterpret_cast<png_uint_16 *>(
+                malloc(height*width*4*sizeof(png_uint_16)));
+            row_pointers = reinterpret_cast<png_uint_16 **>(
+                malloc(height*sizeof(png_uint_16 *)));
+            // try to allocate output image
+            if (!data || !row_pointers) {
+                // might as well use the same error handling as libpng...
+                longjmp(png_jmpbuf(png_ptr), 1);
+            }
+            // set row pointers to flip image
+            for (int i = 0; i < height; i++) {
+                row_pointers[i] = &data[(height-1-i)*width*4];
+            }
+            // read image
+            png_read_image(png_ptr, (png_bytepp) row_pointers);
+            // save to image object
+            rgba.load(width, height, data, data+1, data+2, data+3,
+                4*width, 4);
+        }
         // finish advancing file pointer to end of stream (useful?)
         png_read_end(png_ptr, NULL);
         // clean-up and we are done
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         free(data);
         free(row_pointers);
+        free(row);
         return 1;
     }
 
-    int load(FILE *file, image::RGBA &rgba) {
+    template <typename I> int load(FILE *file, I &rgba) {
         FileReader reader(file);
-        return load(reader, rgba);
+        return read(reader, rgba);
     }
 
-    int load(const std::string &memory, image::RGBA &rgba) {
+    template <typename I> int load(const std::string &memory, I &rgba) {
         StringReader reader(memory);
-        return load(reader, rgba);
+        return read(reader, rgba);
     }
 
-    template <typename T, typename W>
-    int store(W &writer, const image::RGBA &rgba) {
+    template <typename T, typename W, typename I>
+    int write(W &writer, const I &rgba) {
         // temporary image storage
         T ** volatile row_pointers = NULL;
         T * volatile data = NULL;
@@ -318,24 +542,199 @@ namespace pngio {
         return 1;
     }
 
-    int store16(FILE *file, const image::RGBA &rgba) {
+    // large images go to the parallel encoder when there are cores
+    template <typename T, typename W, typename I>
+    int store(W &writer, const I &rgba) {
+        int nthreads = threads();
+        size_t bytes = size_t(rgba.width())*rgba.height()*4*sizeof(T);
+        if (nthreads > 1 && bytes >= 2*STRIPE_BYTES)
+            return write_parallel<T>(writer, rgba, nthreads);
+        return write<T>(writer, rgba);
+    }
+
+    template <typename I> int store16(FILE *file, const I &rgba) {
         FileWriter writer(file);
         return store<png_uint_16>(writer, rgba);
     }
 
-    int store16(std::string &memory, const image::RGBA &rgba) {
+    template <typename I> int store16(std::string &memory, const I &rgba) {
         StringWriter writer(memory);
         return store<png_uint_16>(writer, rgba);
     }
 
-    int store8(FILE *file, const image::RGBA &rgba) {
+    template <typename I> int store8(FILE *file, const I &rgba) {
         FileWriter writer(file);
         return store<png_byte>(writer, rgba);
     }
 
-    int store8(std::string &memory, const image::RGBA &rgba) {
+    template <typename I> int store8(std::string &memory, const I &rgba) {
         StringWriter writer(memory);
         return store<png_byte>(writer, rgba);
     }
 
+#define PNGIO_INSTANTIATE(F, A) \
+    template int load(FILE *, \
+        image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int load(const std::string &, \
+        image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int store16(FILE *, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int store16(std::string &, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int store8(FILE *, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int store8(std::string &, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &);
+IMAGE_FOR_EACH_RGBA(PNGIO_INSTANTIATE)
+#undef PNGIO_INSTANTIATE
+
+    template <typename T, typename W>
+    class rowstream final: public stream {
+    public:
+        rowstream(const W &writer, int width, int height):
+            m_writer(writer), m_width(width), m_height(height),
+            m_rows(STREAM_ROWS*width*4), m_queued(0), m_encoded(0),
+            m_ok(1), m_closed(false) {
+            m_thread = std::thread(&rowstream::encode, this);
+        }
+
+        ~rowstream() {
+            close();
+        }
+
+        int close(void) override {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!m_closed) {
+                m_closed = true;
+                m_ready.notify_one();
+                lock.unlock();
+                m_thread.join();
+                lock.lock();
+            }
+            return m_ok && m_queued == m_height;
+        }
+
+    protected:
+        void *acquire(int width, int height, int row) override {
+            if (width != m_width || row < 0 || row >= height)
+                return NULL;
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_closed || m_queued >= m_height) return NULL;
+            m_space.wait(lock, [this] {
+                return m_queued - m_encoded < STREAM_ROWS; });
+            // the encoder does not touch this slot until we queue it
+            return slot(m_queued);
+        }
+
+        int release(void) override {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_queued++;
+            m_ready.notify_one();
+            return m_ok;
+        }
+
+        int depth(void) const override {
+            return to_bit_depth<T>();
+        }
+
+    private:
+        T *slot(int row) {
+            return &m_rows[(row % STREAM_ROWS)*m_width*4];
+        }
+
+        // wait for the next queued row, or null if there will be none
+        T *next(void) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_ready.wait(lock, [this] {
+                return m_encoded < m_queued || m_closed; });
+            if (m_encoded < m_queued) return slot(m_encoded);
+            else return NULL;
+        }
+
+        // release the slot of the row we just encoded
+        void done(void) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_encoded++;
+            m_space.notify_one();
+        }
+
+        void encode(void) {
+            if (!encoderows()) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_ok = 0;
+                lock.unlock();
+                // keep draining so the renderer never blocks
+                while (next()) done();
+            }
+        }
+
+        int encoderows(void) {
+            // libpng structures
+            png_structp png_ptr = NULL;
+            png_infop info_ptr = NULL;
+            png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+                user_error_fn, user_warning_fn);
+            if (png_ptr) {
+                info_ptr = png_create_info_struct(png_ptr);
+            }
+            if (!png_ptr || !info_ptr) {
+                png_destroy_write_struct(&png_ptr, &info_ptr);
+                fprintf(stderr, "unable to allocate structures");
+                return 0;
+            }
+            // setup long jump for error return
+            if (setjmp(png_jmpbuf(png_ptr))) {
+                png_destroy_write_struct(&png_ptr, &info_ptr);
+                return 0;
+            }
+            png_set_write_fn(png_ptr, &m_writer, io_fn<W>, nullptr);
+            if (g_text.size() > 0)
+                png_set_text(png_ptr, info_ptr, &g_text[0],
+                    (int) g_text.size());
+            png_set_IHDR(png_ptr, info_ptr, m_width, m_height,
+                to_bit_depth<T>(), PNG_COLOR_TYPE_RGB_ALPHA,
+                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                PNG_FILTER_TYPE_DEFAULT);
+            png_set_sRGB_gAMA_and_cHRM(png_ptr, info_ptr,
+                PNG_sRGB_INTENT_RELATIVE);
+            png_write_info(png_ptr, info_ptr);
+            // should we flip endianness?
+            long int a = 1;
+            int swap = (*((unsigned char *) &a) == 1);
+            if (swap) {
+                png_set_swap(png_ptr);
+            }
+            for (int i = 0; i < m_height; i++) {
+                T *row = next();
+                // closed before all rows were queued
+                if (!row) longjmp(png_jmpbuf(png_ptr), 1);
+                png_write_row(png_ptr, (png_bytep) row);
+                done();
+            }
+            png_write_end(png_ptr, NULL);
+            png_destroy_write_struct(&png_ptr, &info_ptr);
+            return 1;
+        }
+
+        W m_writer;
+        int m_width, m_height;
+        std::vector<T> m_rows;
+        int m_queued, m_encoded;
+        int m_ok;
+        bool m_closed;
+        std::mutex m_mutex;
+        std::condition_variable m_ready, m_space;
+        std::thread m_thread;
+    };
+
+    stream *stream16(FILE *file, int width, int height) {
+        return new rowstream<png_uint_16, FileWriter>(FileWriter(file),
+            width, height);
+    }
+
+    stream *stream8(FILE *file, int width, int height) {
+        return new rowstream<png_byte, FileWriter>(FileWriter(file),
+            width, height);
+    }
+
 } // namespaces pngio
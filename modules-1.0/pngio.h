@@ -3,6 +3,7 @@
 
 #include <string>
 #include "image.h"
+#include "imageio.h"
 
 namespace pngio {
     // for png comments
@@ -10,15 +11,22 @@ namespace pngio {
     void init_text(int argc, char **argv);
     void push_text(const char *key, const char *text);
     void pop_text(int n = 1);
-    // load and store
-    int load(FILE *file, image::RGBA &rgba);
-    int load(const std::string &memory, image::RGBA &rgba);
+    // threads used to encode large images, 0 for one per core
+    void set_threads(int n);
+    int threads(void);
+    // load and store, for any image::basic_RGBA the modules support
+    template <typename I> int load(FILE *file, I &rgba);
+    template <typename I> int load(const std::string &memory, I &rgba);
     // output in 16-bit per channel
-    int store16(FILE *file, const image::RGBA &rgba);
-    int store16(std::string &memory, const image::RGBA &rgba);
+    template <typename I> int store16(FILE *file, const I &rgba);
+    template <typename I> int store16(std::string &memory, const I &rgba);
     // output in 8-bit per channel
-    int store8(FILE *file, const image::RGBA &rgba);
-    int store8(std::string &memory, const image::RGBA &rgba);
+    template <typename I> int store8(FILE *file, const I &rgba);
+    template <typename I> int store8(std::string &memory, const I &rgba);
+    // streaming output, one row at a time, encoded on another thread
+    typedef imageio::stream stream;
+    stream *stream16(FILE *file, int width, int height);
+    stream *stream8(FILE *file, int width, int height);
 
 } // namespace pngio
 
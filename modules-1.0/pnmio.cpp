@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "image.h"
+#include "pnmio.h"
+
+using imageio::FileReader;
+using imageio::FileWriter;
+using imageio::StringReader;
+using imageio::StringWriter;
+
+namespace {
+    template <typename T> int to_bit_depth(void);
+    template <> int to_bit_depth<unsigned char>(void) { return 8; }
+    template <> int to_bit_depth<unsigned short>(void) { return 16; }
+    template <> int to_bit_depth<float>(void) { return 32; }
+}
+
+static bool big_endian(void) {
+    unsigned short a = 1;
+    return *reinterpret_cast<unsigned char *>(&a) == 0;
+}
+
+// netpbm integer samples are big endian, pfm floats are whatever
+// the header says, and we always write them in host order
+static void put(unsigned char v, unsigned char *b) {
+    b[0] = v;
+}
+
+static void put(unsigned short v, unsigned char *b) {
+    b[0] = static_cast<unsigned char>(v >> 8);
+    b[1] = static_cast<unsigned char>(v & 0xff);
+}
+
+static void put(float v, unsigned char *b) {
+    memcpy(b, &v, sizeof(float));
+}
+
+// reads header tokens one byte at a time, skipping comments
+template <typename R> class tokenizer {
+public:
+    tokenizer(R &reader): m_reader(reader) { }
+
+    // consumes the single whitespace character that ends the token,
+    // so the samples start right after the last one
+    bool next(std::string &token) {
+        token.clear();
+        char c = 0;
+        for ( ;; ) {
+            if (m_reader(&c, 1) != 1) return false;
+            if (c == '#') {
+                while (m_reader(&c, 1) == 1 && c != '\n') ;
+                continue;
+            }
+            if (!isspace(static_cast<unsigned char>(c))) break;
+        }
+        do {
+            token.push_back(c);
+            if (token.size() > 64) return false;
+            if (m_reader(&c, 1) != 1) return true;
+        } while (!isspace(static_cast<unsigned char>(c)));
+        return true;
+    }
+
+    // positive integers only, which is all netpbm headers hold
+    bool next(int &value) {
+        std::string token;
+        if (!next(token)) return false;
+        char *end = NULL;
+        long v = strtol(token.c_str(), &end, 10);
+        if (*end || v <= 0 || v > INT_MAX) return false;
+        value = static_cast<int>(v);
+        return true;
+    }
+
+    bool next(double &value) {
+        std::string token;
+        if (!next(token)) return false;
+        char *end = NULL;
+        value = strtod(token.c_str(), &end);
+        return *end == '\0';
+    }
+
+private:
+    R &m_reader;
+};
+
+// reads height rows of width pixels, each with channels samples of
+// size bytes, and expands them to rgba in data with row 0 at the bottom
+template <typename T, typename R, typename S>
+int read_rows(R &reader, int width, int height, int channels, int size,
+        bool topdown, T opaque, S sample, std::vector<T> &data) {
+    std::vector<unsigned char> bytes(size_t(width)*channels*size);
+    data.resize(size_t(width)*height*4);
+    for (int i = 0; i < height; i++) {
+        if (reader(reinterpret_cast<char *>(bytes.data()), bytes.size())
+                != bytes.size()) {
+            fprintf(stderr, "unexpected end of file\n");
+            return 0;
+        }
+        T *row = &data[size_t(topdown? height-1-i: i)*width*4];
+        const unsigned char *b = bytes.data();
+        for (int j = 0; j < width; j++) {
+            T s[4] = { opaque, opaque, opaque, opaque };
+            for (int c = 0; c < channels; c++) {
+                s[c] = sample(b);
+                b += size;
+            }
+            if (channels == 2) s[3] = s[1]; // gray and alpha
+            if (channels <= 2) s[1] = s[2] = s[0];
+            if (channels == 1 || channels == 3) s[3] = opaque;
+            row[0] = s[0]; row[1] = s[1]; row[2] = s[2]; row[3] = s[3];
+            row += 4;
+        }
+    }
+    return 1;
+}
+
+template <typename T, typename W>
+class pnmstream final: public imageio::stream {
+public:
+    pnmstream(const W &writer, int width, int height, pnmio::kind k):
+        m_writer(writer), m_width(width), m_height(height),
+        m_channels(k == pnmio::PAM && to_bit_depth<T>() != 32? 4: 3),
+        m_row(size_t(width)*4), m_bytes(size_t(width)*m_channels*sizeof(T)),
+        m_written(0), m_closed(false) {
+        m_ok = header();
+    }
+
+    int close(void) override {
+        m_closed = true;
+        return m_ok && m_written == m_height;
+    }
+
+protected:
+    void *acquire(int width, int height, int row) override {
+        if (!m_ok || m_closed || m_written >= m_height) return NULL;
+        if (width != m_width || row < 0 || row >= height) return NULL;
+        return m_row.data();
+    }
+
+    int release(void) override {
+        unsigned char *b = m_bytes.data();
+        for (int j = 0; j < m_width; j++) {
+            for (int c = 0; c < m_channels; c++) {
+                put(m_row[4*j+c], b);
+                b += sizeof(T);
+            }
+        }
+        if (m_writer(reinterpret_cast<const char *>(m_bytes.data()),
+                m_bytes.size()) != m_bytes.size()) m_ok = 0;
+        m_written++;
+        return m_ok;
+    }
+
+    int depth(void) const override {
+        return to_bit_depth<T>();
+    }
+
+private:
+    int header(void) {
+        char text[256];
+        int len = 0;
+        if (to_bit_depth<T>() == 32) {
+            // a negative scale means little endian samples
+            len = snprintf(text, sizeof(text), "PF\n%d %d\n%s\n",
+                m_width, m_height, big_endian()? "1.0": "-1.0");
+        } else if (m_channels == 4) {
+            len = snprintf(text, sizeof(text), "P7\nWIDTH %d\nHEIGHT %d\n"
+                "DEPTH 4\nMAXVAL %d\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                m_width, m_height, (1 << to_bit_depth<T>())-1);
+        } else {
+            len = snprintf(text, sizeof(text), "P6\n%d %d\n%d\n",
+                m_width, m_height, (1 << to_bit_depth<T>())-1);
+        }
+        return m_writer(text, size_t(len)) == size_t(len);
+    }
+
+    W m_writer;
+    int m_width, m_height;
+    int m_channels;
+    std::vector<T> m_row;
+    std::vector<unsigned char> m_bytes;
+    int m_written;
+    int m_ok;
+    bool m_closed;
+};
+
+namespace pnmio {
+
+    template <typename R, typename I> int read(R &reader, I &rgba) {
+        char magic[2];
+        if (reader(magic, 2) != 2 || magic[0] != 'P') {
+            fprintf(stderr, "not a netpbm file\n");
+            return 0;
+        }
+        tokenizer<R> header(reader);
+        int width = 0, height = 0, channels = 0, maxval = 0;
+        bool ok = true;
+        if (magic[1] == '6') {
+            channels = 3;
+            ok = header.next(width) && header.next(height) &&
+                header.next(maxval);
+        } else if (magic[1] == '7') {
+            std::string key, value;
+            while ((ok = header.next(key)) && key != "ENDHDR") {
+                if (key == "WIDTH") ok = header.next(width);
+                else if (key == "HEIGHT") ok = header.next(height);
+                else if (key == "DEPTH") ok = header.next(channels);
+                else if (key == "MAXVAL") ok = header.next(maxval);
+                // depth alone tells us how to expand the samples
+                else if (key == "TUPLTYPE") ok = header.next(value);
+                else ok = false;
+                if (!ok) break;
+            }
+            ok = ok && width > 0 && height > 0 && channels > 0 &&
+                channels <= 4 && maxval > 0;
+        } else if (magic[1] == 'F' || magic[1] == 'f') {
+            double scale = 0.;
+            channels = magic[1] == 'F'? 3: 1;
+            if (!header.next(width) || !header.next(height) ||
+                !header.next(scale) || scale == 0.) {
+                fprintf(stderr, "invalid pfm header\n");
+                return 0;
+            }
+            // pfm rows go bottom to top, like ours
+            bool swap = (scale > 0.) != big_endian();
+            std::vector<float> data;
+            if (!read_rows(reader, width, height, channels, 4, false, 1.f,
+                [swap](const unsigned char *b) {
+                    unsigned char t[4] = { b[0], b[1], b[2], b[3] };
+                    if (swap) {
+                        std::swap(t[0], t[3]);
+                        std::swap(t[1], t[2]);
+                    }
+                    float f;
+                    memcpy(&f, t, sizeof(float));
+                    return f;
+                }, data)) return 0;
+            rgba.load(width, height, &data[0], &data[1], &data[2],
+                &data[3], 4*width, 4);
+            return 1;
+        } else {
+            fprintf(stderr, "not a binary ppm, pam, or pfm file\n");
+            return 0;
+        }
+        if (!ok || maxval > 65535) {
+            fprintf(stderr, "invalid netpbm header\n");
+            return 0;
+        }
+        // exact formats load without going through float
+        if (maxval == 255) {
+            std::vector<unsigned char> data;
+            if (!read_rows(reader, width, height, channels, 1, true,
+                (unsigned char) 255,
+                [](const unsigned char *b) { return b[0]; }, data))
+                return 0;
+            rgba.load(width, height, &data[0], &data[1], &data[2],
+                &data[3], 4*width, 4);
+        } else if (maxval == 65535) {
+            std::vector<unsigned short> data;
+            if (!read_rows(reader, width, height, channels, 2, true,
+                (unsigned short) 65535,
+                [](const unsigned char *b) {
+                    return static_cast<unsigned short>((b[0] << 8) | b[1]);
+                }, data)) return 0;
+            rgba.load(width, height, &data[0], &data[1], &data[2],
+                &data[3], 4*width, 4);
+        } else {
+            int size = maxval < 256? 1: 2;
+            float scale = 1.f/maxval;
+            std::vector<float> data;
+            if (!read_rows(reader, width, height, channels, size, true, 1.f,
+                [size, scale](const unsigned char *b) {
+                    int v = size == 1? b[0]: (b[0] << 8) | b[1];
+                    return scale*v;
+                }, data)) return 0;
+            rgba.load(width, height, &data[0], &data[1], &data[2],
+                &data[3], 4*width, 4);
+        }
+        return 1;
+    }
+
+    template <typename I> int load(FILE *file, I &rgba) {
+        FileReader reader(file);
+        return read(reader, rgba);
+    }
+
+    template <typename I> int load(const std::string &memory, I &rgba) {
+        StringReader reader(memory);
+        return read(reader, rgba);
+    }
+
+    // same as streaming every row, in the order the format wants
+    template <typename T, typename W, typename I>
+    int write(const W &writer, const I &rgba, kind k) {
+        pnmstream<T, W> s(writer, rgba.width(), rgba.height(), k);
+        bool bottomup = to_bit_depth<T>() == 32;
+        int height = rgba.height();
+        for (int i = 0; i < height; i++) {
+            if (!s.write(rgba, bottomup? i: height-1-i)) return 0;
+        }
+        return s.close();
+    }
+
+    template <typename I> int store16(FILE *file, const I &rgba, kind k) {
+        return write<unsigned short>(FileWriter(file), rgba, k);
+    }
+
+    template <typename I> int store16(std::string &memory, const I &rgba,
+            kind k) {
+        return write<unsigned short>(StringWriter(memory), rgba, k);
+    }
+
+    template <typename I> int store8(FILE *file, const I &rgba, kind k) {
+        return write<unsigned char>(FileWriter(file), rgba, k);
+    }
+
+    template <typename I> int store8(std::string &memory, const I &rgba,
+            kind k) {
+        return write<unsigned char>(StringWriter(memory), rgba, k);
+    }
+
+    template <typename I> int storef(FILE *file, const I &rgba) {
+        return write<float>(FileWriter(file), rgba, PPM);
+    }
+
+    template <typename I> int storef(std::string &memory, const I &rgba) {
+        return write<float>(StringWriter(memory), rgba, PPM);
+    }
+
+#define PNMIO_INSTANTIATE(F, A) \
+    template int load(FILE *, \
+        image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int load(const std::string &, \
+        image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int store16(FILE *, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &, kind); \
+    template int store16(std::string &, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &, kind); \
+    template int store8(FILE *, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &, kind); \
+    template int store8(std::string &, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &, kind); \
+    template int storef(FILE *, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int storef(std::string &, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &);
+IMAGE_FOR_EACH_RGBA(PNMIO_INSTANTIATE)
+#undef PNMIO_INSTANTIATE
+
+    stream *stream16(FILE *file, int width, int height, kind k) {
+        return new pnmstream<unsigned short, FileWriter>(FileWriter(file),
+            width, height, k);
+    }
+
+    stream *stream8(FILE *file, int width, int height, kind k) {
+        return new pnmstream<unsigned char, FileWriter>(FileWriter(file),
+            width, height, k);
+    }
+
+    stream *streamf(FILE *file, int width, int height) {
+        return new pnmstream<float, FileWriter>(FileWriter(file),
+            width, height, PPM);
+    }
+
+} // namespace pnmio
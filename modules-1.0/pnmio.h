@@ -0,0 +1,38 @@
+#ifndef PNMIO_H
+#define PNMIO_H
+
+#include <string>
+#include "image.h"
+#include "imageio.h"
+
+// uncompressed netpbm formats: nothing to deflate, so they are
+// much faster to write than png
+namespace pnmio {
+    // pam keeps alpha, ppm drops it
+    enum kind { PAM, PPM };
+    // loads binary ppm (P6), pam (P7), or pfm (PF and Pf)
+    template <typename I> int load(FILE *file, I &rgba);
+    template <typename I> int load(const std::string &memory, I &rgba);
+    // output in 16-bit per channel
+    template <typename I> int store16(FILE *file, const I &rgba,
+        kind k = PAM);
+    template <typename I> int store16(std::string &memory, const I &rgba,
+        kind k = PAM);
+    // output in 8-bit per channel
+    template <typename I> int store8(FILE *file, const I &rgba,
+        kind k = PAM);
+    template <typename I> int store8(std::string &memory, const I &rgba,
+        kind k = PAM);
+    // pfm output in 32-bit float per channel. pfm has no alpha
+    template <typename I> int storef(FILE *file, const I &rgba);
+    template <typename I> int storef(std::string &memory, const I &rgba);
+    // streaming output, one row at a time. rows are written as
+    // they come, so there is no encoder thread
+    typedef imageio::stream stream;
+    stream *stream16(FILE *file, int width, int height, kind k = PAM);
+    stream *stream8(FILE *file, int width, int height, kind k = PAM);
+    stream *streamf(FILE *file, int width, int height);
+
+} // namespace pnmio
+
+#endif // PNMIO_H
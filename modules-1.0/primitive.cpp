@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <utility>
+
+#include "primitive.h"
+
+namespace primitive {
+
+triangle::triangle(double x1, double y1, double x2, double y2,
+    double x3, double y3) {
+    double xs[4] = { x1, x2, x3, x1 }, ys[4] = { y1, y2, y3, y1 };
+    // each edge function is positive to the left of its edge
+    for (int i = 0; i < 3; i++) {
+        m_a[i] = ys[i]-ys[i+1];
+        m_b[i] = xs[i+1]-xs[i];
+        m_c[i] = -(m_a[i]*xs[i]+m_b[i]*ys[i]);
+    }
+    double area = (x2-x1)*(y3-y1)-(x3-x1)*(y2-y1);
+    m_orientation = area > 0.? 1: area < 0.? -1: 0;
+}
+
+int triangle::winding(double x, double y) {
+    for (int i = 0; i < 3; i++) {
+        double e = m_orientation*(m_a[i]*x+m_b[i]*y+m_c[i]);
+        if (e < 0.) return 0;
+        if (e == 0.) {
+            // the inside is to the left of, or above, the side
+            double a = m_orientation*m_a[i], b = m_orientation*m_b[i];
+            if (a > 0. || (a == 0. && b <= 0.)) return 0;
+        }
+    }
+    return m_orientation;
+}
+
+polygon::polygon(const std::vector<double> &xy):
+    m_next(0), m_started(false), m_y(0.) {
+    size_t n = xy.size()/2;
+    for (size_t i = 0; i < n; i++) {
+        double xa = xy[2*i], ya = xy[2*i+1];
+        double xb = xy[2*((i+1)%n)], yb = xy[2*((i+1)%n)+1];
+        // horizontal edges are never crossed
+        if (ya == yb) continue;
+        edge e;
+        e.dir = yb > ya? 1: -1;
+        if (yb < ya) {
+            std::swap(xa, xb);
+            std::swap(ya, yb);
+        }
+        e.ymin = ya; e.ymax = yb;
+        e.x0 = xa; e.y0 = ya;
+        e.dxdy = (xb-xa)/(yb-ya);
+        m_edges.push_back(e);
+    }
+    std::sort(m_edges.begin(), m_edges.end(),
+        [](const edge &a, const edge &b) { return a.ymin < b.ymin; });
+}
+
+void polygon::row(double y) {
+    if (!m_started || y < m_y) {
+        m_active.clear();
+        m_next = 0;
+    }
+    m_started = true;
+    m_y = y;
+    while (m_next < m_edges.size() && m_edges[m_next].ymin <= y) {
+        m_active.push_back(static_cast<int>(m_next++));
+    }
+    // edges are active within [ymin, ymax)
+    size_t k = 0;
+    for (size_t i = 0; i < m_active.size(); i++) {
+        if (m_edges[m_active[i]].ymax > y) m_active[k++] = m_active[i];
+    }
+    m_active.resize(k);
+    std::vector<std::pair<double, int>> crossings(m_active.size());
+    for (size_t i = 0; i < m_active.size(); i++) {
+        const edge &e = m_edges[m_active[i]];
+        crossings[i].first = e.x0+(y-e.y0)*e.dxdy;
+        crossings[i].second = e.dir;
+    }
+    std::sort(crossings.begin(), crossings.end());
+    m_xs.resize(crossings.size());
+    m_ws.resize(crossings.size());
+    int w = 0;
+    for (size_t i = crossings.size(); i-- > 0; ) {
+        w += crossings[i].second;
+        m_xs[i] = crossings[i].first;
+        m_ws[i] = w;
+    }
+}
+
+int polygon::winding(double x, double y) {
+    if (!m_started || y != m_y) row(y);
+    // crossings at or to the right of x count
+    size_t i = std::lower_bound(m_xs.begin(), m_xs.end(), x)-m_xs.begin();
+    return i < m_ws.size()? m_ws[i]: 0;
+}
+
+ellipse::ellipse(double a, double b, double c, double d, double e,
+    double f) {
+    double det = a*e-b*d;
+    m_orientation = det > 0.? 1: det < 0.? -1: 0;
+    if (m_orientation == 0) det = 1.;
+    m_ia = e/det; m_ib = -b/det;
+    m_id = -d/det; m_ie = a/det;
+    m_ic = -(m_ia*c+m_ib*f);
+    m_if = -(m_id*c+m_ie*f);
+}
+
+int ellipse::winding(double x, double y) {
+    double u = m_ia*x+m_ib*y+m_ic;
+    double v = m_id*x+m_ie*y+m_if;
+    return u*u+v*v < 1.? m_orientation: 0;
+}
+
+} // namespace primitive
@@ -0,0 +1,71 @@
+#ifndef PRIMITIVE_H
+#define PRIMITIVE_H
+
+#include <vector>
+
+// winding numbers of simple shapes, already in pixel coordinates,
+// without going through generic paths. they agree with crossing tests
+// that count the edges going up (+1) or down (-1) across a ray from
+// the point to the right, the point itself included, for rows within
+// [ymin, ymax) of each edge
+namespace primitive {
+    class shape {
+    public:
+        virtual ~shape() { }
+        virtual int winding(double x, double y) = 0;
+    };
+
+    // edge functions of the three sides. points on a side are inside
+    // when the side bounds the triangle from the right or from below,
+    // as the crossing tests would have it
+    class triangle: public shape {
+    public:
+        triangle(double x1, double y1, double x2, double y2,
+            double x3, double y3);
+        int winding(double x, double y);
+    private:
+        double m_a[3], m_b[3], m_c[3];
+        int m_orientation;
+    };
+
+    // closed polygon through vertices x1, y1, x2, y2, ... with edges
+    // sorted by ymin. consecutive samples on the same row reuse the
+    // sorted crossings of that row, and rows in increasing order keep
+    // an active edge list instead of starting over
+    class polygon: public shape {
+    public:
+        explicit polygon(const std::vector<double> &xy);
+        int winding(double x, double y);
+    private:
+        struct edge {
+            double ymin, ymax, x0, y0, dxdy;
+            int dir;
+        };
+        void row(double y);
+
+        std::vector<edge> m_edges;
+        std::vector<int> m_active;
+        size_t m_next;
+        bool m_started;
+        double m_y;
+        // crossings of row m_y in increasing x, and the winding
+        // number of a point just left of each
+        std::vector<double> m_xs;
+        std::vector<int> m_ws;
+    };
+
+    // image of the unit circle under the affine map
+    //   x = a*u + b*v + c, y = d*u + e*v + f
+    // tested by mapping points back to the unit circle
+    class ellipse: public shape {
+    public:
+        ellipse(double a, double b, double c, double d, double e,
+            double f);
+        int winding(double x, double y);
+    private:
+        double m_ia, m_ib, m_ic, m_id, m_ie, m_if;
+        int m_orientation;
+    };
+} // namespace primitive
+
+#endif // PRIMITIVE_H
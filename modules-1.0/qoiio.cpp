@@ -0,0 +1,302 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "image.h"
+#include "qoiio.h"
+
+using imageio::FileReader;
+using imageio::FileWriter;
+using imageio::StringReader;
+using imageio::StringWriter;
+
+// opcodes from the qoi specification
+static const unsigned char QOI_OP_INDEX = 0x00;
+static const unsigned char QOI_OP_DIFF = 0x40;
+static const unsigned char QOI_OP_LUMA = 0x80;
+static const unsigned char QOI_OP_RUN = 0xc0;
+static const unsigned char QOI_OP_RGB = 0xfe;
+static const unsigned char QOI_OP_RGBA = 0xff;
+static const unsigned char QOI_MASK = 0xc0;
+static const int QOI_MAX_RUN = 62;
+static const int QOI_HEADER_SIZE = 14;
+// same guard as the reference decoder
+static const size_t QOI_MAX_PIXELS = 400000000;
+static const unsigned char qoi_end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+struct pixel {
+    unsigned char r, g, b, a;
+};
+
+static bool same(const pixel &p, const pixel &q) {
+    return p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+}
+
+static int hash(const pixel &p) {
+    return (p.r*3 + p.g*5 + p.b*7 + p.a*11) % 64;
+}
+
+static void put32(unsigned long v, unsigned char *b) {
+    b[0] = static_cast<unsigned char>(v >> 24);
+    b[1] = static_cast<unsigned char>(v >> 16);
+    b[2] = static_cast<unsigned char>(v >> 8);
+    b[3] = static_cast<unsigned char>(v);
+}
+
+static unsigned long get32(const unsigned char *b) {
+    return (static_cast<unsigned long>(b[0]) << 24) |
+        (static_cast<unsigned long>(b[1]) << 16) |
+        (static_cast<unsigned long>(b[2]) << 8) | b[3];
+}
+
+// the decoder wants one byte at a time
+template <typename R> class bytereader {
+public:
+    bytereader(R &reader): m_reader(reader), m_pos(0), m_len(0) { }
+    bool get(unsigned char &b) {
+        if (m_pos == m_len) {
+            m_len = m_reader(reinterpret_cast<char *>(m_buffer),
+                sizeof(m_buffer));
+            m_pos = 0;
+            if (m_len == 0) return false;
+        }
+        b = m_buffer[m_pos++];
+        return true;
+    }
+private:
+    R &m_reader;
+    unsigned char m_buffer[4096];
+    size_t m_pos, m_len;
+};
+
+// encoder state carries over from row to row, so rows can be
+// encoded as they arrive
+template <typename W>
+class qoistream final: public imageio::stream {
+public:
+    qoistream(const W &writer, int width, int height):
+        m_writer(writer), m_width(width), m_height(height),
+        m_row(size_t(width)*4), m_run(0), m_written(0), m_closed(false) {
+        m_prev.r = m_prev.g = m_prev.b = 0;
+        m_prev.a = 255;
+        memset(m_index, 0, sizeof(m_index));
+        unsigned char header[QOI_HEADER_SIZE] = { 'q', 'o', 'i', 'f' };
+        put32(static_cast<unsigned long>(width), header+4);
+        put32(static_cast<unsigned long>(height), header+8);
+        header[12] = 4; // rgba
+        header[13] = 0; // srgb with linear alpha
+        m_ok = m_writer(reinterpret_cast<const char *>(header),
+            sizeof(header)) == sizeof(header);
+    }
+
+    int close(void) override {
+        if (!m_closed) {
+            m_closed = true;
+            if (m_ok && m_written == m_height) {
+                m_bytes.clear();
+                if (m_run > 0) m_bytes.push_back(QOI_OP_RUN | (m_run-1));
+                m_bytes.insert(m_bytes.end(), qoi_end, qoi_end+8);
+                m_ok = flush();
+            }
+        }
+        return m_ok && m_written == m_height;
+    }
+
+protected:
+    void *acquire(int width, int height, int row) override {
+        if (!m_ok || m_closed || m_written >= m_height) return NULL;
+        if (width != m_width || row < 0 || row >= height) return NULL;
+        return m_row.data();
+    }
+
+    int release(void) override {
+        m_bytes.clear();
+        for (int j = 0; j < m_width; j++) {
+            pixel p = { m_row[4*j], m_row[4*j+1], m_row[4*j+2],
+                m_row[4*j+3] };
+            encode(p);
+        }
+        m_ok = flush();
+        m_written++;
+        return m_ok;
+    }
+
+    int depth(void) const override {
+        return 8;
+    }
+
+private:
+    void encode(const pixel &p) {
+        if (same(p, m_prev)) {
+            if (++m_run == QOI_MAX_RUN) {
+                m_bytes.push_back(QOI_OP_RUN | (m_run-1));
+                m_run = 0;
+            }
+            return;
+        }
+        if (m_run > 0) {
+            m_bytes.push_back(QOI_OP_RUN | (m_run-1));
+            m_run = 0;
+        }
+        int k = hash(p);
+        if (same(m_index[k], p)) {
+            m_bytes.push_back(QOI_OP_INDEX | k);
+        } else {
+            m_index[k] = p;
+            if (p.a == m_prev.a) {
+                signed char vr = static_cast<signed char>(p.r - m_prev.r);
+                signed char vg = static_cast<signed char>(p.g - m_prev.g);
+                signed char vb = static_cast<signed char>(p.b - m_prev.b);
+                int vgr = vr - vg, vgb = vb - vg;
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 &&
+                    vb > -3 && vb < 2) {
+                    m_bytes.push_back(QOI_OP_DIFF |
+                        (vr+2) << 4 | (vg+2) << 2 | (vb+2));
+                } else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 &&
+                    vgb > -9 && vgb < 8) {
+                    m_bytes.push_back(QOI_OP_LUMA | (vg+32));
+                    m_bytes.push_back((vgr+8) << 4 | (vgb+8));
+                } else {
+                    unsigned char op[4] = { QOI_OP_RGB, p.r, p.g, p.b };
+                    m_bytes.insert(m_bytes.end(), op, op+4);
+                }
+            } else {
+                unsigned char op[5] = { QOI_OP_RGBA, p.r, p.g, p.b, p.a };
+                m_bytes.insert(m_bytes.end(), op, op+5);
+            }
+        }
+        m_prev = p;
+    }
+
+    int flush(void) {
+        if (m_bytes.empty()) return 1;
+        return m_writer(reinterpret_cast<const char *>(m_bytes.data()),
+            m_bytes.size()) == m_bytes.size();
+    }
+
+    W m_writer;
+    int m_width, m_height;
+    std::vector<unsigned char> m_row;
+    std::vector<unsigned char> m_bytes;
+    pixel m_prev;
+    pixel m_index[64];
+    int m_run;
+    int m_written;
+    int m_ok;
+    bool m_closed;
+};
+
+namespace qoiio {
+
+    template <typename R, typename I> int read(R &reader, I &rgba) {
+        unsigned char header[QOI_HEADER_SIZE];
+        if (reader(reinterpret_cast<char *>(header), sizeof(header)) !=
+                sizeof(header) || memcmp(header, "qoif", 4) != 0) {
+            fprintf(stderr, "not a QOI file\n");
+            return 0;
+        }
+        unsigned long width = get32(header+4), height = get32(header+8);
+        int channels = header[12];
+        if (width == 0 || height == 0 || width > 0x7fffffff ||
+            height > 0x7fffffff || height >= QOI_MAX_PIXELS/width ||
+            (channels != 3 && channels != 4)) {
+            fprintf(stderr, "invalid QOI header\n");
+            return 0;
+        }
+        int w = static_cast<int>(width), h = static_cast<int>(height);
+        std::vector<unsigned char> data(size_t(w)*h*4);
+        bytereader<R> in(reader);
+        pixel p = { 0, 0, 0, 255 };
+        pixel index[64];
+        memset(index, 0, sizeof(index));
+        int run = 0;
+        for (int i = 0; i < h; i++) {
+            // qoi rows go top to bottom
+            unsigned char *row = &data[size_t(h-1-i)*w*4];
+            for (int j = 0; j < w; j++) {
+                if (run > 0) {
+                    run--;
+                } else {
+                    unsigned char b1 = 0, b2 = 0;
+                    bool ok = in.get(b1);
+                    if (b1 == QOI_OP_RGB) {
+                        ok = ok && in.get(p.r) && in.get(p.g) && in.get(p.b);
+                    } else if (b1 == QOI_OP_RGBA) {
+                        ok = ok && in.get(p.r) && in.get(p.g) &&
+                            in.get(p.b) && in.get(p.a);
+                    } else if ((b1 & QOI_MASK) == QOI_OP_INDEX) {
+                        p = index[b1];
+                    } else if ((b1 & QOI_MASK) == QOI_OP_DIFF) {
+                        p.r += ((b1 >> 4) & 0x03) - 2;
+                        p.g += ((b1 >> 2) & 0x03) - 2;
+                        p.b += (b1 & 0x03) - 2;
+                    } else if ((b1 & QOI_MASK) == QOI_OP_LUMA) {
+                        ok = ok && in.get(b2);
+                        int vg = (b1 & 0x3f) - 32;
+                        p.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                        p.g += vg;
+                        p.b += vg - 8 + (b2 & 0x0f);
+                    } else {
+                        run = b1 & 0x3f;
+                    }
+                    if (!ok) {
+                        fprintf(stderr, "unexpected end of file\n");
+                        return 0;
+                    }
+                    index[hash(p)] = p;
+                }
+                row[4*j] = p.r;
+                row[4*j+1] = p.g;
+                row[4*j+2] = p.b;
+                row[4*j+3] = p.a;
+            }
+        }
+        rgba.load(w, h, &data[0], &data[1], &data[2], &data[3], 4*w, 4);
+        return 1;
+    }
+
+    template <typename I> int load(FILE *file, I &rgba) {
+        FileReader reader(file);
+        return read(reader, rgba);
+    }
+
+    template <typename I> int load(const std::string &memory, I &rgba) {
+        StringReader reader(memory);
+        return read(reader, rgba);
+    }
+
+    // same as streaming every row, top to bottom
+    template <typename W, typename I>
+    int write(const W &writer, const I &rgba) {
+        qoistream<W> s(writer, rgba.width(), rgba.height());
+        for (int i = rgba.height()-1; i >= 0; i--) {
+            if (!s.write(rgba, i)) return 0;
+        }
+        return s.close();
+    }
+
+    template <typename I> int store8(FILE *file, const I &rgba) {
+        return write(FileWriter(file), rgba);
+    }
+
+    template <typename I> int store8(std::string &memory, const I &rgba) {
+        return write(StringWriter(memory), rgba);
+    }
+
+#define QOIIO_INSTANTIATE(F, A) \
+    template int load(FILE *, \
+        image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int load(const std::string &, \
+        image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int store8(FILE *, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &); \
+    template int store8(std::string &, \
+        const image::basic_RGBA<image::F, image::alpha_mode::A> &);
+IMAGE_FOR_EACH_RGBA(QOIIO_INSTANTIATE)
+#undef QOIIO_INSTANTIATE
+
+    stream *stream8(FILE *file, int width, int height) {
+        return new qoistream<FileWriter>(FileWriter(file), width, height);
+    }
+
+} // namespace qoiio
@@ -0,0 +1,22 @@
+#ifndef QOIIO_H
+#define QOIIO_H
+
+#include <string>
+#include "image.h"
+#include "imageio.h"
+
+// the "quite ok image" format: lossless 8-bit rgba that encodes
+// in a single cheap pass, yet is often close to png in size
+namespace qoiio {
+    template <typename I> int load(FILE *file, I &rgba);
+    template <typename I> int load(const std::string &memory, I &rgba);
+    // qoi only has 8 bits per channel
+    template <typename I> int store8(FILE *file, const I &rgba);
+    template <typename I> int store8(std::string &memory, const I &rgba);
+    // streaming output, one row at a time, encoded as rows come
+    typedef imageio::stream stream;
+    stream *stream8(FILE *file, int width, int height);
+
+} // namespace qoiio
+
+#endif // QOIIO_H
@@ -0,0 +1,186 @@
+#include <cmath>
+
+#include "solve.h"
+
+namespace solve {
+
+int quadratic(double a, double b, double c, double delta, double ts[4]) {
+    b = b*.5;
+    if (delta >= 0) {
+        double d = std::sqrt(delta);
+        if (b > 0) {
+            double e = b+d;
+            ts[0] = -c; ts[1] = e; ts[2] = e; ts[3] = -a;
+        } else if (b < 0) {
+            double e = -b+d;
+            ts[0] = e; ts[1] = a; ts[2] = c; ts[3] = e;
+        } else if (std::fabs(a) > std::fabs(c)) {
+            ts[0] = d; ts[1] = a; ts[2] = -d; ts[3] = a;
+        } else {
+            ts[0] = -c; ts[1] = d; ts[2] = c; ts[3] = d;
+        }
+        return 2;
+    }
+    return 0;
+}
+
+int quadratic(double a, double b, double c, double ts[4]) {
+    double h = b*.5;
+    return quadratic(a, b, c, h*h-a*c, ts);
+}
+
+// same cases as quadratic, but every lane computes every case and
+// keeps the one it wants, so the loop has no branches to vectorize
+// around
+void quadratics(size_t n, const double *a, const double *b,
+    const double *c, int *counts, double *ts) {
+    for (size_t i = 0; i < n; i++) {
+        double ai = a[i], bi = b[i]*.5, ci = c[i];
+        double delta = bi*bi-ai*ci;
+        bool real = delta >= 0;
+        double d = std::sqrt(real? delta: 0.);
+        double ep = bi+d, en = -bi+d;
+        bool pos = bi > 0, neg = bi < 0;
+        bool big = std::fabs(ai) > std::fabs(ci);
+        double *r = ts+4*i;
+        r[0] = pos? -ci: neg? en: big? d: -ci;
+        r[1] = pos? ep: neg? ai: big? ai: d;
+        r[2] = pos? ep: neg? ci: big? -d: ci;
+        r[3] = pos? -ai: neg? en: big? ai: d;
+        counts[i] = real? 2: 0;
+    }
+}
+
+static double cubicroot(double x) {
+    double absx = std::fabs(x);
+    double value = absx != 0? std::exp(std::log(absx)/3): 0;
+    return x < 0? -value: value;
+}
+
+static double singleroothelper(double tilde_a, double bar_c, double bar_d,
+    double D) {
+    double sqrt_D = std::sqrt(-D);
+    double p;
+    if (bar_d < 0) {
+        p = cubicroot(.5*(-bar_d+std::fabs(tilde_a)*sqrt_D));
+    } else {
+        p = cubicroot(.5*(-bar_d-std::fabs(tilde_a)*sqrt_D));
+    }
+    return p - bar_c/p;
+}
+
+static void tripleroothelper(double bar_c, double bar_d, double sqrt_D,
+    double s, double r, double &first, double &second) {
+    static const double sqrt_3 = std::sqrt(3.);
+    double theta = std::fabs(std::atan2(s*sqrt_D, -bar_d))/3.;
+    double cos_theta = std::cos(theta);
+    double sin_theta = std::sin(theta);
+    double sqrt_bar_c = std::sqrt(std::fabs(bar_c));
+    double x1 = 2.*sqrt_bar_c*cos_theta;
+    double x3 = -sqrt_bar_c*(cos_theta+sqrt_3*sin_theta);
+    if (x1+x3 > 2.*r) {
+        first = x1; second = x3;
+    } else {
+        first = x3; second = x1;
+    }
+}
+
+static int roots(double ts[6], double t1, double s1, double t2, double s2,
+    double t3, double s3) {
+    ts[0] = t1; ts[1] = s1; ts[2] = t2; ts[3] = s2; ts[4] = t3; ts[5] = s3;
+    return 3;
+}
+
+int cubic(double a, double b, double c, double d, double ts[6]) {
+    b = b*(1./3.);
+    c = c*(1./3.);
+    double d1 = a*c-b*b;
+    double d2 = a*d-b*c;
+    double d3 = b*d-c*c;
+    double D = 4.*d1*d3-d2*d2;
+    if (D <= 0.) {
+        // triple root
+        if (d1 == 0. && d2 == 0. && d3 == 0.) {
+            if (std::fabs(a) > std::fabs(b)) {
+                if (std::fabs(a) > std::fabs(c)) {
+                    return roots(ts, -b, a, -b, a, -b, a);
+                } else {
+                    return roots(ts, -d, c, -d, c, -d, c);
+                }
+            } else if (std::fabs(b) > std::fabs(c)) {
+                return roots(ts, -c, b, -c, b, -c, b);
+            } else {
+                return roots(ts, -d, c, -d, c, -d, c);
+            }
+        }
+        if (b*b*b*d >= a*c*c*c) {
+            double bar_c = d1;
+            double bar_d = -2.*b*d1+a*d2;
+            double r1 = singleroothelper(a, bar_c, bar_d, D);
+            // double root
+            if (D == 0.) {
+                return roots(ts, r1-b, a, -0.5*r1-b, a, -0.5*r1-b, a);
+            }
+            ts[0] = r1-b; ts[1] = a;
+            return 1;
+        } else {
+            double bar_c = d3;
+            double bar_d = -d*d2+2.*c*d3;
+            double r1 = singleroothelper(d, bar_c, bar_d, D);
+            // double root
+            if (D == 0.) {
+                return roots(ts, -d, r1+c, -d, -0.5*r1+b, -d, -0.5*r1+b);
+            }
+            ts[0] = -d; ts[1] = r1+c;
+            return 1;
+        }
+    } else {
+        double sqrt_D = std::sqrt(D);
+        double bar_c_a = d1;
+        double bar_d_a = -2.*b*d1+a*d2;
+        double xl, xs, o;
+        tripleroothelper(bar_c_a, bar_d_a, sqrt_D, a, b, xl, o);
+        xl = xl-b;
+        double wl = a;
+        double bar_c_d = d3;
+        double bar_d_d = -d*d2+2.*c*d3;
+        tripleroothelper(bar_c_d, bar_d_d, sqrt_D, d, c, o, xs);
+        double ws = xs+c;
+        xs = -d;
+        double e = wl*ws;
+        double f = -xl*ws-wl*xs;
+        double g = xl*xs;
+        double xm = c*f-b*g;
+        double wm = -b*f+c*e;
+        return roots(ts, xs, ws, xm, wm, xl, wl);
+    }
+}
+
+void cubics(size_t n, const double *a, const double *b, const double *c,
+    const double *d, int *counts, double *ts) {
+    for (size_t i = 0; i < n; i++) {
+        counts[i] = cubic(a[i], b[i], c[i], d[i], ts+6*i);
+    }
+}
+
+size_t unitroots(size_t n, const double *a, const double *b,
+    const double *c, double *t) {
+    // solve in blocks small enough to live on the stack
+    const size_t BLOCK = 64;
+    int counts[BLOCK];
+    double ts[4*BLOCK];
+    size_t m = 0;
+    for (size_t first = 0; first < n; first += BLOCK) {
+        size_t k = n-first < BLOCK? n-first: BLOCK;
+        quadratics(k, a+first, b+first, c+first, counts, ts);
+        for (size_t i = 0; i < k; i++) {
+            if (counts[i] == 0) continue;
+            double t1 = ts[4*i]/ts[4*i+1], t2 = ts[4*i+2]/ts[4*i+3];
+            if (0 < t1 && t1 < 1) t[m++] = t1;
+            if (0 < t2 && t2 < 1) t[m++] = t2;
+        }
+    }
+    return m;
+}
+
+} // namespace solve
@@ -0,0 +1,35 @@
+#ifndef SOLVE_H
+#define SOLVE_H
+
+#include <cstddef>
+
+// real roots of quadratic and cubic equations, after Jim Blinn's
+// "How to Solve a Quadratic Equation" (Nov/Dec 2005) and "How to Solve
+// a Cubic Equation, Part 5" (May/Jun 2007). roots come back in
+// homogeneous form, so root i is ts[2*i]/ts[2*i+1]. the arithmetic is
+// the same, operation by operation, as quadratic.lua and cubic.lua
+namespace solve {
+    // roots of a*x^2 + b*x + c == 0, using delta = 1/4*b^2 - a*c
+    int quadratic(double a, double b, double c, double delta, double ts[4]);
+    int quadratic(double a, double b, double c, double ts[4]);
+    // roots of a*x^3 + b*x^2 + c*x + d == 0
+    int cubic(double a, double b, double c, double d, double ts[6]);
+
+    // n equations at once, coefficients one array per power. counts
+    // receives the number of roots of each, and ts 4 (or 6) entries
+    // per equation
+    void quadratics(size_t n, const double *a, const double *b,
+        const double *c, int *counts, double *ts);
+    void cubics(size_t n, const double *a, const double *b,
+        const double *c, const double *d, int *counts, double *ts);
+
+    // roots of n quadratics that fall in the open interval (0, 1),
+    // which is what curve splitting wants. degenerate equations give
+    // zero denominators, and their infinite or undefined roots are
+    // never in range. returns the number of roots written to t, which
+    // must have room for 2*n
+    size_t unitroots(size_t n, const double *a, const double *b,
+        const double *c, double *t);
+} // namespace solve
+
+#endif // SOLVE_H
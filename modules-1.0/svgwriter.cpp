@@ -0,0 +1,70 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "svgwriter.h"
+
+namespace svgwriter {
+
+int format(double v, char *buf) {
+    // coordinates are very often integers, which need no search
+    if (v == std::floor(v) && std::fabs(v) < 1e15) {
+        long long i = static_cast<long long>(v);
+        unsigned long long u = i < 0? -static_cast<unsigned long long>(i): i;
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = static_cast<char>('0'+u%10);
+            u /= 10;
+        } while (u > 0);
+        int k = 0;
+        if (i < 0) buf[k++] = '-';
+        while (n > 0) buf[k++] = digits[--n];
+        buf[k] = '\0';
+        return k;
+    }
+    // any decimal with up to 15 digits survives a round trip through a
+    // double, so the first precision that reads back is the shortest
+    int n = 0;
+    for (int p = 15; p <= 17; p++) {
+        n = snprintf(buf, FORMAT_SIZE, "%.*g", p, v);
+        if (p == 17 || std::strtod(buf, NULL) == v) break;
+    }
+    return n;
+}
+
+writer::writer(FILE *file, size_t size):
+    m_file(file), m_buffer(size > 0? size: 1), m_used(0), m_ok(true) {
+}
+
+bool writer::text(const char *s, size_t n) {
+    if (n > m_buffer.size()-m_used) {
+        flush();
+        // too large to be worth copying
+        if (n >= m_buffer.size()) {
+            if (fwrite(s, 1, n, m_file) != n) m_ok = false;
+            return m_ok;
+        }
+    }
+    memcpy(m_buffer.data()+m_used, s, n);
+    m_used += n;
+    return m_ok;
+}
+
+bool writer::number(double v) {
+    char buf[FORMAT_SIZE];
+    int n = format(v, buf);
+    return text(buf, static_cast<size_t>(n));
+}
+
+bool writer::flush(void) {
+    if (m_used > 0) {
+        if (fwrite(m_buffer.data(), 1, m_used, m_file) != m_used) {
+            m_ok = false;
+        }
+        m_used = 0;
+    }
+    return m_ok;
+}
+
+} // namespace svgwriter
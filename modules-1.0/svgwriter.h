@@ -0,0 +1,36 @@
+#ifndef SVGWRITER_H
+#define SVGWRITER_H
+
+#include <cstdio>
+#include <vector>
+
+// buffered text output for scene dumps. many small writes go into one
+// large buffer, which only reaches the file when it fills up or is
+// flushed. destroying a writer drops whatever was not flushed, since
+// the file may be gone by then
+namespace svgwriter {
+    // shortest decimal that reads back as v, and its length.
+    // buf must hold at least FORMAT_SIZE chars
+    const int FORMAT_SIZE = 32;
+    int format(double v, char *buf);
+
+    class writer {
+    public:
+        explicit writer(FILE *file, size_t size = 1 << 16);
+        // false once anything failed to reach the file
+        bool text(const char *s, size_t n);
+        bool number(double v);
+        bool flush(void);
+        bool ok(void) const { return m_ok; }
+    private:
+        writer(const writer &);
+        writer &operator=(const writer &);
+
+        FILE *m_file;
+        std::vector<char> m_buffer;
+        size_t m_used;
+        bool m_ok;
+    };
+} // namespace svgwriter
+
+#endif // SVGWRITER_H
@@ -0,0 +1,60 @@
+-- render bands of rows of one image with several threads, each running
+-- its own Lua state. the scene goes to each thread as a snapshot, and
+-- each thread prepares its own copy with the driver
+local parallel = require"parallel"
+local image = require"image"
+
+local _M = {}
+
+local BAND = 4 -- rows a thread takes from the queue at a time
+
+-- modules whose metatables can appear in a scene description
+local NAMES = { "arc", "circle", "color", "element", "paint", "path",
+    "polygon", "ramp", "scene", "triangle", "vector", "viewport", "window",
+    "xform" }
+
+local function metatables()
+    local metas = {}
+    for i, name in ipairs(NAMES) do
+        local meta = require(name).meta
+        metas[meta.name] = meta
+    end
+    return metas
+end
+
+-- what each thread runs in its new state: look for modules where we
+-- do, and get to work
+local WORKER = [[
+local worker, index, path, cpath, drivername, snapshot = ...
+package.path, package.cpath = path, cpath
+return require"bands".work(worker, drivername, snapshot)
+]]
+
+-- render all rows of outputimage, which must be unorm8, with n threads.
+-- drivername is the file of a driver with a function
+--   rows(scene, viewport, options)
+-- that prepares the scene and returns a function samplerow(i, img, ii)
+-- that renders row i of the viewport into row ii of img. scene,
+-- viewport, and options must be plain data: no functions or userdata
+function _M.render(n, drivername, outputimage, scene, viewport, options)
+    local snapshot = parallel.snapshot{ scene, viewport, options }
+    parallel.run(n, WORKER, outputimage, BAND, package.path, package.cpath,
+        drivername, snapshot)
+end
+
+-- runs in each thread
+function _M.work(worker, drivername, snapshot)
+    local driver = dofile(drivername)
+    local s = parallel.restore(snapshot, metatables())
+    local scene, viewport, options = s[1], s[2], s[3]
+    local samplerow = driver.rows(scene, viewport, options)
+    local rowimage = image.image(viewport[3]-viewport[1], 1, "unorm8")
+    for first, last in worker.next, worker do
+        for i = first, last do
+            samplerow(i, rowimage, 1)
+            worker:store(rowimage, 1, i)
+        end
+    end
+end
+
+return _M
@@ -0,0 +1,261 @@
+-- print help and exit
+local function help()
+    io.stderr:write([=[
+Usage:
+  lua batch.lua [options]
+where options are:
+  -jobs:<path>         read jobs from <path> (e.g. a fifo) instead of stdin
+  -workers:<number>    spread jobs over that many warm worker processes
+Each line of input describes one job, using the same syntax as process.lua
+  [options] <driver.lua> <input.rvg> <output-name>
+Empty lines and lines starting with # are ignored. Drivers, compiled
+inputs, and decoded textures are kept between jobs.
+]=])
+    os.exit()
+end
+
+local chronos = require"chronos"
+
+local unpack = table.unpack
+
+-- output formatted string to stderr
+local function stderr(...)
+    io.stderr:write(string.format(...))
+end
+
+-- quote a word for the shell that io.popen runs. windows file names
+-- cannot contain double quotes, and elsewhere single quotes keep
+-- everything but themselves as is
+local function shellquote(word)
+    if package.config:sub(1, 1) == "\\" then
+        return '"' .. word .. '"'
+    end
+    return "'" .. word:gsub("'", "'\\''") .. "'"
+end
+
+-- locals for jobs source and number of worker processes
+local jobsname, nworkers
+
+local options = {
+    { "^%-help", function(w)
+        if w then
+            help()
+            return true
+        else
+            return false
+        end
+    end },
+    { "^(%-jobs%:(.+))$", function(all, p)
+        if not p then return false end
+        jobsname = p
+        return true
+    end },
+    { "^(%-workers%:(%d+)(.*))$", function(all, n, e)
+        if not n then return false end
+        assert(e == "", "invalid option " .. all)
+        n = assert(tonumber(n), "invalid option " .. all)
+        assert(n >= 1, "invalid option " .. all)
+        nworkers = math.floor(n)
+        return true
+    end },
+}
+
+for i, argument in ipairs({...}) do
+    local recognized = false
+    for j, option in ipairs(options) do
+        if option[2](argument:match(option[1])) then
+            recognized = true
+            break
+        end
+    end
+    assert(recognized, "unrecognized option " .. argument)
+end
+
+local jobs = io.stdin
+if jobsname then
+    jobs = assert(io.open(jobsname, "r"))
+end
+
+-- with workers, we only forward each job line to one of them
+-- round-robin. each worker is this same script reading from a pipe,
+-- so it keeps its own caches warm across the jobs it receives
+if nworkers and nworkers > 1 then
+    local interpreter = arg and arg[-1] or "lua"
+    local script = arg and arg[0] or "batch.lua"
+    local workers = {}
+    for i = 1, nworkers do
+        workers[i] = assert(io.popen(string.format("%s %s",
+            shellquote(interpreter), shellquote(script)), "w"))
+    end
+    local njobs = 0
+    for line in jobs:lines() do
+        if line:match("%S") and not line:match("^%s*#") then
+            local worker = workers[njobs % nworkers + 1]
+            worker:write(line, "\n")
+            worker:flush()
+            njobs = njobs + 1
+        end
+    end
+    -- closing a pipe waits for its worker to finish
+    for i = 1, nworkers do
+        workers[i]:close()
+    end
+    if jobsname then jobs:close() end
+    return
+end
+
+-- drivers are loaded only once per name
+local drivers = {}
+local function loaddriver(drivername)
+    local driver = drivers[drivername]
+    if not driver then
+        driver = dofile(drivername)
+        assert(type(driver) == "table", "invalid driver")
+        drivers[drivername] = driver
+    end
+    return driver
+end
+
+-- textures are decoded only once per encoded string
+-- the decoded image is read-only during rendering, so it can be shared
+local function newimagecache(image)
+    local loaded = {}
+    local png = setmetatable({
+        load = function(data)
+            if type(data) ~= "string" then return image.png.load(data) end
+            local img = loaded[data]
+            if not img then
+                img = image.png.load(data)
+                loaded[data] = img
+            end
+            return img
+        end
+    }, { __index = image.png })
+    return setmetatable({ png = png }, { __index = image })
+end
+
+local function newbase64cache(base64)
+    local decoded = {}
+    return setmetatable({
+        decode = function(data)
+            local str = decoded[data]
+            if not str then
+                str = base64.decode(data)
+                decoded[data] = str
+            end
+            return str
+        end
+    }, { __index = base64 })
+end
+
+-- inputs are compiled only once per (driver, input) pair. they must be
+-- run again for each job because drivers modify the scene in place
+local inputs = {}
+local function loadinput(driver, drivername, inputname)
+    local key = drivername .. "\0" .. inputname
+    local chunk = inputs[key]
+    if not chunk then
+        local env = setmetatable({
+            image = newimagecache(driver.image),
+            base64 = newbase64cache(driver.base64),
+        }, { __index = driver })
+        chunk = assert(loadfile(inputname, "bt", env))
+        inputs[key] = chunk
+    end
+    return assert(chunk())
+end
+
+-- same viewport logic as in process.lua
+local function resizeviewport(driver, viewport, width, height)
+    local vxmin, vymin, vxmax, vymax = unpack(viewport)
+    local vwidth = vxmax-vxmin
+    local vheight = vymax-vymin
+    if width and not height then
+        assert(vwidth > 0, "empty viewport")
+        vheight = math.floor(vheight*width/vwidth+0.5)
+        assert(vheight > 0, "empty viewport")
+        vwidth = width
+    end
+    if height and not width then
+        assert(vheight > 0, "empty viewport")
+        vwidth = math.floor(vwidth*height/vheight+0.5)
+        assert(vwidth > 0, "empty viewport")
+        vheight = height
+    end
+    if height and width then
+        vwidth = width
+        vheight = height
+    end
+    return driver.viewport(0, 0, vwidth, vheight)
+end
+
+-- drivers call os.exit when they are done dumping debug output
+-- within a job, this only needs to end the job, not the service
+local jobexit = {}
+local osexit = os.exit
+
+local function runjob(arguments)
+    local width, height
+    local rejected = {}
+    local values = {}
+    for i, argument in ipairs(arguments) do
+        if argument:sub(1,1) == "-" then
+            local n = argument:match("^%-width%:(%d+)$")
+            local m = argument:match("^%-height%:(%d+)$")
+            if n then
+                width = math.floor(assert(tonumber(n)))
+            elseif m then
+                height = math.floor(assert(tonumber(m)))
+            else
+                rejected[#rejected+1] = argument
+            end
+        else
+            values[#values+1] = argument
+        end
+    end
+    local drivername, inputname, outputname = unpack(values, 1, 3)
+    assert(drivername, "missing <driver.lua> argument")
+    assert(inputname, "missing <input.rvg> argument")
+    assert(outputname, "missing <output-name> argument")
+    local time = chronos.chronos()
+    local driver = loaddriver(drivername)
+    local input = loadinput(driver, drivername, inputname)
+    local viewport = resizeviewport(driver, input.viewport, width, height)
+    local scene = input.scene:windowviewport(input.window, viewport)
+    local loaded = time:elapsed()
+    local output = assert(io.open(outputname, "wb"))
+    os.exit = function() error(jobexit, 0) end
+    local ok, err = pcall(driver.render, scene, viewport, output, rejected)
+    os.exit = osexit
+    output:close()
+    if not ok and err ~= jobexit then
+        os.remove(outputname)
+        error(err, 0)
+    end
+    return loaded, time:elapsed()
+end
+
+local njobs, nfailed = 0, 0
+local total = chronos.chronos()
+for line in jobs:lines() do
+    if line:match("%S") and not line:match("^%s*#") then
+        local arguments = {}
+        for word in line:gmatch("%S+") do
+            arguments[#arguments+1] = word
+        end
+        njobs = njobs + 1
+        local ok, loaded, elapsed = pcall(runjob, arguments)
+        -- the collector cannot see how large image buffers are, so
+        -- hand the ones this job dropped back to the pool right away
+        collectgarbage()
+        if ok then
+            stderr("job %d: %s in %.3fs (load %.3fs)\n", njobs, line,
+                elapsed, loaded)
+        else
+            nfailed = nfailed + 1
+            stderr("job %d: %s failed: %s\n", njobs, line, tostring(loaded))
+        end
+    end
+end
+if jobsname then jobs:close() end
+stderr("%d jobs (%d failed) in %.3fs\n", njobs, nfailed, total:elapsed())
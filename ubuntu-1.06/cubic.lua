@@ -197,4 +197,10 @@ test111(1, 2, 3)
 test111(-1, 0, 0)
 ]]
 
+-- the native solver gives the same roots, bit for bit
+local native, solve = pcall(require, "solve")
+if native then
+    _M.cubic = solve.cubic
+end
+
 return _M
@@ -29,4 +29,29 @@ function _M.quadratic(a, b, c, delta)
     end
 end
 
+-- appends to t the roots in the open interval (0,1) of each equation
+-- a*x^2 + b*x + c == 0 in coefs = {a1, b1, c1, a2, b2, c2, ...}
+-- returns t and the number of roots appended
+function _M.unitroots(coefs, t)
+    t = t or {}
+    local m = #t
+    for i = 1, #coefs, 3 do
+        local n, t1, s1, t2, s2 = _M.quadratic(coefs[i], coefs[i+1],
+            coefs[i+2])
+        if n ~= 0 then
+            t1, t2 = t1/s1, t2/s2
+            if 0 < t1 and t1 < 1 then t[#t+1] = t1 end
+            if 0 < t2 and t2 < 1 then t[#t+1] = t2 end
+        end
+    end
+    return t, #t - m
+end
+
+-- the native solver gives the same roots, bit for bit
+local native, solve = pcall(require, "solve")
+if native then
+    _M.quadratic = solve.quadratic
+    _M.unitroots = solve.unitroots
+end
+
 return _M